@@ -0,0 +1,311 @@
+/* This file is part of Elfuse. */
+
+/* Elfuse is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or */
+/* (at your option) any later version. */
+
+/* Elfuse is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the */
+/* GNU General Public License for more details. */
+
+/* You should have received a copy of the GNU General Public License */
+/* along with Elfuse.  If not, see <http://www.gnu.org/licenses/>. */
+
+/* Workloads of `make bench', run against a mount of bench/elfuse-bench.el
+ * by elfuse-bench-batch:
+ *
+ *   bench/bench-fs MOUNTPATH [SCALE]
+ *
+ * SCALE multiplies the number of operations (default 1). Each workload
+ * prints a tab-separated line: its name, operations, failed operations,
+ * seconds, operations per second, p50 and p99 latency in microseconds and
+ * MiB/s, after a header line starting with #. Exits with 1 if anything
+ * failed. */
+
+#define _XOPEN_SOURCE 700
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DIR_ENTRIES 10000
+#define BIG_SIZE (100L * 1024 * 1024)
+#define SEQ_READ_SIZE (128 * 1024)
+#define RANDOM_READ_SIZE 4096
+#define SMALL_WRITE_SIZE 1024
+/* Writes per file, the reference handlers copy a file on each write */
+#define WRITES_PER_FILE 64
+
+struct workload {
+    const char *name;
+    long ops;
+    uint64_t *latencies;
+    long recorded;
+    uint64_t bytes;
+    uint64_t start_ns;
+    int failed;
+};
+
+static const char *mountpath;
+static int failed = 0;
+static uint64_t random_state = 88172645463325252ULL;
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* xorshift64, the same sequence on every run */
+static uint64_t
+random_next(void)
+{
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 7;
+    random_state ^= random_state << 17;
+    return random_state;
+}
+
+static void
+path_of(char *path, size_t size, const char *format, long n)
+{
+    int length = snprintf(path, size, "%s/", mountpath);
+    snprintf(path + length, size - length, format, n);
+}
+
+static void
+workload_start(struct workload *workload, const char *name, long ops)
+{
+    workload->name = name;
+    workload->ops = ops;
+    workload->latencies = malloc((ops > 0 ? ops : 1) * sizeof(workload->latencies[0]));
+    workload->recorded = 0;
+    workload->bytes = 0;
+    workload->failed = 0;
+    if (workload->latencies == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    workload->start_ns = now_ns();
+}
+
+static void
+workload_record(struct workload *workload, uint64_t start_ns, long res)
+{
+    if (res < 0) {
+        if (workload->failed++ == 0)
+            fprintf(stderr, "%s: %s\n", workload->name, strerror(-res));
+        return;
+    }
+    workload->bytes += res;
+    if (workload->recorded < workload->ops)
+        workload->latencies[workload->recorded++] = now_ns() - start_ns;
+}
+
+static int
+compare(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+static void
+workload_report(struct workload *workload)
+{
+    double seconds = (now_ns() - workload->start_ns) / 1e9;
+    long n = workload->recorded;
+    qsort(workload->latencies, n, sizeof(workload->latencies[0]), compare);
+    double p50 = n > 0 ? workload->latencies[(n - 1) * 50 / 100] / 1e3 : 0;
+    double p99 = n > 0 ? workload->latencies[(n - 1) * 99 / 100] / 1e3 : 0;
+
+    printf("%s\t%ld\t%d\t%.3f\t%.1f\t%.1f\t%.1f\t%.1f\n", workload->name, n, workload->failed,
+           seconds, n / seconds, p50, p99, workload->bytes / seconds / (1024 * 1024));
+    fflush(stdout);
+    failed |= workload->failed > 0;
+    free(workload->latencies);
+}
+
+static void
+bench_stat(long ops)
+{
+    struct workload workload;
+    workload_start(&workload, "stat", ops);
+    for (long i = 0; i < ops; i++) {
+        char path[4096];
+        struct stat stbuf;
+        path_of(path, sizeof(path), "dir/f%05ld", random_next() % DIR_ENTRIES);
+        uint64_t start_ns = now_ns();
+        workload_record(&workload, start_ns, stat(path, &stbuf) == 0 ? 0 : -errno);
+    }
+    workload_report(&workload);
+}
+
+/* opendir, readdir and lstat of every entry, like ls -l */
+static void
+bench_ls(long ops)
+{
+    struct workload workload;
+    workload_start(&workload, "ls-l", ops);
+    char dir[4096];
+    path_of(dir, sizeof(dir), "dir", 0);
+    for (long i = 0; i < ops; i++) {
+        uint64_t start_ns = now_ns();
+        DIR *stream = opendir(dir);
+        if (stream == NULL) {
+            workload_record(&workload, start_ns, -errno);
+            continue;
+        }
+        long entries = 0;
+        int res = 0;
+        for (struct dirent *entry; (entry = readdir(stream)) != NULL; entries++) {
+            struct stat stbuf;
+            if (fstatat(dirfd(stream), entry->d_name, &stbuf, AT_SYMLINK_NOFOLLOW) != 0)
+                res = -errno;
+        }
+        closedir(stream);
+        if (res == 0 && entries != DIR_ENTRIES + 2)
+            res = -EIO;
+        workload_record(&workload, start_ns, res);
+    }
+    workload_report(&workload);
+}
+
+static void
+bench_seq_read(long passes)
+{
+    char path[4096];
+    path_of(path, sizeof(path), "big", 0);
+    char *buffer = malloc(SEQ_READ_SIZE);
+
+    struct workload workload;
+    workload_start(&workload, "seq-read", passes * (BIG_SIZE / SEQ_READ_SIZE + 1));
+    for (long pass = 0; pass < passes; pass++) {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            workload_record(&workload, 0, -errno);
+            continue;
+        }
+        for (;;) {
+            uint64_t start_ns = now_ns();
+            ssize_t res = read(fd, buffer, SEQ_READ_SIZE);
+            workload_record(&workload, start_ns, res < 0 ? -errno : res);
+            if (res <= 0)
+                break;
+        }
+        close(fd);
+    }
+    workload_report(&workload);
+    free(buffer);
+}
+
+static void
+bench_random_read(long ops)
+{
+    char path[4096];
+    path_of(path, sizeof(path), "big", 0);
+    char buffer[RANDOM_READ_SIZE];
+
+    struct workload workload;
+    workload_start(&workload, "random-read", ops);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        workload_record(&workload, 0, -errno);
+    } else {
+        for (long i = 0; i < ops; i++) {
+            off_t offset = (random_next() % (BIG_SIZE / RANDOM_READ_SIZE)) * RANDOM_READ_SIZE;
+            uint64_t start_ns = now_ns();
+            ssize_t res = pread(fd, buffer, sizeof(buffer), offset);
+            workload_record(&workload, start_ns, res < 0 ? -errno : res);
+        }
+        close(fd);
+    }
+    workload_report(&workload);
+}
+
+static void
+bench_small_writes(long ops)
+{
+    char buffer[SMALL_WRITE_SIZE];
+    memset(buffer, 'w', sizeof(buffer));
+
+    struct workload workload;
+    workload_start(&workload, "small-write", ops);
+    int fd = -1;
+    for (long i = 0; i < ops; i++) {
+        if (i % WRITES_PER_FILE == 0) {
+            if (fd >= 0)
+                close(fd);
+            char path[4096];
+            path_of(path, sizeof(path), "scratch/w%ld", i / WRITES_PER_FILE);
+            fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0) {
+                workload_record(&workload, 0, -errno);
+                break;
+            }
+        }
+        uint64_t start_ns = now_ns();
+        ssize_t res = write(fd, buffer, sizeof(buffer));
+        workload_record(&workload, start_ns, res < 0 ? -errno : res);
+    }
+    if (fd >= 0)
+        close(fd);
+    workload_report(&workload);
+
+    for (long i = 0; i <= (ops - 1) / WRITES_PER_FILE; i++) {
+        char path[4096];
+        path_of(path, sizeof(path), "scratch/w%ld", i);
+        unlink(path);
+    }
+}
+
+/* Create, close and unlink a file */
+static void
+bench_churn(long ops)
+{
+    struct workload workload;
+    workload_start(&workload, "create-unlink", ops);
+    for (long i = 0; i < ops; i++) {
+        char path[4096];
+        path_of(path, sizeof(path), "scratch/c%ld", i);
+        uint64_t start_ns = now_ns();
+        int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+        int res = fd < 0 ? -errno : 0;
+        if (fd >= 0 && close(fd) != 0)
+            res = -errno;
+        if (res == 0 && unlink(path) != 0)
+            res = -errno;
+        workload_record(&workload, start_ns, res);
+    }
+    workload_report(&workload);
+}
+
+int
+main(int argc, char *argv[])
+{
+    double scale = argc > 2 ? atof(argv[2]) : 1;
+    if (argc < 2 || scale <= 0) {
+        fprintf(stderr, "Usage: %s MOUNTPATH [SCALE]\n", argv[0]);
+        return 2;
+    }
+    mountpath = argv[1];
+
+    printf("# workload\tops\terrors\tseconds\tops/s\tp50-us\tp99-us\tMiB/s\n");
+    bench_stat(100000 * scale);
+    bench_ls(20 * scale + 1);
+    bench_seq_read(scale < 1 ? 1 : scale);
+    bench_random_read(20000 * scale);
+    bench_small_writes(20000 * scale);
+    bench_churn(5000 * scale);
+    return failed;
+}
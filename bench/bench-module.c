@@ -0,0 +1,224 @@
+/* This file is part of Elfuse. */
+
+/* Elfuse is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or */
+/* (at your option) any later version. */
+
+/* Elfuse is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the */
+/* GNU General Public License for more details. */
+
+/* You should have received a copy of the GNU General Public License */
+/* along with Elfuse.  If not, see <http://www.gnu.org/licenses/>. */
+
+/* Time the round trip of requests through elfuse-module.o: marshalling
+ * the arguments, calling the handler and unmarshalling its results. The
+ * handlers are C functions returning prebuilt values and Emacs is
+ * bench/mock-env.c, so what's measured is the module's own overhead.
+ *
+ *   bench/bench-module [SCALE]
+ *
+ * SCALE multiplies the number of iterations (default 1). */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../emacs-module.h"
+#include "../elfuse-fuse.h"
+#include "mock-env.h"
+#include "mock-fuse.h"
+
+#define DIR_ENTRIES 10000
+#define READ_SIZE (128 * 1024)
+
+static emacs_value getattr_result;
+static emacs_value readdir_names;
+static emacs_value readdir_attrs;
+static emacs_value read_result;
+
+static emacs_value
+bench_getattr(emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+{
+    (void) env; (void) nargs; (void) args; (void) data;
+    return getattr_result;
+}
+
+static emacs_value
+bench_readdir(emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+{
+    (void) env; (void) nargs; (void) data;
+
+    /* "/attrs" lists files with their attributes */
+    char path[16];
+    ptrdiff_t size = sizeof(path);
+    if (env->copy_string_contents(env, args[0], path, &size) && strcmp(path, "/attrs") == 0)
+        return readdir_attrs;
+    return readdir_names;
+}
+
+static emacs_value
+bench_read(emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+{
+    (void) env; (void) nargs; (void) args; (void) data;
+    return read_result;
+}
+
+static void
+prepare(emacs_env *env)
+{
+    emacs_value Qvector = env->intern(env, "vector");
+    emacs_value Qlist = env->intern(env, "list");
+    emacs_value Qfile = env->intern(env, "file");
+
+    emacs_value attr[] = { Qfile, env->make_integer(env, 1234) };
+    getattr_result = env->make_global_ref(env, env->funcall(env, Qvector, 2, attr));
+
+    emacs_value *names = malloc(DIR_ENTRIES * sizeof(emacs_value));
+    emacs_value *attrs = malloc(DIR_ENTRIES * sizeof(emacs_value));
+    for (int i = 0; i < DIR_ENTRIES; i++) {
+        char name[32];
+        int length = snprintf(name, sizeof(name), "file-%05d.txt", i);
+        names[i] = env->make_string(env, name, length);
+        emacs_value entry[] = { names[i], Qfile, env->make_integer(env, i) };
+        attrs[i] = env->funcall(env, Qlist, 3, entry);
+    }
+    readdir_names = env->make_global_ref(env, env->funcall(env, Qvector, DIR_ENTRIES, names));
+    readdir_attrs = env->make_global_ref(env, env->funcall(env, Qvector, DIR_ENTRIES, attrs));
+    free(names);
+    free(attrs);
+
+    char *contents = malloc(READ_SIZE);
+    memset(contents, 'x', READ_SIZE);
+    read_result = env->make_global_ref(env, env->make_string(env, contents, READ_SIZE));
+    free(contents);
+
+    mock_env_reset();
+}
+
+static double
+now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* Hand a request to the module, like a FUSE thread would, and clean up
+ * after it */
+static void
+roundtrip(struct elfuse_mount *mount, struct elfuse_call_state *call)
+{
+    mock_enqueue(mount, call);
+    mock_call("elfuse--check-ops", 0, NULL);
+    if (!call->done || call->response_state != RESPONSE_SUCCESS) {
+        fprintf(stderr, "request %d failed (%d)\n", call->request_state, call->response_state);
+        exit(1);
+    }
+
+    if (call->request_state == WAITING_READDIR) {
+        for (size_t i = 0; i < call->results.readdir.entries_size; i++)
+            free(call->results.readdir.entries[i].name);
+        free(call->results.readdir.entries);
+    } else if (call->request_state == WAITING_READ) {
+        free(call->results.read.data);
+    }
+    mock_env_reset();
+}
+
+static void
+report(const char *name, long iterations, double seconds, const char *unit, double units)
+{
+    printf("%-18s %9ld %12.0f ns/op", name, iterations, seconds * 1e9 / iterations);
+    if (unit != NULL)
+        printf(" %12.1f %s", units * iterations / seconds, unit);
+    printf("\n");
+}
+
+static void
+bench_request(struct elfuse_mount *mount, const char *name, long iterations,
+              struct elfuse_call_state *request, const char *unit, double units)
+{
+    /* Warm up */
+    for (long i = 0; i < iterations / 10 + 1; i++) {
+        struct elfuse_call_state call = *request;
+        roundtrip(mount, &call);
+    }
+
+    double start = now();
+    for (long i = 0; i < iterations; i++) {
+        struct elfuse_call_state call = *request;
+        roundtrip(mount, &call);
+    }
+    report(name, iterations, now() - start, unit, units);
+}
+
+int
+main(int argc, char *argv[])
+{
+    double scale = argc > 1 ? atof(argv[1]) : 1;
+    if (scale <= 0) {
+        fprintf(stderr, "Usage: %s [SCALE]\n", argv[0]);
+        return 2;
+    }
+
+    if (emacs_module_init(mock_runtime()) != 0) {
+        fprintf(stderr, "emacs_module_init failed\n");
+        return 1;
+    }
+    emacs_env *env = mock_env();
+    prepare(env);
+
+    emacs_value path = env->make_global_ref(env, env->make_string(env, "/bench", 6));
+    emacs_value Umount = mock_call("elfuse--mount", 1, &path);
+    if (!env->is_not_nil(env, Umount)) {
+        fprintf(stderr, "elfuse--mount failed\n");
+        return 1;
+    }
+    Umount = env->make_global_ref(env, Umount);
+    struct elfuse_mount *mount = mock_last_mount();
+
+    struct {
+        const char *op;
+        emacs_value (*function)(emacs_env *, ptrdiff_t, emacs_value[], void *);
+        ptrdiff_t arity;
+    } handlers[] = {
+        { "getattr", bench_getattr, 1 },
+        { "readdir", bench_readdir, 1 },
+        { "read", bench_read, 3 },
+    };
+    for (size_t i = 0; i < sizeof(handlers) / sizeof(handlers[0]); i++) {
+        emacs_value args[] = {
+            Umount,
+            env->intern(env, handlers[i].op),
+            env->make_function(env, handlers[i].arity, handlers[i].arity, handlers[i].function, NULL, NULL),
+        };
+        mock_call("elfuse--register-op", 3, args);
+    }
+    mock_env_reset();
+
+    printf("%-18s %9s %15s\n", "request", "count", "time");
+
+    struct elfuse_call_state getattr = { .request_state = WAITING_GETATTR };
+    getattr.args.getattr.path = "/file";
+    bench_request(mount, "getattr", 200000 * scale, &getattr, NULL, 0);
+
+    struct elfuse_call_state readdir = { .request_state = WAITING_READDIR };
+    readdir.args.readdir.path = "/names";
+    bench_request(mount, "readdir 10k names", 200 * scale, &readdir, "entries/s", DIR_ENTRIES);
+    readdir.args.readdir.path = "/attrs";
+    bench_request(mount, "readdir 10k attrs", 200 * scale, &readdir, "entries/s", DIR_ENTRIES);
+
+    struct elfuse_call_state read = { .request_state = WAITING_READ };
+    read.args.read.path = "/file";
+    read.args.read.size = READ_SIZE;
+    bench_request(mount, "read 128KiB", 20000 * scale, &read, "MiB/s", READ_SIZE / 1048576.0);
+
+    mock_call("elfuse--stop", 1, &Umount);
+    return 0;
+}
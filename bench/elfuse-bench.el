@@ -0,0 +1,218 @@
+;; This file is part of Elfuse.
+
+;; Elfuse is free software: you can redistribute it and/or modify
+;; it under the terms of the GNU General Public License as published by
+;; the Free Software Foundation, either version 3 of the License, or
+;; (at your option) any later version.
+
+;; Elfuse is distributed in the hope that it will be useful,
+;; but WITHOUT ANY WARRANTY; without even the implied warranty of
+;; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+;; GNU General Public License for more details.
+
+;; You should have received a copy of the GNU General Public License
+;; along with Elfuse.  If not, see <http://www.gnu.org/licenses/>.
+
+;; Reference handlers and workload runner of `make bench'.  The tree
+;; lives in hash tables:
+;;
+;;   /dir/f00000 ... /dir/f09999   10k small files, for stat and ls -l
+;;   /big                          100MiB of "x", generated on read
+;;   /scratch/                     empty, for writes and create/unlink
+;;
+;; elfuse-bench-batch mounts it on a temporary directory and runs
+;; bench/bench-fs against it, which prints one line per workload.  The
+;; same tree served by the native memory backend gives a baseline.
+
+(require 'seq)
+(require 'subr-x)
+(require 'elfuse)
+
+(defconst elfuse-bench--dir-entries 10000)
+(defconst elfuse-bench--big-size (* 100 1024 1024))
+
+(defvar elfuse-bench--files (make-hash-table :test 'equal)
+  "File paths mapped to their contents, or to the size of a file
+of \"x\" generated on read.")
+
+(defvar elfuse-bench--dirs (make-hash-table :test 'equal)
+  "Directory paths mapped to hash tables of the names they list.")
+
+(defun elfuse-bench--parent (path)
+  (directory-file-name (or (file-name-directory path) "/")))
+
+(defun elfuse-bench--add (path contents)
+  (puthash path contents elfuse-bench--files)
+  (puthash (file-name-nondirectory path) t
+           (gethash (elfuse-bench--parent path) elfuse-bench--dirs)))
+
+(defun elfuse-bench--remove (path)
+  (remhash path elfuse-bench--files)
+  (remhash (file-name-nondirectory path)
+           (gethash (elfuse-bench--parent path) elfuse-bench--dirs)))
+
+(defun elfuse-bench--size (contents)
+  (if (integerp contents) contents (length contents)))
+
+(defun elfuse-bench--contents (path)
+  (let ((contents (gethash path elfuse-bench--files)))
+    (unless contents
+      (signal 'elfuse-op-error elfuse-ENOENT))
+    contents))
+
+(defun elfuse-bench-populate ()
+  "Create the benchmark tree, replacing any previous one."
+  (clrhash elfuse-bench--files)
+  (clrhash elfuse-bench--dirs)
+  (dolist (dir '("/" "/dir" "/scratch"))
+    (puthash dir (make-hash-table :test 'equal) elfuse-bench--dirs))
+  (puthash "dir" t (gethash "/" elfuse-bench--dirs))
+  (puthash "scratch" t (gethash "/" elfuse-bench--dirs))
+  (dotimes (i elfuse-bench--dir-entries)
+    (elfuse-bench--add (format "/dir/f%05d" i) "elfuse\n"))
+  (elfuse-bench--add "/big" elfuse-bench--big-size))
+
+(defun elfuse-bench--getattr (path)
+  (cond ((gethash path elfuse-bench--dirs)
+         [dir 0])
+        ((gethash path elfuse-bench--files)
+         (vector 'file (elfuse-bench--size (gethash path elfuse-bench--files))))
+        (t (signal 'elfuse-op-error elfuse-ENOENT))))
+
+(defun elfuse-bench--readdir (path)
+  (let ((names (gethash path elfuse-bench--dirs))
+        (entries (list ".." ".")))
+    (unless names
+      (signal 'elfuse-op-error elfuse-ENOENT))
+    ;; Attributes go along, ls -l takes a single call
+    (maphash (lambda (name _)
+               (let* ((child (concat (file-name-as-directory path) name))
+                      (contents (gethash child elfuse-bench--files)))
+                 (push (if contents
+                           (list name 'file (elfuse-bench--size contents))
+                         (list name 'dir 0))
+                       entries)))
+             names)
+    (vconcat (nreverse entries))))
+
+(defun elfuse-bench--open (path)
+  (elfuse-bench--contents path)
+  t)
+
+(defun elfuse-bench--release (_path)
+  t)
+
+(defun elfuse-bench--read (path offset size)
+  (let* ((contents (elfuse-bench--contents path))
+         (file-size (elfuse-bench--size contents))
+         (end (min file-size (+ offset size))))
+    (cond ((>= offset end) "")
+          ((integerp contents) (make-string (- end offset) ?x))
+          (t (substring contents offset end)))))
+
+(defun elfuse-bench--write (path buffer offset)
+  (let ((contents (elfuse-bench--contents path)))
+    (when (integerp contents)
+      (signal 'elfuse-op-error elfuse-EACCESS))
+    (let ((size (length contents)))
+      (elfuse-bench--add
+       path
+       (concat (substring contents 0 (min offset size))
+               (make-string (max 0 (- offset size)) 0)
+               buffer
+               (substring contents (min size (+ offset (length buffer)))))))
+    (length buffer)))
+
+(defun elfuse-bench--truncate (path size)
+  (let ((contents (elfuse-bench--contents path)))
+    (when (integerp contents)
+      (signal 'elfuse-op-error elfuse-EACCESS))
+    (elfuse-bench--add path (if (< size (length contents))
+                                (substring contents 0 size)
+                              (concat contents (make-string (- size (length contents)) 0)))))
+  0)
+
+(defun elfuse-bench--create (path)
+  (unless (gethash (elfuse-bench--parent path) elfuse-bench--dirs)
+    (signal 'elfuse-op-error elfuse-ENOENT))
+  (elfuse-bench--add path "")
+  0)
+
+(defun elfuse-bench--unlink (path)
+  (elfuse-bench--contents path)
+  (elfuse-bench--remove path)
+  0)
+
+(defun elfuse-bench--rename (from to)
+  (let ((contents (elfuse-bench--contents from)))
+    (elfuse-bench--remove from)
+    (elfuse-bench--add to contents))
+  0)
+
+(defconst elfuse-bench-handlers
+  '((getattr . elfuse-bench--getattr)
+    (readdir . elfuse-bench--readdir)
+    (open . elfuse-bench--open)
+    (release . elfuse-bench--release)
+    (read . elfuse-bench--read)
+    (write . elfuse-bench--write)
+    (truncate . elfuse-bench--truncate)
+    (create . elfuse-bench--create)
+    (unlink . elfuse-bench--unlink)
+    (rename . elfuse-bench--rename))
+  "Handlers of the benchmark tree, an alist for `elfuse-start'.")
+
+(defun elfuse-bench--populate-memory (mountpath)
+  "Copy the benchmark tree to the memory mount at MOUNTPATH."
+  (elfuse-memory-put "/scratch" nil mountpath)
+  (maphash (lambda (path contents)
+             (elfuse-memory-put path
+                                (if (integerp contents) (make-string contents ?x) contents)
+                                mountpath))
+           elfuse-bench--files))
+
+(defun elfuse-bench-run (program backend &rest args)
+  "Mount the benchmark tree and run PROGRAM with the mount path and ARGS.
+BACKEND is `lisp' for the handlers above or `memory' for the native
+memory backend.  The output of PROGRAM is printed as it comes,
+return its exit status, nil if mounting failed."
+  (let* ((mountpath (make-temp-file "elfuse-bench" t))
+         (stderr (generate-new-buffer " *elfuse-bench stderr*"))
+         (memory (eq backend 'memory))
+         (process nil))
+    (elfuse-bench-populate)
+    (unwind-protect
+        (when (if memory
+                  (and (elfuse-start mountpath '(:memory t))
+                       (progn (elfuse-bench--populate-memory mountpath) t))
+                (elfuse-start mountpath nil elfuse-bench-handlers))
+          (setq process (make-process :name "elfuse-bench"
+                                      :command (cons program (cons mountpath args))
+                                      :connection-type 'pipe
+                                      :noquery t
+                                      :stderr stderr
+                                      :filter (lambda (_process output) (princ output))))
+          ;; Elfuse answers requests while Emacs waits here
+          (while (process-live-p process)
+            (accept-process-output nil elfuse-time-between-checks))
+          (process-exit-status process))
+      (elfuse-stop mountpath)
+      (delete-directory mountpath)
+      ;; Keep stdout machine-readable, errors go to stderr
+      (with-current-buffer stderr
+        (unless (zerop (buffer-size))
+          (message "%s" (string-trim-right (buffer-string)))))
+      (kill-buffer stderr))))
+
+(defun elfuse-bench-batch ()
+  "Run bench/bench-fs from `emacs --batch'.
+The first remaining argument is the backend, `lisp' or `memory',
+the others go to bench-fs."
+  (let ((program (expand-file-name "bench-fs"
+                                   (file-name-directory (locate-library "elfuse-bench"))))
+        (backend (intern (or (pop command-line-args-left) "lisp")))
+        (args command-line-args-left))
+    (setq command-line-args-left nil)
+    (kill-emacs (or (apply #'elfuse-bench-run program backend args) 1))))
+
+(provide 'elfuse-bench)
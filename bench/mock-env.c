@@ -0,0 +1,636 @@
+/* This file is part of Elfuse. */
+
+/* Elfuse is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or */
+/* (at your option) any later version. */
+
+/* Elfuse is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the */
+/* GNU General Public License for more details. */
+
+/* You should have received a copy of the GNU General Public License */
+/* along with Elfuse.  If not, see <http://www.gnu.org/licenses/>. */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mock-env.h"
+
+enum mock_type {
+    MOCK_SYMBOL,
+    MOCK_INTEGER,
+    MOCK_FLOAT,
+    MOCK_STRING,
+    MOCK_VECTOR,
+    MOCK_CONS,
+    MOCK_FUNCTION,
+    MOCK_USER_PTR,
+};
+
+struct emacs_value_tag {
+    enum mock_type type;
+    union {
+        struct {
+            const char *name;
+            emacs_value function;
+            struct emacs_value_tag *next;
+        } symbol;
+        intmax_t integer;
+        double number;
+        struct {
+            char *data;
+            ptrdiff_t length;
+        } string;
+        struct {
+            emacs_value *items;
+            ptrdiff_t size;
+        } vector;
+        struct {
+            emacs_value car;
+            emacs_value cdr;
+        } cons;
+        struct {
+            emacs_value (*function)(emacs_env *, ptrdiff_t, emacs_value[], void *);
+            ptrdiff_t min_arity;
+            ptrdiff_t max_arity;
+            void *data;
+        } function;
+        struct {
+            void (*finalizer)(void *);
+            void *pointer;
+        } user_ptr;
+    };
+};
+
+/* Short-lived values come from an arena emptied by mock_env_reset */
+#define ARENA_CHUNK (1 << 20)
+
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t used;
+    size_t size;
+    char data[];
+};
+
+static struct arena_chunk *arena = NULL;
+
+static void *
+arena_alloc(size_t size)
+{
+    size = (size + 15) & ~(size_t) 15;
+    if (arena == NULL || arena->used + size > arena->size) {
+        size_t chunk_size = size > ARENA_CHUNK ? size : ARENA_CHUNK;
+        struct arena_chunk *chunk = malloc(sizeof(*chunk) + chunk_size);
+        if (chunk == NULL)
+            abort();
+        chunk->next = arena;
+        chunk->used = 0;
+        chunk->size = chunk_size;
+        arena = chunk;
+    }
+    void *memory = arena->data + arena->used;
+    arena->used += size;
+    return memory;
+}
+
+void
+mock_env_reset(void)
+{
+    /* Keep the newest chunk around */
+    while (arena != NULL && arena->next != NULL) {
+        struct arena_chunk *next = arena->next;
+        free(arena);
+        arena = next;
+    }
+    if (arena != NULL)
+        arena->used = 0;
+}
+
+static void *
+checked_malloc(size_t size)
+{
+    void *memory = malloc(size);
+    if (memory == NULL)
+        abort();
+    return memory;
+}
+
+/* Symbols */
+#define SYMBOL_BUCKETS 1024
+
+static emacs_value symbols[SYMBOL_BUCKETS];
+
+static emacs_value
+mock_intern(emacs_env *env, const char *name)
+{
+    (void) env;
+
+    uint32_t hash = 5381;
+    for (const char *c = name; *c; c++)
+        hash = hash * 33 + (unsigned char) *c;
+    emacs_value *bucket = &symbols[hash % SYMBOL_BUCKETS];
+
+    for (emacs_value symbol = *bucket; symbol != NULL; symbol = symbol->symbol.next) {
+        if (strcmp(symbol->symbol.name, name) == 0)
+            return symbol;
+    }
+
+    emacs_value symbol = checked_malloc(sizeof(*symbol));
+    symbol->type = MOCK_SYMBOL;
+    symbol->symbol.name = strdup(name);
+    symbol->symbol.function = NULL;
+    symbol->symbol.next = *bucket;
+    *bucket = symbol;
+    return symbol;
+}
+
+static emacs_value Qnil;
+
+/* Non-local exits */
+static enum emacs_funcall_exit exit_status = emacs_funcall_exit_return;
+static emacs_value exit_symbol;
+static emacs_value exit_data;
+
+static enum emacs_funcall_exit
+mock_non_local_exit_check(emacs_env *env)
+{
+    (void) env;
+    return exit_status;
+}
+
+static void
+mock_non_local_exit_clear(emacs_env *env)
+{
+    (void) env;
+    exit_status = emacs_funcall_exit_return;
+}
+
+static enum emacs_funcall_exit
+mock_non_local_exit_get(emacs_env *env, emacs_value *symbol, emacs_value *data)
+{
+    (void) env;
+    if (exit_status != emacs_funcall_exit_return) {
+        *symbol = exit_symbol;
+        *data = exit_data;
+    }
+    return exit_status;
+}
+
+static void
+mock_non_local_exit_signal(emacs_env *env, emacs_value symbol, emacs_value data)
+{
+    (void) env;
+    if (exit_status != emacs_funcall_exit_return)
+        return;
+    exit_status = emacs_funcall_exit_signal;
+    exit_symbol = symbol;
+    exit_data = data;
+}
+
+static void
+mock_non_local_exit_throw(emacs_env *env, emacs_value tag, emacs_value value)
+{
+    (void) env;
+    if (exit_status != emacs_funcall_exit_return)
+        return;
+    exit_status = emacs_funcall_exit_throw;
+    exit_symbol = tag;
+    exit_data = value;
+}
+
+static void
+signal_error(const char *name, emacs_value data)
+{
+    mock_non_local_exit_signal(NULL, mock_intern(NULL, name), data);
+}
+
+/* Values */
+static emacs_value
+new_value(enum mock_type type)
+{
+    emacs_value value = arena_alloc(sizeof(*value));
+    value->type = type;
+    return value;
+}
+
+static emacs_value
+mock_make_integer(emacs_env *env, intmax_t integer)
+{
+    (void) env;
+    emacs_value value = new_value(MOCK_INTEGER);
+    value->integer = integer;
+    return value;
+}
+
+static emacs_value
+mock_make_float(emacs_env *env, double number)
+{
+    (void) env;
+    emacs_value value = new_value(MOCK_FLOAT);
+    value->number = number;
+    return value;
+}
+
+static emacs_value
+mock_make_string(emacs_env *env, const char *contents, ptrdiff_t length)
+{
+    (void) env;
+    emacs_value value = new_value(MOCK_STRING);
+    value->string.data = arena_alloc(length + 1);
+    memcpy(value->string.data, contents, length);
+    value->string.data[length] = '\0';
+    value->string.length = length;
+    return value;
+}
+
+static emacs_value
+make_vector(ptrdiff_t size, emacs_value *items)
+{
+    emacs_value value = new_value(MOCK_VECTOR);
+    value->vector.items = arena_alloc(size * sizeof(emacs_value) + 1);
+    if (items != NULL)
+        memcpy(value->vector.items, items, size * sizeof(emacs_value));
+    value->vector.size = size;
+    return value;
+}
+
+static emacs_value
+make_cons(emacs_value car, emacs_value cdr)
+{
+    emacs_value value = new_value(MOCK_CONS);
+    value->cons.car = car;
+    value->cons.cdr = cdr;
+    return value;
+}
+
+/* Copy a value out of the arena, global references outlive resets */
+static emacs_value
+persist(emacs_value value)
+{
+    switch (value->type) {
+    case MOCK_SYMBOL:
+    case MOCK_FUNCTION:
+    case MOCK_USER_PTR:
+        return value;
+    default:
+        break;
+    }
+
+    emacs_value copy = checked_malloc(sizeof(*copy));
+    *copy = *value;
+    if (value->type == MOCK_STRING) {
+        copy->string.data = checked_malloc(value->string.length + 1);
+        memcpy(copy->string.data, value->string.data, value->string.length + 1);
+    } else if (value->type == MOCK_VECTOR) {
+        copy->vector.items = checked_malloc(value->vector.size * sizeof(emacs_value) + 1);
+        for (ptrdiff_t i = 0; i < value->vector.size; i++)
+            copy->vector.items[i] = persist(value->vector.items[i]);
+    } else if (value->type == MOCK_CONS) {
+        copy->cons.car = persist(value->cons.car);
+        copy->cons.cdr = persist(value->cons.cdr);
+    }
+    return copy;
+}
+
+static emacs_value
+mock_make_global_ref(emacs_env *env, emacs_value value)
+{
+    (void) env;
+    return persist(value);
+}
+
+static void
+mock_free_global_ref(emacs_env *env, emacs_value value)
+{
+    /* Leaked, the bench doesn't drop many */
+    (void) env; (void) value;
+}
+
+static emacs_value
+mock_type_of(emacs_env *env, emacs_value value)
+{
+    static const char *names[] = {
+        [MOCK_SYMBOL] = "symbol",
+        [MOCK_INTEGER] = "integer",
+        [MOCK_FLOAT] = "float",
+        [MOCK_STRING] = "string",
+        [MOCK_VECTOR] = "vector",
+        [MOCK_CONS] = "cons",
+        [MOCK_FUNCTION] = "module-function",
+        [MOCK_USER_PTR] = "user-ptr",
+    };
+    return mock_intern(env, names[value->type]);
+}
+
+static bool
+mock_is_not_nil(emacs_env *env, emacs_value value)
+{
+    (void) env;
+    return value != Qnil;
+}
+
+static bool
+mock_eq(emacs_env *env, emacs_value a, emacs_value b)
+{
+    (void) env;
+    if (a->type == MOCK_INTEGER && b->type == MOCK_INTEGER)
+        return a->integer == b->integer;
+    return a == b;
+}
+
+static intmax_t
+mock_extract_integer(emacs_env *env, emacs_value value)
+{
+    (void) env;
+    if (value->type != MOCK_INTEGER) {
+        signal_error("wrong-type-argument", value);
+        return 0;
+    }
+    return value->integer;
+}
+
+static double
+mock_extract_float(emacs_env *env, emacs_value value)
+{
+    (void) env;
+    if (value->type != MOCK_FLOAT) {
+        signal_error("wrong-type-argument", value);
+        return 0;
+    }
+    return value->number;
+}
+
+static bool
+mock_copy_string_contents(emacs_env *env, emacs_value value, char *buffer, ptrdiff_t *size)
+{
+    (void) env;
+    if (value->type != MOCK_STRING) {
+        signal_error("wrong-type-argument", value);
+        return false;
+    }
+
+    ptrdiff_t required = value->string.length + 1;
+    if (buffer == NULL) {
+        *size = required;
+        return true;
+    }
+    if (*size < required) {
+        *size = required;
+        signal_error("args-out-of-range", value);
+        return false;
+    }
+    memcpy(buffer, value->string.data, required);
+    *size = required;
+    return true;
+}
+
+static emacs_value
+mock_make_function(emacs_env *env, ptrdiff_t min_arity, ptrdiff_t max_arity,
+                   emacs_value (*function)(emacs_env *, ptrdiff_t, emacs_value[], void *),
+                   const char *documentation, void *data)
+{
+    (void) env; (void) documentation;
+    emacs_value value = checked_malloc(sizeof(*value));
+    value->type = MOCK_FUNCTION;
+    value->function.function = function;
+    value->function.min_arity = min_arity;
+    value->function.max_arity = max_arity;
+    value->function.data = data;
+    return value;
+}
+
+static emacs_value
+mock_make_user_ptr(emacs_env *env, void (*finalizer)(void *), void *pointer)
+{
+    (void) env;
+    emacs_value value = checked_malloc(sizeof(*value));
+    value->type = MOCK_USER_PTR;
+    value->user_ptr.finalizer = finalizer;
+    value->user_ptr.pointer = pointer;
+    return value;
+}
+
+static void *
+mock_get_user_ptr(emacs_env *env, emacs_value value)
+{
+    (void) env;
+    if (value->type != MOCK_USER_PTR) {
+        signal_error("wrong-type-argument", value);
+        return NULL;
+    }
+    return value->user_ptr.pointer;
+}
+
+static void
+(*mock_get_user_finalizer(emacs_env *env, emacs_value value))(void *)
+{
+    (void) env;
+    if (value->type != MOCK_USER_PTR) {
+        signal_error("wrong-type-argument", value);
+        return NULL;
+    }
+    return value->user_ptr.finalizer;
+}
+
+static emacs_value
+mock_vec_get(emacs_env *env, emacs_value vector, ptrdiff_t i)
+{
+    (void) env;
+    if (vector->type != MOCK_VECTOR) {
+        signal_error("wrong-type-argument", vector);
+        return Qnil;
+    }
+    if (i < 0 || i >= vector->vector.size) {
+        signal_error("args-out-of-range", vector);
+        return Qnil;
+    }
+    return vector->vector.items[i];
+}
+
+static void
+mock_vec_set(emacs_env *env, emacs_value vector, ptrdiff_t i, emacs_value value)
+{
+    (void) env;
+    if (vector->type != MOCK_VECTOR || i < 0 || i >= vector->vector.size) {
+        signal_error("args-out-of-range", vector);
+        return;
+    }
+    vector->vector.items[i] = value;
+}
+
+static ptrdiff_t
+mock_vec_size(emacs_env *env, emacs_value vector)
+{
+    (void) env;
+    if (vector->type != MOCK_VECTOR) {
+        signal_error("wrong-type-argument", vector);
+        return 0;
+    }
+    return vector->vector.size;
+}
+
+static bool
+mock_should_quit(emacs_env *env)
+{
+    (void) env;
+    return false;
+}
+
+static int
+mock_open_channel(emacs_env *env, emacs_value process)
+{
+    (void) env;
+    signal_error("wrong-type-argument", process);
+    return -1;
+}
+
+/* Builtins */
+static emacs_value
+builtin(const char *name, ptrdiff_t nargs, emacs_value args[])
+{
+    if (strcmp(name, "fset") == 0 && nargs == 2 && args[0]->type == MOCK_SYMBOL) {
+        args[0]->symbol.function = args[1];
+        return args[1];
+    }
+    if (strcmp(name, "provide") == 0 || strcmp(name, "message") == 0)
+        return nargs > 0 ? args[0] : Qnil;
+    if (strcmp(name, "input-pending-p") == 0)
+        return Qnil;
+    if (strcmp(name, "vector") == 0)
+        return make_vector(nargs, args);
+    if (strcmp(name, "list") == 0) {
+        emacs_value list = Qnil;
+        for (ptrdiff_t i = nargs - 1; i >= 0; i--)
+            list = make_cons(args[i], list);
+        return list;
+    }
+    if (strcmp(name, "car") == 0 || strcmp(name, "cdr") == 0) {
+        if (nargs == 1 && args[0] == Qnil)
+            return Qnil;
+        if (nargs != 1 || args[0]->type != MOCK_CONS) {
+            signal_error("wrong-type-argument", nargs > 0 ? args[0] : Qnil);
+            return Qnil;
+        }
+        return name[1] == 'a' ? args[0]->cons.car : args[0]->cons.cdr;
+    }
+    if (strcmp(name, "vconcat") == 0 && nargs == 1) {
+        emacs_value sequence = args[0];
+        if (sequence->type == MOCK_VECTOR)
+            return make_vector(sequence->vector.size, sequence->vector.items);
+        ptrdiff_t size = 0;
+        for (emacs_value cell = sequence; cell->type == MOCK_CONS; cell = cell->cons.cdr)
+            size++;
+        emacs_value vector = make_vector(size, NULL);
+        emacs_value cell = sequence;
+        for (ptrdiff_t i = 0; i < size; i++, cell = cell->cons.cdr)
+            vector->vector.items[i] = cell->cons.car;
+        if (cell != Qnil)
+            signal_error("wrong-type-argument", sequence);
+        return vector;
+    }
+    if (strcmp(name, "symbol-name") == 0 && nargs == 1) {
+        if (args[0]->type != MOCK_SYMBOL) {
+            signal_error("wrong-type-argument", args[0]);
+            return Qnil;
+        }
+        return mock_make_string(NULL, args[0]->symbol.name, strlen(args[0]->symbol.name));
+    }
+
+    signal_error("void-function", mock_intern(NULL, name));
+    return Qnil;
+}
+
+static emacs_value
+mock_funcall(emacs_env *env, emacs_value function, ptrdiff_t nargs, emacs_value args[])
+{
+    if (exit_status != emacs_funcall_exit_return)
+        return Qnil;
+
+    if (function->type == MOCK_SYMBOL) {
+        if (function->symbol.function == NULL)
+            return builtin(function->symbol.name, nargs, args);
+        function = function->symbol.function;
+    }
+    if (function->type != MOCK_FUNCTION) {
+        signal_error("invalid-function", function);
+        return Qnil;
+    }
+    if (nargs < function->function.min_arity
+        || (function->function.max_arity >= 0 && nargs > function->function.max_arity)) {
+        signal_error("wrong-number-of-arguments", function);
+        return Qnil;
+    }
+    return function->function.function(env, nargs, args, function->function.data);
+}
+
+emacs_value
+mock_call(const char *name, ptrdiff_t nargs, emacs_value args[])
+{
+    return mock_funcall(mock_env(), mock_intern(NULL, name), nargs, args);
+}
+
+static struct emacs_env_28 env = {
+    .size = sizeof(struct emacs_env_28),
+    .make_global_ref = mock_make_global_ref,
+    .free_global_ref = mock_free_global_ref,
+    .non_local_exit_check = mock_non_local_exit_check,
+    .non_local_exit_clear = mock_non_local_exit_clear,
+    .non_local_exit_get = mock_non_local_exit_get,
+    .non_local_exit_signal = mock_non_local_exit_signal,
+    .non_local_exit_throw = mock_non_local_exit_throw,
+    .make_function = mock_make_function,
+    .funcall = mock_funcall,
+    .intern = mock_intern,
+    .type_of = mock_type_of,
+    .is_not_nil = mock_is_not_nil,
+    .eq = mock_eq,
+    .extract_integer = mock_extract_integer,
+    .make_integer = mock_make_integer,
+    .extract_float = mock_extract_float,
+    .make_float = mock_make_float,
+    .copy_string_contents = mock_copy_string_contents,
+    .make_string = mock_make_string,
+    .make_unibyte_string = mock_make_string,
+    .make_user_ptr = mock_make_user_ptr,
+    .get_user_ptr = mock_get_user_ptr,
+    .get_user_finalizer = mock_get_user_finalizer,
+    .vec_get = mock_vec_get,
+    .vec_set = mock_vec_set,
+    .vec_size = mock_vec_size,
+    .should_quit = mock_should_quit,
+    .open_channel = mock_open_channel,
+};
+
+static emacs_env *
+get_environment(struct emacs_runtime *runtime)
+{
+    (void) runtime;
+    return mock_env();
+}
+
+static struct emacs_runtime runtime = {
+    .size = sizeof(struct emacs_runtime),
+    .get_environment = get_environment,
+};
+
+emacs_env *
+mock_env(void)
+{
+    if (Qnil == NULL)
+        Qnil = mock_intern(NULL, "nil");
+    return &env;
+}
+
+struct emacs_runtime *
+mock_runtime(void)
+{
+    mock_env();
+    return &runtime;
+}
@@ -0,0 +1,44 @@
+/* This file is part of Elfuse. */
+
+/* Elfuse is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or */
+/* (at your option) any later version. */
+
+/* Elfuse is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the */
+/* GNU General Public License for more details. */
+
+/* You should have received a copy of the GNU General Public License */
+/* along with Elfuse.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef ELFUSE_MOCK_ENV_H
+#define ELFUSE_MOCK_ENV_H
+
+#include "../emacs-module.h"
+
+/* A stand-in for Emacs, just enough of emacs_env to load elfuse-module.o
+ * and run its functions without Emacs. Functions are module functions
+ * (make_function) or symbols bound to one by fset, plus a handful of
+ * builtins the module calls (list, vector, vconcat, car, cdr, symbol-name,
+ * message, provide, input-pending-p). */
+
+/* The runtime to pass to emacs_module_init, and its environment */
+struct emacs_runtime *
+mock_runtime(void);
+
+emacs_env *
+mock_env(void);
+
+/* Free every value made since the last reset, except for global references,
+ * symbols, functions and user pointers. Call it between requests, like
+ * Emacs returning from a module function. */
+void
+mock_env_reset(void);
+
+/* Call the function of the symbol NAME */
+emacs_value
+mock_call(const char *name, ptrdiff_t nargs, emacs_value args[]);
+
+#endif //ELFUSE_MOCK_ENV_H
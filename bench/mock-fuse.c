@@ -0,0 +1,298 @@
+/* This file is part of Elfuse. */
+
+/* Elfuse is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or */
+/* (at your option) any later version. */
+
+/* Elfuse is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the */
+/* GNU General Public License for more details. */
+
+/* You should have received a copy of the GNU General Public License */
+/* along with Elfuse.  If not, see <http://www.gnu.org/licenses/>. */
+
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../elfuse-stats.h"
+#include "mock-fuse.h"
+
+int elfuse_thread_count = 1;
+int elfuse_max_deferred = 64;
+double elfuse_attr_cache_ttl = 0;
+size_t elfuse_attr_cache_size = 65536;
+double elfuse_negative_cache_ttl = 0;
+size_t elfuse_negative_cache_size = 4096;
+double elfuse_read_cache_ttl = 0;
+size_t elfuse_read_cache_size = 32 * 1024 * 1024;
+size_t elfuse_readahead_max = 1024 * 1024;
+bool elfuse_write_back = false;
+size_t elfuse_write_back_size = 4 * 1024 * 1024;
+double elfuse_write_back_age = 1.0;
+size_t elfuse_memory_max_size = 256 * 1024 * 1024;
+
+struct elfuse_mount {
+    char *path;
+    bool running;
+    struct elfuse_call_state *queue_head;
+    struct elfuse_call_state *queue_tail;
+    size_t queue_size;
+    struct elfuse_stats stats;
+};
+
+static struct elfuse_mount *last_mount = NULL;
+
+struct elfuse_mount *
+mock_last_mount(void)
+{
+    return last_mount;
+}
+
+void
+mock_enqueue(struct elfuse_mount *mount, struct elfuse_call_state *call)
+{
+    call->next = NULL;
+    call->done = false;
+    call->received_ns = elfuse_stats_now();
+    if (mount->queue_tail != NULL)
+        mount->queue_tail->next = call;
+    else
+        mount->queue_head = call;
+    mount->queue_tail = call;
+    mount->queue_size++;
+}
+
+struct elfuse_call_state *
+elfuse_call_dequeue(struct elfuse_mount *mount)
+{
+    struct elfuse_call_state *call = mount->queue_head;
+    if (call != NULL) {
+        mount->queue_head = call->next;
+        if (mount->queue_head == NULL)
+            mount->queue_tail = NULL;
+        call->next = NULL;
+        call->dequeued_ns = elfuse_stats_now();
+        mount->queue_size--;
+    }
+    return call;
+}
+
+size_t
+elfuse_queue_length(struct elfuse_mount *mount)
+{
+    return mount->queue_size;
+}
+
+bool
+elfuse_call_park(struct elfuse_mount *mount, struct elfuse_call_state *call)
+{
+    (void) mount;
+    call->parked = true;
+    return true;
+}
+
+void
+elfuse_call_complete(struct elfuse_mount *mount, struct elfuse_call_state *call,
+                     enum elfuse_response_state response_state)
+{
+    (void) mount;
+    call->handled_ns = elfuse_stats_now();
+    call->response_state = response_state;
+    call->done = true;
+}
+
+const char *
+elfuse_call_path(const struct elfuse_call_state *call)
+{
+    /* Every args struct starts with the path */
+    return call->args.getattr.path;
+}
+
+void
+elfuse_set_wakeup_fd(int fd)
+{
+    (void) fd;
+}
+
+bool
+elfuse_set_route(struct elfuse_mount *mount, const char *prefix, int route, uint32_t ops)
+{
+    (void) mount; (void) prefix; (void) route; (void) ops;
+    return true;
+}
+
+void
+elfuse_unset_route(struct elfuse_mount *mount, const char *prefix)
+{
+    (void) mount; (void) prefix;
+}
+
+enum elfuse_mount_option_type
+elfuse_mount_option_type(const char *name)
+{
+    (void) name;
+    return MOUNT_OPTION_FLAG;
+}
+
+bool
+elfuse_mount_option_add(const char *name, double value)
+{
+    (void) name; (void) value;
+    return true;
+}
+
+void
+elfuse_mount_options_clear(void)
+{
+}
+
+void
+elfuse_invalidate_attr(struct elfuse_mount *mount, const char *path)
+{
+    (void) mount; (void) path;
+}
+
+void
+elfuse_invalidate_all(struct elfuse_mount *mount)
+{
+    (void) mount;
+}
+
+void
+elfuse_invalidate_content(struct elfuse_mount *mount, const char *path)
+{
+    (void) mount; (void) path;
+}
+
+bool
+elfuse_notify(struct elfuse_mount *mount, enum elfuse_notify_kind kind, const char *path)
+{
+    (void) mount; (void) kind; (void) path;
+    return true;
+}
+
+struct elfuse_stats *
+elfuse_mount_stats(struct elfuse_mount *mount)
+{
+    return &mount->stats;
+}
+
+bool
+elfuse_mount_trace(struct elfuse_mount *mount, const char *filename)
+{
+    (void) mount; (void) filename;
+    return false;
+}
+
+struct elfuse_memfs *
+elfuse_mount_memfs(struct elfuse_mount *mount)
+{
+    (void) mount;
+    return NULL;
+}
+
+/* Loopback requests are never made, elfuse-loopback.o only links */
+
+int
+elfuse_loopback_getattr(struct elfuse_mount *mount, const char *path)
+{
+    (void) mount; (void) path;
+    return -ENOSYS;
+}
+
+int
+elfuse_loopback_readdir(struct elfuse_mount *mount, const char *path)
+{
+    (void) mount; (void) path;
+    return -ENOSYS;
+}
+
+int
+elfuse_loopback_open(struct elfuse_mount *mount, const char *path, int flags, uint64_t *fh)
+{
+    (void) mount; (void) path; (void) flags;
+    *fh = 0;
+    return -ENOSYS;
+}
+
+int
+elfuse_loopback_read(struct elfuse_mount *mount, const char *path, uint64_t fh, char *buf, size_t size, off_t offset)
+{
+    (void) mount; (void) path; (void) fh; (void) buf; (void) size; (void) offset;
+    return -ENOSYS;
+}
+
+int
+elfuse_loopback_write(struct elfuse_mount *mount, const char *path, uint64_t fh, const char *buf, size_t size, off_t offset)
+{
+    (void) mount; (void) path; (void) fh; (void) buf; (void) size; (void) offset;
+    return -ENOSYS;
+}
+
+int
+elfuse_loopback_release(struct elfuse_mount *mount, const char *path, uint64_t fh)
+{
+    (void) mount; (void) path; (void) fh;
+    return -ENOSYS;
+}
+
+int
+elfuse_loopback_unlink(struct elfuse_mount *mount, const char *path)
+{
+    (void) mount; (void) path;
+    return -ENOSYS;
+}
+
+struct elfuse_mount *
+elfuse_mount_new(const char *path)
+{
+    struct elfuse_mount *mount = calloc(1, sizeof(*mount));
+    if (mount == NULL)
+        return NULL;
+    mount->path = strdup(path);
+    if (mount->path == NULL) {
+        free(mount);
+        return NULL;
+    }
+    last_mount = mount;
+    return mount;
+}
+
+void
+elfuse_mount_free(struct elfuse_mount *mount)
+{
+    if (mount == NULL)
+        return;
+    if (mount == last_mount)
+        last_mount = NULL;
+    free(mount->path);
+    free(mount);
+}
+
+const char *
+elfuse_mount_path(const struct elfuse_mount *mount)
+{
+    return mount->path;
+}
+
+enum elfuse_init_code_enum
+elfuse_mount_start(struct elfuse_mount *mount)
+{
+    mount->running = true;
+    return INIT_DONE;
+}
+
+bool
+elfuse_mount_stop(struct elfuse_mount *mount)
+{
+    bool running = mount->running;
+    mount->running = false;
+    return running;
+}
@@ -0,0 +1,32 @@
+/* This file is part of Elfuse. */
+
+/* Elfuse is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or */
+/* (at your option) any later version. */
+
+/* Elfuse is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the */
+/* GNU General Public License for more details. */
+
+/* You should have received a copy of the GNU General Public License */
+/* along with Elfuse.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef ELFUSE_MOCK_FUSE_H
+#define ELFUSE_MOCK_FUSE_H
+
+#include "../elfuse-fuse.h"
+
+/* The FUSE side of elfuse-fuse.h without FUSE: mounts only have a request
+ * queue, filled by mock_enqueue from the thread running the module. */
+
+/* Queue a request for elfuse--check-ops, it's complete once call->done */
+void
+mock_enqueue(struct elfuse_mount *mount, struct elfuse_call_state *call);
+
+/* The mount elfuse--mount created last */
+struct elfuse_mount *
+mock_last_mount(void);
+
+#endif //ELFUSE_MOCK_FUSE_H
@@ -0,0 +1,509 @@
+/* This file is part of Elfuse. */
+
+/* Elfuse is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or */
+/* (at your option) any later version. */
+
+/* Elfuse is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the */
+/* GNU General Public License for more details. */
+
+/* You should have received a copy of the GNU General Public License */
+/* along with Elfuse.  If not, see <http://www.gnu.org/licenses/>. */
+
+#define _XOPEN_SOURCE 700
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "elfuse-cache.h"
+
+struct elfuse_cache_entry {
+    /* Next entry in the same bucket */
+    struct elfuse_cache_entry *chain;
+
+    struct elfuse_cache_entry *lru_prev;
+    struct elfuse_cache_entry *lru_next;
+
+    /* Other members of the same group, if any */
+    struct elfuse_cache_group *group;
+    struct elfuse_cache_entry *group_prev;
+    struct elfuse_cache_entry *group_next;
+
+    uint64_t hash;
+    double expires;
+
+    /* Both live in the same allocation as the entry itself */
+    void *value;
+    char *path;
+};
+
+struct elfuse_cache_group {
+    /* Next group in the same bucket */
+    struct elfuse_cache_group *chain;
+
+    /* On the groups list while there are members, on idle_groups after */
+    struct elfuse_cache_group *list_prev;
+    struct elfuse_cache_group *list_next;
+
+    struct elfuse_cache_entry *members;
+
+    uint64_t hash;
+    uint64_t generation;
+
+    /* Lives in the same allocation as the group itself */
+    char *path;
+};
+
+double
+elfuse_monotonic_time(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* FNV-1a */
+uint64_t
+elfuse_hash_path(const char *path)
+{
+    uint64_t hash = 0xcbf29ce484222325;
+    for (const unsigned char *p = (const unsigned char *) path; *p; p++) {
+        hash ^= *p;
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+bool
+elfuse_cache_init(struct elfuse_cache *cache, size_t value_size, size_t max_entries)
+{
+    memset(cache, 0, sizeof(*cache));
+
+    cache->buckets_size = 64;
+    while (cache->buckets_size < max_entries)
+        cache->buckets_size *= 2;
+    cache->buckets = calloc(cache->buckets_size, sizeof(cache->buckets[0]));
+    cache->group_buckets = calloc(cache->buckets_size, sizeof(cache->group_buckets[0]));
+    if (cache->buckets == NULL || cache->group_buckets == NULL) {
+        free(cache->buckets);
+        free(cache->group_buckets);
+        return false;
+    }
+
+    cache->value_size = value_size;
+    cache->max_entries = max_entries > 0 ? max_entries : 1;
+    pthread_mutex_init(&cache->lock, NULL);
+
+    return true;
+}
+
+void
+elfuse_cache_destroy(struct elfuse_cache *cache)
+{
+    elfuse_cache_clear(cache);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->buckets);
+    free(cache->group_buckets);
+    cache->buckets = NULL;
+    cache->group_buckets = NULL;
+}
+
+static struct elfuse_cache_entry **
+find_slot(struct elfuse_cache *cache, const char *path, uint64_t hash)
+{
+    struct elfuse_cache_entry **slot = &cache->buckets[hash & (cache->buckets_size - 1)];
+    while (*slot != NULL) {
+        if ((*slot)->hash == hash && strcmp((*slot)->path, path) == 0)
+            break;
+        slot = &(*slot)->chain;
+    }
+    return slot;
+}
+
+static void
+lru_unlink(struct elfuse_cache *cache, struct elfuse_cache_entry *entry)
+{
+    if (entry->lru_prev != NULL)
+        entry->lru_prev->lru_next = entry->lru_next;
+    else
+        cache->lru_head = entry->lru_next;
+
+    if (entry->lru_next != NULL)
+        entry->lru_next->lru_prev = entry->lru_prev;
+    else
+        cache->lru_tail = entry->lru_prev;
+
+    entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void
+lru_push(struct elfuse_cache *cache, struct elfuse_cache_entry *entry)
+{
+    entry->lru_prev = NULL;
+    entry->lru_next = cache->lru_head;
+    if (cache->lru_head != NULL)
+        cache->lru_head->lru_prev = entry;
+    else
+        cache->lru_tail = entry;
+    cache->lru_head = entry;
+}
+
+static struct elfuse_cache_group **
+find_group_slot(struct elfuse_cache *cache, const char *path, uint64_t hash)
+{
+    struct elfuse_cache_group **slot = &cache->group_buckets[hash & (cache->buckets_size - 1)];
+    while (*slot != NULL) {
+        if ((*slot)->hash == hash && strcmp((*slot)->path, path) == 0)
+            break;
+        slot = &(*slot)->chain;
+    }
+    return slot;
+}
+
+static void
+group_list_unlink(struct elfuse_cache_group_list *list, struct elfuse_cache_group *group)
+{
+    if (group->list_prev != NULL)
+        group->list_prev->list_next = group->list_next;
+    else
+        list->head = group->list_next;
+
+    if (group->list_next != NULL)
+        group->list_next->list_prev = group->list_prev;
+    else
+        list->tail = group->list_prev;
+
+    group->list_prev = group->list_next = NULL;
+    list->length--;
+}
+
+static void
+group_list_append(struct elfuse_cache_group_list *list, struct elfuse_cache_group *group)
+{
+    group->list_next = NULL;
+    group->list_prev = list->tail;
+    if (list->tail != NULL)
+        list->tail->list_next = group;
+    else
+        list->head = group;
+    list->tail = group;
+    list->length++;
+}
+
+/* Forget an idle group, a later one for the same path starts where the
+ * dropped generation is */
+static void
+free_group(struct elfuse_cache *cache, struct elfuse_cache_group *group)
+{
+    struct elfuse_cache_group **slot = find_group_slot(cache, group->path, group->hash);
+    *slot = group->chain;
+    group_list_unlink(&cache->idle_groups, group);
+    if (cache->dropped_generation < group->generation)
+        cache->dropped_generation = group->generation;
+    free(group);
+}
+
+/* Idle groups are only kept for their generation, the oldest go first */
+static void
+trim_idle_groups(struct elfuse_cache *cache)
+{
+    while (cache->idle_groups.length > cache->buckets_size)
+        free_group(cache, cache->idle_groups.head);
+}
+
+/* A new idle group */
+static struct elfuse_cache_group *
+add_group(struct elfuse_cache *cache, const char *path, uint64_t hash)
+{
+    size_t path_size = strlen(path) + 1;
+    struct elfuse_cache_group *group = malloc(sizeof(*group) + path_size);
+    if (group == NULL)
+        return NULL;
+    group->path = (char *) (group + 1);
+    memcpy(group->path, path, path_size);
+    group->hash = hash;
+    group->generation = cache->dropped_generation;
+    group->members = NULL;
+
+    struct elfuse_cache_group **slot = find_group_slot(cache, path, hash);
+    group->chain = NULL;
+    *slot = group;
+    group_list_append(&cache->idle_groups, group);
+    trim_idle_groups(cache);
+
+    return group;
+}
+
+/* Unlink the entry SLOT points to and free it */
+static void
+remove_slot(struct elfuse_cache *cache, struct elfuse_cache_entry **slot)
+{
+    struct elfuse_cache_entry *entry = *slot;
+    *slot = entry->chain;
+    lru_unlink(cache, entry);
+    cache->entries--;
+
+    struct elfuse_cache_group *group = entry->group;
+    if (group != NULL) {
+        if (entry->group_prev != NULL)
+            entry->group_prev->group_next = entry->group_next;
+        else
+            group->members = entry->group_next;
+        if (entry->group_next != NULL)
+            entry->group_next->group_prev = entry->group_prev;
+        cache->grouped_entries--;
+
+        if (group->members == NULL) {
+            group_list_unlink(&cache->groups, group);
+            group_list_append(&cache->idle_groups, group);
+            trim_idle_groups(cache);
+        }
+    }
+
+    free(entry);
+}
+
+static void
+remove_entry(struct elfuse_cache *cache, struct elfuse_cache_entry *entry)
+{
+    remove_slot(cache, find_slot(cache, entry->path, entry->hash));
+}
+
+bool
+elfuse_cache_get(struct elfuse_cache *cache, const char *path, void *value)
+{
+    uint64_t hash = elfuse_hash_path(path);
+    bool found = false;
+
+    pthread_mutex_lock(&cache->lock);
+
+    struct elfuse_cache_entry **slot = find_slot(cache, path, hash);
+    if (*slot != NULL) {
+        if ((*slot)->expires <= elfuse_monotonic_time()) {
+            remove_slot(cache, slot);
+        } else {
+            struct elfuse_cache_entry *entry = *slot;
+            if (value != NULL && cache->value_size > 0)
+                memcpy(value, entry->value, cache->value_size);
+            lru_unlink(cache, entry);
+            lru_push(cache, entry);
+            found = true;
+        }
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+    return found;
+}
+
+uint64_t
+elfuse_cache_generation(struct elfuse_cache *cache)
+{
+    pthread_mutex_lock(&cache->lock);
+    uint64_t generation = cache->generation;
+    pthread_mutex_unlock(&cache->lock);
+    return generation;
+}
+
+static void
+put_entry(struct elfuse_cache *cache, const char *group_path, const char *path,
+          const void *value, double ttl, uint64_t generation)
+{
+    if (ttl <= 0)
+        return;
+
+    uint64_t hash = elfuse_hash_path(path);
+    uint64_t group_hash = group_path != NULL ? elfuse_hash_path(group_path) : 0;
+    size_t path_size = strlen(path) + 1;
+
+    struct elfuse_cache_entry *entry = malloc(sizeof(*entry) + cache->value_size + path_size);
+    if (entry == NULL)
+        return;
+    entry->value = entry + 1;
+    entry->path = (char *) entry->value + cache->value_size;
+    if (cache->value_size > 0)
+        memcpy(entry->value, value, cache->value_size);
+    memcpy(entry->path, path, path_size);
+    entry->hash = hash;
+    entry->expires = elfuse_monotonic_time() + ttl;
+    entry->group = NULL;
+    entry->group_prev = entry->group_next = NULL;
+
+    pthread_mutex_lock(&cache->lock);
+
+    struct elfuse_cache_group *group = NULL;
+    if (group_path != NULL) {
+        group = *find_group_slot(cache, group_path, group_hash);
+        if ((group != NULL ? group->generation : cache->dropped_generation) != generation) {
+            pthread_mutex_unlock(&cache->lock);
+            free(entry);
+            return;
+        }
+    } else if (cache->generation != generation) {
+        pthread_mutex_unlock(&cache->lock);
+        free(entry);
+        return;
+    }
+
+    struct elfuse_cache_entry **slot = find_slot(cache, path, hash);
+    if (*slot != NULL)
+        remove_slot(cache, slot);
+    while (cache->entries >= cache->max_entries)
+        remove_entry(cache, cache->lru_tail);
+
+    /* Evictions may have emptied and dropped the group */
+    if (group_path != NULL) {
+        group = *find_group_slot(cache, group_path, group_hash);
+        if (group == NULL)
+            group = add_group(cache, group_path, group_hash);
+        if (group == NULL) {
+            pthread_mutex_unlock(&cache->lock);
+            free(entry);
+            return;
+        }
+        if (group->members == NULL) {
+            group_list_unlink(&cache->idle_groups, group);
+            group_list_append(&cache->groups, group);
+        } else {
+            group->members->group_prev = entry;
+        }
+        entry->group = group;
+        entry->group_next = group->members;
+        group->members = entry;
+        cache->grouped_entries++;
+    }
+
+    slot = find_slot(cache, path, hash);
+    entry->chain = NULL;
+    *slot = entry;
+    lru_push(cache, entry);
+    cache->entries++;
+
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void
+elfuse_cache_put(struct elfuse_cache *cache, const char *path, const void *value,
+                 double ttl, uint64_t generation)
+{
+    put_entry(cache, NULL, path, value, ttl, generation);
+}
+
+uint64_t
+elfuse_cache_group_generation(struct elfuse_cache *cache, const char *group_path)
+{
+    uint64_t hash = elfuse_hash_path(group_path);
+
+    pthread_mutex_lock(&cache->lock);
+    struct elfuse_cache_group *group = *find_group_slot(cache, group_path, hash);
+    uint64_t generation = group != NULL ? group->generation : cache->dropped_generation;
+    pthread_mutex_unlock(&cache->lock);
+
+    return generation;
+}
+
+void
+elfuse_cache_put_member(struct elfuse_cache *cache, const char *group, const char *path,
+                        const void *value, double ttl, uint64_t generation)
+{
+    put_entry(cache, group, path, value, ttl, generation);
+}
+
+/* Empty GROUP under a generation of its own */
+static void
+invalidate_group(struct elfuse_cache *cache, struct elfuse_cache_group *group)
+{
+    group->generation = ++cache->generation;
+    while (group->members != NULL)
+        remove_entry(cache, group->members);
+}
+
+void
+elfuse_cache_remove_group(struct elfuse_cache *cache, const char *group_path)
+{
+    uint64_t hash = elfuse_hash_path(group_path);
+
+    pthread_mutex_lock(&cache->lock);
+
+    struct elfuse_cache_group *group = *find_group_slot(cache, group_path, hash);
+    if (group != NULL) {
+        invalidate_group(cache, group);
+    } else {
+        /* Still has to outdate whatever was read before */
+        group = add_group(cache, group_path, hash);
+        if (group != NULL)
+            group->generation = ++cache->generation;
+        else
+            cache->dropped_generation = ++cache->generation;
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+}
+
+static bool
+path_in_subtree(const char *path, const char *root)
+{
+    size_t root_length = strlen(root);
+    if (root_length > 0 && root[root_length - 1] == '/')
+        root_length--;
+    return strncmp(path, root, root_length) == 0
+        && (path[root_length] == '\0' || path[root_length] == '/');
+}
+
+void
+elfuse_cache_remove(struct elfuse_cache *cache, const char *path, bool subtree)
+{
+    pthread_mutex_lock(&cache->lock);
+
+    cache->generation++;
+    if (subtree) {
+        /* Groups below PATH go as a whole, those not in the table can't be
+         * told apart from the others */
+        for (struct elfuse_cache_group *group = cache->groups.head; group != NULL;) {
+            struct elfuse_cache_group *next = group->list_next;
+            if (path_in_subtree(group->path, path))
+                invalidate_group(cache, group);
+            group = next;
+        }
+        for (struct elfuse_cache_group *group = cache->idle_groups.head; group != NULL; group = group->list_next) {
+            if (path_in_subtree(group->path, path))
+                group->generation = ++cache->generation;
+        }
+        cache->dropped_generation = ++cache->generation;
+
+        struct elfuse_cache_entry *entry = cache->entries > cache->grouped_entries ? cache->lru_head : NULL;
+        while (entry != NULL) {
+            struct elfuse_cache_entry *next = entry->lru_next;
+            if (entry->group == NULL && path_in_subtree(entry->path, path))
+                remove_entry(cache, entry);
+            entry = next;
+        }
+    } else {
+        struct elfuse_cache_entry **slot = find_slot(cache, path, elfuse_hash_path(path));
+        if (*slot != NULL)
+            remove_slot(cache, slot);
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void
+elfuse_cache_clear(struct elfuse_cache *cache)
+{
+    pthread_mutex_lock(&cache->lock);
+
+    cache->generation++;
+    while (cache->lru_head != NULL)
+        remove_entry(cache, cache->lru_head);
+    while (cache->idle_groups.head != NULL)
+        free_group(cache, cache->idle_groups.head);
+    cache->dropped_generation = ++cache->generation;
+
+    pthread_mutex_unlock(&cache->lock);
+}
@@ -0,0 +1,114 @@
+/* This file is part of Elfuse. */
+
+/* Elfuse is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or */
+/* (at your option) any later version. */
+
+/* Elfuse is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the */
+/* GNU General Public License for more details. */
+
+/* You should have received a copy of the GNU General Public License */
+/* along with Elfuse.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef ELFUSE_CACHE_H
+#define ELFUSE_CACHE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* A thread-safe path-keyed hash table of fixed-size values. Every entry
+ * expires after its own TTL, the least recently used entries are dropped
+ * once the table is full. */
+struct elfuse_cache_entry;
+
+/* Entries may belong to a group, e.g. all blocks of one file, that can be
+ * dropped without looking at any other entry */
+struct elfuse_cache_group;
+
+struct elfuse_cache_group_list {
+    struct elfuse_cache_group *head;
+    struct elfuse_cache_group *tail;
+    size_t length;
+};
+
+struct elfuse_cache {
+    pthread_mutex_t lock;
+
+    struct elfuse_cache_entry **buckets;
+    size_t buckets_size;
+
+    /* Most recently used entry first */
+    struct elfuse_cache_entry *lru_head;
+    struct elfuse_cache_entry *lru_tail;
+
+    size_t value_size;
+    size_t entries;
+    size_t max_entries;
+
+    /* Bumped by every invalidation, see elfuse_cache_put */
+    uint64_t generation;
+
+    struct elfuse_cache_group **group_buckets;
+    /* Groups with entries, then the empty ones kept for their generation */
+    struct elfuse_cache_group_list groups;
+    struct elfuse_cache_group_list idle_groups;
+    size_t grouped_entries;
+    /* The generation of groups not in the table */
+    uint64_t dropped_generation;
+};
+
+/* Seconds on the monotonic clock */
+double
+elfuse_monotonic_time(void);
+
+/* Hash of a path, for tables keyed by them */
+uint64_t
+elfuse_hash_path(const char *path);
+
+bool
+elfuse_cache_init(struct elfuse_cache *cache, size_t value_size, size_t max_entries);
+
+void
+elfuse_cache_destroy(struct elfuse_cache *cache);
+
+/* Copy the value of an unexpired PATH entry to VALUE (if not NULL). Values
+ * may be empty (VALUE_SIZE of 0) when only the presence of a path matters. */
+bool
+elfuse_cache_get(struct elfuse_cache *cache, const char *path, void *value);
+
+uint64_t
+elfuse_cache_generation(struct elfuse_cache *cache);
+
+/* Store VALUE for TTL seconds unless the cache was invalidated since
+ * GENERATION was read, i.e. while the value was being computed */
+void
+elfuse_cache_put(struct elfuse_cache *cache, const char *path, const void *value,
+                 double ttl, uint64_t generation);
+
+/* Like elfuse_cache_generation, only bumped when GROUP is invalidated */
+uint64_t
+elfuse_cache_group_generation(struct elfuse_cache *cache, const char *group);
+
+/* Store VALUE for PATH as a member of GROUP, GENERATION being the one of the
+ * group */
+void
+elfuse_cache_put_member(struct elfuse_cache *cache, const char *group, const char *path,
+                        const void *value, double ttl, uint64_t generation);
+
+/* Drop every member of GROUP, at the cost of those alone */
+void
+elfuse_cache_remove_group(struct elfuse_cache *cache, const char *group);
+
+/* Drop PATH and, if SUBTREE is set, everything below it */
+void
+elfuse_cache_remove(struct elfuse_cache *cache, const char *path, bool subtree);
+
+void
+elfuse_cache_clear(struct elfuse_cache *cache);
+
+#endif //ELFUSE_CACHE_H
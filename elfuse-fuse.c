@@ -21,8 +21,12 @@
 #include <fcntl.h>
 #include <fuse.h>
 #include <fuse/fuse_lowlevel.h>
+#include <inttypes.h>
+#include <linux/fuse.h>
+#include <math.h>
 #include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -30,588 +34,2346 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 
+#include "elfuse-cache.h"
 #include "elfuse-fuse.h"
+#include "elfuse-log.h"
+#include "elfuse-memfs.h"
+#include "elfuse-probes.h"
+#include "elfuse-route.h"
+#include "elfuse-stats.h"
+#include "elfuse-trace.h"
+
+/* Defaults for new mounts */
+double elfuse_attr_cache_ttl = 0;
+size_t elfuse_attr_cache_size = 65536;
+double elfuse_negative_cache_ttl = 0;
+size_t elfuse_negative_cache_size = 4096;
+double elfuse_read_cache_ttl = 0;
+size_t elfuse_read_cache_size = 32 * 1024 * 1024;
+size_t elfuse_readahead_max = 1024 * 1024;
+bool elfuse_write_back = false;
+size_t elfuse_write_back_size = 4 * 1024 * 1024;
+double elfuse_write_back_age = 1.0;
+size_t elfuse_memory_max_size = 256 * 1024 * 1024;
+
+/* Number of threads receiving FUSE requests */
+int elfuse_thread_count = 1;
+int elfuse_max_deferred = 64;
+
+/* File contents in fixed-size blocks, keyed by "path/index" */
+#define ELFUSE_BLOCK_SIZE 16384
+
+struct elfuse_block {
+    /* Short for the last block of a file only */
+    size_t length;
+    char data[ELFUSE_BLOCK_SIZE];
+};
 
-pthread_mutex_t elfuse_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t elfuse_cond_var = PTHREAD_COND_INITIALIZER;
+/* Header of the request this worker is processing, NULL if out of reach */
+static _Thread_local const struct fuse_in_header *elfuse_current_in = NULL;
 
-struct elfuse_call_state elfuse_call = {
-    .request_state = WAITING_NONE,
-    .response_state = RESPONSE_NOTREADY,
+/* A receiver standing in for a worker parked on a deferred request */
+struct elfuse_spare {
+    struct elfuse_mount *mount;
+    pthread_t thread;
+    bool started;
+    bool exited;
 };
 
-static int
-elfuse_create(const char *path, mode_t mode, struct fuse_file_info *fi)
-{
-    (void) mode;
-    (void) fi;
-    int res = 0;
+/* Spare this thread is, NULL for the workers started with the mount */
+static _Thread_local struct elfuse_spare *elfuse_current_spare = NULL;
 
-    pthread_mutex_lock(&elfuse_mutex);
+/* Loopback mount this thread is making a request to, see elfuse_loopback_getattr */
+static _Thread_local struct elfuse_mount *elfuse_current_loopback = NULL;
 
-    /* Function to call */
-    elfuse_call.request_state = WAITING_CREATE;
-    elfuse_call.response_state = RESPONSE_NOTREADY;
+/* Kernel cache invalidations waiting for the notify thread */
+struct elfuse_notification {
+    struct elfuse_notification *next;
+    enum elfuse_notify_kind kind;
+    char path[];
+};
 
-    /* Set function args */
-    elfuse_call.args.create.path = path;
+/* FUSE options for the next mount, -o style */
+static char elfuse_mount_options[1024] = "";
+
+/* The next mount takes requests from elfuse_loopback_* calls instead of
+ * the kernel, set by the loopback option */
+static bool elfuse_mount_loopback = false;
+
+/* The next mount serves a tree in memory without Emacs, set by the memory
+ * option */
+static bool elfuse_mount_memory = false;
+
+static const struct {
+    const char *name;
+    enum elfuse_mount_option_type type;
+} elfuse_mount_option_table[] = {
+    {"entry_timeout", MOUNT_OPTION_SECONDS},
+    {"attr_timeout", MOUNT_OPTION_SECONDS},
+    {"negative_timeout", MOUNT_OPTION_SECONDS},
+    {"kernel_cache", MOUNT_OPTION_FLAG},
+    {"auto_cache", MOUNT_OPTION_FLAG},
+    {"max_read", MOUNT_OPTION_BYTES},
+    {"max_readahead", MOUNT_OPTION_BYTES},
+    {"max_write", MOUNT_OPTION_BYTES},
+    {"big_writes", MOUNT_OPTION_FLAG},
+    {"async_read", MOUNT_OPTION_FLAG},
+    {"loopback", MOUNT_OPTION_FLAG},
+    {"memory", MOUNT_OPTION_FLAG},
+};
 
-    /* Wait for the funcall results */
-    fprintf(stderr, "CREATE request (path=%s).\n", path);
-    pthread_cond_wait(&elfuse_cond_var, &elfuse_mutex);
+struct elfuse_file;
+
+/* Everything a single mount owns */
+struct elfuse_mount {
+    /* Mount point and -o style FUSE options */
+    char *path;
+    char options[sizeof(elfuse_mount_options)];
+
+    /* Settings, copied from the defaults when the mount is created */
+    bool loopback;
+
+    /* The tree of a memory mount, NULL if Emacs answers requests */
+    struct elfuse_memfs *memfs;
+    int thread_count;
+    int max_deferred;
+    double attr_cache_ttl;
+    double negative_cache_ttl;
+    double read_cache_ttl;
+    size_t read_cache_size;
+    size_t readahead_max;
+    bool write_back;
+    size_t write_back_size;
+    double write_back_age;
+
+    /* Protects the queue and the init handshake */
+    pthread_mutex_t lock;
+    pthread_cond_t init_cond;
+    enum elfuse_init_code_enum init_code;
+    pthread_t thread;
+    bool running;
+
+    /* Requests waiting for Emacs, oldest first */
+    struct elfuse_call_state *queue_head;
+    struct elfuse_call_state *queue_tail;
+    size_t queue_size;
+    bool queue_stopped;
+
+    /* A wakeup byte was written and Emacs didn't empty the queue since */
+    bool wakeup_pending;
+
+    /* Counters and latencies of requests sent to Emacs */
+    struct elfuse_stats stats;
+
+    /* Every request as it arrives, when recording */
+    struct elfuse_trace trace;
+
+    /* Subtrees Emacs has handlers for, set from the Emacs thread */
+    struct elfuse_routes routes;
+
+    /* File attributes by path and paths known not to exist */
+    struct elfuse_cache attr_cache;
+    struct elfuse_cache negative_cache;
+
+    /* File contents, see struct elfuse_block */
+    struct elfuse_cache block_cache;
+
+    /* Kernel node ids by path, learned from the requests naming them */
+    struct elfuse_cache node_cache;
+
+    /* Open files with buffered writes, oldest first, flushed by the flush
+     * thread once they are write_back_age old. Protected by pending_lock. */
+    pthread_mutex_t pending_lock;
+    pthread_cond_t pending_cond;
+    struct elfuse_file *pending_head;
+    struct elfuse_file *pending_tail;
+    bool flush_running;
+    pthread_t flush_thread;
+
+    /* Invalidations for the notify thread. Protected by notify_lock. */
+    pthread_mutex_t notify_lock;
+    pthread_cond_t notify_cond;
+    struct elfuse_notification *notify_head;
+    struct elfuse_notification *notify_tail;
+    bool notify_running;
+    pthread_t notify_thread;
+
+    /* The FUSE instance, its channel and receiver threads */
+    struct fuse *fuse;
+    struct fuse_chan *chan;
+    pthread_t *workers;
+    int workers_size;
+
+    /* Spare receivers, max_deferred of them at most, and the number of
+     * running ones and of parked calls. Protected by lock. */
+    struct elfuse_spare *spares;
+    int spares_running;
+    int parked;
+};
 
-    /* Got the results, see if everything's fine */
-    if (elfuse_call.response_state == RESPONSE_SUCCESS) {
-        fprintf(stderr, "CREATE success (code=%d)\n", elfuse_call.results.create.code);
-        if (elfuse_call.results.create.code == CREATE_DONE) {
-            res = 0;
-        } else {
-            res = -ENOENT;
-        }
-    } else if (elfuse_call.response_state == RESPONSE_UNDEFINED) {
-        fprintf(stderr, "CREATE fail (operation undefined)\n");
-        res = -ENOSYS;
-    } else if (elfuse_call.response_state == RESPONSE_SIGNAL_ERROR) {
-        fprintf(stderr, "CREATE fail (elfuse signal with errno %d)\n", elfuse_call.response_err_code);
-        res = -elfuse_call.response_err_code;
-    } else {
-        fprintf(stderr, "CREATE fail (unknown error\n)");
-        res = -ENOSYS;
-    }
+/* Write end of the pipe Emacs is watching, -1 if Emacs polls instead.
+ * Shared by all mounts. */
+static pthread_mutex_t elfuse_wakeup_lock = PTHREAD_MUTEX_INITIALIZER;
+static int elfuse_wakeup_fd = -1;
 
-    elfuse_call.request_state = WAITING_NONE;
-    pthread_mutex_unlock(&elfuse_mutex);
+static struct elfuse_mount *
+elfuse_current_mount(void)
+{
+    if (elfuse_current_loopback != NULL)
+        return elfuse_current_loopback;
+    return fuse_get_context()->private_data;
+}
 
-    return res;
+/* Process making the current request */
+static pid_t
+elfuse_current_pid(void)
+{
+    if (elfuse_current_loopback != NULL)
+        return getpid();
+    return fuse_get_context()->pid;
 }
 
-static int
-elfuse_rename(const char *oldpath, const char *newpath)
+bool
+elfuse_set_route(struct elfuse_mount *mount, const char *prefix, int route, uint32_t ops)
 {
-    int res = 0;
+    if (!elfuse_routes_set(&mount->routes, prefix, route, ops))
+        return false;
 
-    pthread_mutex_lock(&elfuse_mutex);
+    /* Whatever was cached may have come from other handlers */
+    elfuse_invalidate_all(mount);
+    return true;
+}
 
-    /* Function to call */
-    elfuse_call.request_state = WAITING_RENAME;
-    elfuse_call.response_state = RESPONSE_NOTREADY;
+void
+elfuse_unset_route(struct elfuse_mount *mount, const char *prefix)
+{
+    elfuse_routes_unset(&mount->routes, prefix);
+    elfuse_invalidate_all(mount);
+}
 
-    /* Set function args */
-    elfuse_call.args.rename.oldpath = oldpath;
-    elfuse_call.args.rename.newpath = newpath;
+/* Record an incoming request if the mount is being traced */
+static void
+elfuse_trace(struct elfuse_mount *mount, enum elfuse_trace_op op, const char *path,
+             const char *path2, uint64_t offset, uint64_t size)
+{
+    if (atomic_load_explicit(&mount->trace.active, memory_order_relaxed))
+        elfuse_trace_write(&mount->trace, op, elfuse_current_pid(), path, path2, offset, size);
+}
 
-    /* Wait for the funcall results */
-    fprintf(stderr, "RENAME request (oldpath=%s, newpath=%s).\n", oldpath, newpath);
-    pthread_cond_wait(&elfuse_cond_var, &elfuse_mutex);
+bool
+elfuse_mount_trace(struct elfuse_mount *mount, const char *filename)
+{
+    return elfuse_trace_open(&mount->trace, filename);
+}
 
-    if (elfuse_call.response_state == RESPONSE_SUCCESS) {
-        if (elfuse_call.results.rename.code == RENAME_DONE) {
-            fprintf(stderr, "RENAME success (code=DONE)\n");
-            res = 0;
-        }  {
-            fprintf(stderr, "RENAME success (code=UNKNOWN)\n");
-            res = -ENOENT;
-        }
-    } else if (elfuse_call.response_state == RESPONSE_UNDEFINED) {
-        fprintf(stderr, "RENAME fail (operation undefined)\n");
-        res = -ENOSYS;
-    } else if (elfuse_call.response_state == RESPONSE_SIGNAL_ERROR) {
-        fprintf(stderr, "RENAME fail (elfuse signal with errno %d)\n", elfuse_call.response_err_code);
-        res = -elfuse_call.response_err_code;
-    } else {
-        fprintf(stderr, "RENAME fail unknown error\n");
-        res = -ENOSYS;
+/* Find the handlers of PATH, return the route if they handle any of OPS and
+ * point RELATIVE to the path they see. Paths nothing is routed to fail
+ * right away. */
+static int
+elfuse_route(struct elfuse_mount *mount, const char *path, uint32_t ops, const char **relative)
+{
+    int route;
+    uint32_t route_ops;
+    switch (elfuse_routes_match(&mount->routes, path, &route, &route_ops, relative)) {
+    case ROUTE_FOUND:
+        return (route_ops & ops) != 0 ? route : -ENOSYS;
+    case ROUTE_INNER:
+        /* Directories leading to routes are read-only */
+        return -EACCES;
+    default:
+        return -ENOENT;
     }
+}
 
-    elfuse_call.request_state = WAITING_NONE;
-    pthread_mutex_unlock(&elfuse_mutex);
+/* A directory only there because something is routed below it */
+static bool
+elfuse_synthetic_dir(struct elfuse_mount *mount, const char *path)
+{
+    int route;
+    uint32_t ops;
+    const char *relative;
+    return elfuse_routes_match(&mount->routes, path, &route, &ops, &relative) == ROUTE_INNER;
+}
 
-    return res;
+struct elfuse_call_state *
+elfuse_call_new(enum elfuse_request_state request_state)
+{
+    struct elfuse_call_state *call = calloc(1, sizeof(*call));
+    if (call == NULL)
+        return NULL;
+
+    call->request_state = request_state;
+    call->response_state = RESPONSE_NOTREADY;
+    call->received_ns = elfuse_stats_now();
+    pthread_cond_init(&call->cond, NULL);
+
+    return call;
 }
 
-static int
-elfuse_getattr(const char *path, struct stat *stbuf)
+void
+elfuse_call_free(struct elfuse_call_state *call)
 {
-    int res = 0;
+    pthread_cond_destroy(&call->cond);
+    free(call);
+}
 
-    pthread_mutex_lock(&elfuse_mutex);
+const char *
+elfuse_call_path(const struct elfuse_call_state *call)
+{
+    switch (call->request_state) {
+    case WAITING_CREATE:
+        return call->args.create.path;
+    case WAITING_RENAME:
+        return call->args.rename.oldpath;
+    case WAITING_GETATTR:
+        return call->args.getattr.path;
+    case WAITING_READDIR:
+        return call->args.readdir.path;
+    case WAITING_OPEN:
+        return call->args.open.path;
+    case WAITING_RELEASE:
+        return call->args.release.path;
+    case WAITING_READ:
+        return call->args.read.path;
+    case WAITING_WRITE:
+        return call->args.write.path;
+    case WAITING_TRUNCATE:
+        return call->args.truncate.path;
+    case WAITING_UNLINK:
+        return call->args.unlink.path;
+    default:
+        return NULL;
+    }
+}
 
-    /* Function to call */
-    elfuse_call.request_state = WAITING_GETATTR;
-    elfuse_call.response_state = RESPONSE_NOTREADY;
+void
+elfuse_call_finish(struct elfuse_mount *mount, struct elfuse_call_state *call, int res, uint64_t bytes)
+{
+    ELFUSE_PROBE4(reply, call->request_state, elfuse_call_path(call), res, bytes);
+    elfuse_stats_record(&mount->stats, call, res, bytes);
+    elfuse_call_free(call);
+}
 
-    /* Set function args */
-    elfuse_call.args.getattr.path = path;
+void
+elfuse_call_wait(struct elfuse_mount *mount, struct elfuse_call_state *call)
+{
+    pthread_mutex_lock(&mount->lock);
 
-    /* Wait for the funcall results */
-    fprintf(stderr, "GETATTR request (path=%s)\n", path);
-    pthread_cond_wait(&elfuse_cond_var, &elfuse_mutex);
+    if (mount->queue_stopped) {
+        call->response_state = RESPONSE_UNKNOWN_ERROR;
+        pthread_mutex_unlock(&mount->lock);
+        return;
+    }
 
-    /* Got the results, see if everything's fine */
-    if (elfuse_call.response_state == RESPONSE_SUCCESS) {
-        memset(stbuf, 0, sizeof(struct stat));
-        if (elfuse_call.results.getattr.code == GETATTR_FILE) {
-            fprintf(stderr, "GETATTR success (file %s)\n", path);
-            stbuf->st_mode = S_IFREG | 0666;
-            stbuf->st_nlink = 1;
-            stbuf->st_size = elfuse_call.results.getattr.file_size;
-            res = 0;
-        } else if (elfuse_call.results.getattr.code == GETATTR_DIR) {
-            fprintf(stderr, "GETATTR success (dir %s)\n", path);
-            stbuf->st_mode = S_IFDIR | 0755;
-            stbuf->st_nlink = 2;
-            res = 0;
-        } else {
-            fprintf(stderr, "GETATTR success (unknown %s)\n", path);
-            res = -ENOENT;
-        }
-    } else if (elfuse_call.response_state == RESPONSE_UNDEFINED) {
-        fprintf(stderr, "GETATTR fail (operation undefined)\n");
-        res = -ENOSYS;
-    } else if (elfuse_call.response_state == RESPONSE_SIGNAL_ERROR) {
-        fprintf(stderr, "GETATTR fail (elfuse signal with errno %d)\n", elfuse_call.response_err_code);
-        res = -elfuse_call.response_err_code;
+    call->next = NULL;
+    if (mount->queue_tail != NULL) {
+        mount->queue_tail->next = call;
     } else {
-        fprintf(stderr, "GETATTR fail (unknown error)\n");
-        res = -ENOSYS;
+        mount->queue_head = call;
+    }
+    mount->queue_tail = call;
+    mount->queue_size++;
+    ELFUSE_PROBE3(enqueue, call->request_state, elfuse_call_path(call), mount->queue_size);
+
+    /* Emacs drains the queue until it is empty, so it only needs a wakeup
+     * byte when the queue stops being empty */
+    if (!mount->wakeup_pending) {
+        pthread_mutex_lock(&elfuse_wakeup_lock);
+        if (elfuse_wakeup_fd >= 0) {
+            if (write(elfuse_wakeup_fd, "", 1) < 0 && errno != EAGAIN)
+                elfuse_log_warn("failed to wake up Emacs (errno=%d)", errno);
+            mount->wakeup_pending = true;
+        }
+        pthread_mutex_unlock(&elfuse_wakeup_lock);
     }
 
-    elfuse_call.request_state = WAITING_NONE;
-    pthread_mutex_unlock(&elfuse_mutex);
+    /* The mutex is only held while waiting on the condition variable, i.e.
+     * other FUSE threads are free to enqueue their own requests meanwhile */
+    while (!call->done)
+        pthread_cond_wait(&call->cond, &mount->lock);
 
-    return res;
+    pthread_mutex_unlock(&mount->lock);
 }
 
-static int
-elfuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-			 off_t offset, struct fuse_file_info *fi)
+struct elfuse_call_state *
+elfuse_call_dequeue(struct elfuse_mount *mount)
 {
-    (void) offset;
-    (void) fi;
-
-    int res = 0;
+    pthread_mutex_lock(&mount->lock);
+
+    struct elfuse_call_state *call = mount->queue_head;
+    if (call != NULL) {
+        mount->queue_head = call->next;
+        if (mount->queue_head == NULL)
+            mount->queue_tail = NULL;
+        call->next = NULL;
+        call->dequeued_ns = elfuse_stats_now();
+        mount->queue_size--;
+        ELFUSE_PROBE3(dequeue, call->request_state, elfuse_call_path(call),
+                      call->dequeued_ns - call->received_ns);
+    }
+    if (mount->queue_head == NULL)
+        mount->wakeup_pending = false;
 
-    pthread_mutex_lock(&elfuse_mutex);
+    pthread_mutex_unlock(&mount->lock);
+    return call;
+}
 
-    /* Function to call */
-    elfuse_call.request_state = WAITING_READDIR;
-    elfuse_call.response_state = RESPONSE_NOTREADY;
+size_t
+elfuse_queue_length(struct elfuse_mount *mount)
+{
+    pthread_mutex_lock(&mount->lock);
+    size_t size = mount->queue_size;
+    pthread_mutex_unlock(&mount->lock);
+    return size;
+}
 
-    /* Set function args */
-    elfuse_call.args.readdir.path = path;
+static void *elfuse_spare_loop(void *data);
 
-    /* Wait for results */
-    fprintf(stderr, "READDIR request (path=%s)\n", path);
-    pthread_cond_wait(&elfuse_cond_var, &elfuse_mutex);
+bool
+elfuse_call_park(struct elfuse_mount *mount, struct elfuse_call_state *call)
+{
+    pthread_mutex_lock(&mount->lock);
 
-    /* Got the results, see if everything's fine */
-    if (elfuse_call.response_state == RESPONSE_SUCCESS) {
-        size_t files_size = elfuse_call.results.readdir.files_size;
-        fprintf(stderr, "READDIR success (files found = %ld)\n", files_size);
-        for (size_t i = 0; i < files_size; i++) {
-            filler(buf, elfuse_call.results.readdir.files[i], NULL, 0);
+    if (mount->parked >= mount->max_deferred) {
+        pthread_mutex_unlock(&mount->lock);
+        return false;
+    }
+    call->parked = true;
+    mount->parked++;
+
+    /* Keep as many threads receiving requests as the mount started with.
+     * Requests to loopback mounts come from their driver threads instead. */
+    if (!mount->loopback && mount->spares_running < mount->parked) {
+        struct elfuse_spare *spare = NULL;
+        for (int i = 0; spare == NULL && i < mount->max_deferred; i++) {
+            if (!mount->spares[i].started || mount->spares[i].exited)
+                spare = &mount->spares[i];
         }
 
-        free(elfuse_call.results.readdir.files);
-        res = 0;
-    } else if (elfuse_call.response_state == RESPONSE_UNDEFINED) {
-        fprintf(stderr, "READDIR fail (operation undefined)\n");
-        res = -ENOSYS;
-    } else if (elfuse_call.response_state == RESPONSE_SIGNAL_ERROR) {
-        fprintf(stderr, "READDIR fail (elfuse signal with errno %d)\n", elfuse_call.response_err_code);
-        res = -elfuse_call.response_err_code;
-    } else {
-        fprintf(stderr, "READDIR fail (unknown error)\n");
-        res = -ENOSYS;
+        /* Fewer spares run than calls are parked, one slot is free */
+        if (spare->started)
+            pthread_join(spare->thread, NULL);
+        spare->mount = mount;
+        spare->exited = false;
+        spare->started = pthread_create(&spare->thread, NULL, elfuse_spare_loop, spare) == 0;
+        if (spare->started)
+            mount->spares_running++;
+        else
+            elfuse_log_warn("failed to launch a spare worker");
     }
 
-    elfuse_call.request_state = WAITING_NONE;
-    pthread_mutex_unlock(&elfuse_mutex);
+    pthread_mutex_unlock(&mount->lock);
+    return true;
+}
+
+void
+elfuse_call_complete(struct elfuse_mount *mount, struct elfuse_call_state *call,
+                     enum elfuse_response_state response_state)
+{
+    call->handled_ns = elfuse_stats_now();
 
-    return res;
+    pthread_mutex_lock(&mount->lock);
+    if (call->parked) {
+        call->parked = false;
+        mount->parked--;
+    }
+    call->response_state = response_state;
+    call->done = true;
+    pthread_cond_signal(&call->cond);
+    pthread_mutex_unlock(&mount->lock);
 }
 
-static int
-elfuse_open(const char *path, struct fuse_file_info *fi)
+void
+elfuse_set_wakeup_fd(int fd)
 {
-    int res = 0;
+    if (fd >= 0)
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    pthread_mutex_lock(&elfuse_wakeup_lock);
+    if (elfuse_wakeup_fd >= 0)
+        close(elfuse_wakeup_fd);
+    elfuse_wakeup_fd = fd;
+    pthread_mutex_unlock(&elfuse_wakeup_lock);
+}
 
-    /* TODO: should be handled on the Emacs side of things */
-    if ((fi->flags & 3) != O_RDONLY)
-        return -EACCES;
+static void
+elfuse_queue_start(struct elfuse_mount *mount)
+{
+    pthread_mutex_lock(&mount->lock);
+    mount->queue_stopped = false;
+    pthread_mutex_unlock(&mount->lock);
+}
 
-    pthread_mutex_lock(&elfuse_mutex);
+static void
+elfuse_queue_stop(struct elfuse_mount *mount)
+{
+    pthread_mutex_lock(&mount->lock);
+
+    /* Fail everything still waiting for Emacs and refuse new requests so
+     * that FUSE threads can get back to their (cancellable) receive loop */
+    mount->queue_stopped = true;
+    while (mount->queue_head != NULL) {
+        struct elfuse_call_state *call = mount->queue_head;
+        mount->queue_head = call->next;
+
+        call->response_state = RESPONSE_UNKNOWN_ERROR;
+        call->done = true;
+        pthread_cond_signal(&call->cond);
+    }
+    mount->queue_tail = NULL;
+    mount->queue_size = 0;
+    mount->wakeup_pending = false;
 
-    /* Function to call */
-    elfuse_call.request_state = WAITING_OPEN;
-    elfuse_call.response_state = RESPONSE_NOTREADY;
+    pthread_mutex_unlock(&mount->lock);
+}
 
-    /* Set callback args */
-    elfuse_call.args.open.path = path;
+void
+elfuse_invalidate_attr(struct elfuse_mount *mount, const char *path)
+{
+    elfuse_cache_remove(&mount->attr_cache, path, false);
+    elfuse_cache_remove(&mount->negative_cache, path, false);
+}
 
-    /* Wait for results */
-    fprintf(stderr, "OPEN request (path=%s)\n", path);
-    pthread_cond_wait(&elfuse_cond_var, &elfuse_mutex);
+void
+elfuse_invalidate_content(struct elfuse_mount *mount, const char *path)
+{
+    /* The blocks of a file are grouped under its path */
+    elfuse_cache_remove_group(&mount->block_cache, path);
+}
 
-    if (elfuse_call.response_state == RESPONSE_SUCCESS) {
-        fprintf(stderr, "OPEN success (code=%d)\n", elfuse_call.results.open.code);
+void
+elfuse_invalidate_all(struct elfuse_mount *mount)
+{
+    elfuse_cache_clear(&mount->attr_cache);
+    elfuse_cache_clear(&mount->negative_cache);
+    elfuse_cache_clear(&mount->block_cache);
+}
 
-        if (elfuse_call.results.open.code == OPEN_FOUND) {
-            res = 0;
-        } else {
-            res = -EACCES;
-        }
-    } else if (elfuse_call.response_state == RESPONSE_UNDEFINED) {
-        fprintf(stderr, "OPEN fail (operation undefined)\n");
-        res = -ENOSYS;
-    } else if (elfuse_call.response_state == RESPONSE_SIGNAL_ERROR) {
-        fprintf(stderr, "OPEN fail (elfuse signal with errno %d)\n", elfuse_call.response_err_code);
-        res = -elfuse_call.response_err_code;
+/* Split "/a/b" into "/a" and "b", PARENT must fit the whole path */
+static const char *
+elfuse_split_path(const char *path, char *parent)
+{
+    const char *slash = strrchr(path, '/');
+    size_t length = slash > path ? (size_t) (slash - path) : 1;
+    memcpy(parent, path, length);
+    parent[length] = '\0';
+    return slash + 1;
+}
+
+/* Remember the node id the current request carries for a path */
+static void
+elfuse_learn_node(struct elfuse_mount *mount, const char *path)
+{
+    const struct fuse_in_header *in = elfuse_current_in;
+    if (in == NULL)
+        return;
+
+    uint64_t generation = elfuse_cache_generation(&mount->node_cache);
+    uint64_t nodeid;
+    switch (in->opcode) {
+    case FUSE_LOOKUP: {
+        /* Lookups carry the node id of the parent directory */
+        char parent[strlen(path) + 1];
+        elfuse_split_path(path, parent);
+        if (!elfuse_cache_get(&mount->node_cache, parent, &nodeid) || nodeid != in->nodeid)
+            elfuse_cache_put(&mount->node_cache, parent, &in->nodeid, INFINITY, generation);
+        break;
+    }
+    case FUSE_GETATTR:
+    case FUSE_OPEN:
+    case FUSE_OPENDIR:
+        if (!elfuse_cache_get(&mount->node_cache, path, &nodeid) || nodeid != in->nodeid)
+            elfuse_cache_put(&mount->node_cache, path, &in->nodeid, INFINITY, generation);
+        break;
+    default:
+        break;
+    }
+}
+
+bool
+elfuse_notify(struct elfuse_mount *mount, enum elfuse_notify_kind kind, const char *path)
+{
+    /* Our own caches first, the kernel may ask again right away */
+    if (kind == NOTIFY_DELETED) {
+        elfuse_cache_remove(&mount->attr_cache, path, true);
+        elfuse_cache_remove(&mount->negative_cache, path, false);
+        elfuse_cache_remove(&mount->block_cache, path, true);
     } else {
-        fprintf(stderr, "OPEN fail (unknown error\n)");
-        res = -ENOSYS;
+        elfuse_invalidate_attr(mount, path);
+        elfuse_invalidate_content(mount, path);
     }
 
-    elfuse_call.request_state = WAITING_NONE;
-    pthread_mutex_unlock(&elfuse_mutex);
+    size_t path_size = strlen(path) + 1;
+    struct elfuse_notification *notification = malloc(sizeof(*notification) + path_size);
+    if (notification == NULL)
+        return false;
+    notification->next = NULL;
+    notification->kind = kind;
+    memcpy(notification->path, path, path_size);
 
-    return res;
-}
+    pthread_mutex_lock(&mount->notify_lock);
 
-static int
-elfuse_release(const char *path, struct fuse_file_info *fi)
-{
-    int res = 0;
+    if (!mount->notify_running) {
+        pthread_mutex_unlock(&mount->notify_lock);
+        free(notification);
+        return false;
+    }
 
-    /* TODO: should be handled on the Emacs side of things */
-    if ((fi->flags & 3) != O_RDONLY)
-        return -EACCES;
+    /* A buffer being edited announces the same change over and over */
+    for (struct elfuse_notification *pending = mount->notify_head; pending; pending = pending->next) {
+        if (pending->kind == kind && strcmp(pending->path, path) == 0) {
+            pthread_mutex_unlock(&mount->notify_lock);
+            free(notification);
+            return true;
+        }
+    }
 
-    pthread_mutex_lock(&elfuse_mutex);
+    if (mount->notify_tail)
+        mount->notify_tail->next = notification;
+    else
+        mount->notify_head = notification;
+    mount->notify_tail = notification;
+    pthread_cond_signal(&mount->notify_cond);
 
-    /* Function to call */
-    elfuse_call.request_state = WAITING_RELEASE;
-    elfuse_call.response_state = RESPONSE_NOTREADY;
+    pthread_mutex_unlock(&mount->notify_lock);
+    return true;
+}
 
-    /* Set callback args */
-    elfuse_call.args.release.path = path;
+/* Per-open state of a file, in fi->fh */
+struct elfuse_file {
+    pthread_mutex_t lock;
+
+    /* Where the next read starts if the file is read sequentially, and how
+     * many reads in a row did so */
+    off_t next_offset;
+    int sequential_reads;
+
+    /* The last window read ahead, only valid while the contents of the file
+     * weren't invalidated since */
+    char *window;
+    off_t window_offset;
+    size_t window_length;
+    bool window_eof;
+    uint64_t window_generation;
+
+    /* Size of the next window, doubled with every one of them */
+    size_t window_size;
+
+    /* Contiguous writes not handed to Emacs yet */
+    char *pending;
+    off_t pending_offset;
+    size_t pending_length;
+    size_t pending_capacity;
+    double pending_since;
+
+    /* Where the pending writes go, the error flushing them on age failed
+     * with, and the links of the mount's list of files with pending writes */
+    char *pending_path;
+    int pending_error;
+    struct elfuse_file *pending_prev;
+    struct elfuse_file *pending_next;
+};
 
-    /* Wait for results */
-    fprintf(stderr, "RELEASE request (path=%s)\n", path);
-    pthread_cond_wait(&elfuse_cond_var, &elfuse_mutex);
+static struct elfuse_file *
+elfuse_file_new(void)
+{
+    struct elfuse_file *file = calloc(1, sizeof(*file));
+    if (file != NULL)
+        pthread_mutex_init(&file->lock, NULL);
+    return file;
+}
 
-    if (elfuse_call.response_state == RESPONSE_SUCCESS) {
-        fprintf(stderr, "RELEASE success (code=%d)\n", elfuse_call.results.release.code);
+static void
+elfuse_file_free(struct elfuse_file *file)
+{
+    if (file == NULL)
+        return;
+    pthread_mutex_destroy(&file->lock);
+    free(file->window);
+    free(file->pending);
+    free(file->pending_path);
+    free(file);
+}
 
-        if (elfuse_call.results.release.code == RELEASE_FOUND) {
-            res = 0;
-        } else {
-            res = -EACCES;
-        }
-    } else if (elfuse_call.response_state == RESPONSE_UNDEFINED) {
-        fprintf(stderr, "RELEASE fail (operation undefined)\n");
-        res = -ENOSYS;
-    } else if (elfuse_call.response_state == RESPONSE_SIGNAL_ERROR) {
-        fprintf(stderr, "RELEASE fail (elfuse signal with errno %d)\n", elfuse_call.response_err_code);
-        res = -elfuse_call.response_err_code;
-    } else {
-        fprintf(stderr, "RELEASE fail (unknown error\n)");
-        res = -ENOSYS;
+/* Let the flush thread hand the buffered writes of FILE to PATH on age,
+ * FILE must be locked */
+static void
+elfuse_pending_add(struct elfuse_mount *mount, struct elfuse_file *file, const char *path)
+{
+    if (file->pending_path == NULL || strcmp(file->pending_path, path) != 0) {
+        free(file->pending_path);
+        file->pending_path = strdup(path);
+        if (file->pending_path == NULL)
+            return;
     }
 
-    elfuse_call.request_state = WAITING_NONE;
-    pthread_mutex_unlock(&elfuse_mutex);
+    pthread_mutex_lock(&mount->pending_lock);
+    file->pending_next = NULL;
+    file->pending_prev = mount->pending_tail;
+    if (mount->pending_tail != NULL)
+        mount->pending_tail->pending_next = file;
+    else
+        mount->pending_head = file;
+    mount->pending_tail = file;
+    /* A new deadline for the flush thread */
+    pthread_cond_signal(&mount->pending_cond);
+    pthread_mutex_unlock(&mount->pending_lock);
+}
 
-    return res;
+/* FILE, locked, has no buffered writes anymore */
+static void
+elfuse_pending_remove(struct elfuse_mount *mount, struct elfuse_file *file)
+{
+    pthread_mutex_lock(&mount->pending_lock);
+    if (file->pending_prev != NULL)
+        file->pending_prev->pending_next = file->pending_next;
+    else if (mount->pending_head == file)
+        mount->pending_head = file->pending_next;
+    if (file->pending_next != NULL)
+        file->pending_next->pending_prev = file->pending_prev;
+    else if (mount->pending_tail == file)
+        mount->pending_tail = file->pending_prev;
+    file->pending_prev = NULL;
+    file->pending_next = NULL;
+    pthread_mutex_unlock(&mount->pending_lock);
 }
 
+/* Hand SIZE bytes at OFFSET to Emacs, return the number of bytes written or
+ * -errno */
 static int
-elfuse_read(const char *path, char *buf, size_t size, off_t offset,
-		      struct fuse_file_info *fi)
+elfuse_write_call(struct elfuse_mount *mount, const char *path, const char *buf, size_t size, off_t offset)
 {
-    (void) fi;
-
     int res = 0;
 
-    pthread_mutex_lock(&elfuse_mutex);
+    /* No need to bother Emacs without a handler */
+    const char *relative;
+    int route = elfuse_route(mount, path, ELFUSE_OP_BIT(OP_WRITE), &relative);
+    if (route < 0)
+        return route;
 
     /* Function to call */
-    elfuse_call.request_state = WAITING_READ;
-    elfuse_call.response_state = RESPONSE_NOTREADY;
+    struct elfuse_call_state *call = elfuse_call_new(WAITING_WRITE);
+    if (call == NULL)
+        return -ENOMEM;
 
     /* Set function args */
-    elfuse_call.args.read.path = path;
-    elfuse_call.args.read.offset = offset;
-    elfuse_call.args.read.size = size;
+    call->route = route;
+    call->args.write.path = relative;
+    call->args.write.buf = buf;
+    call->args.write.size = size;
+    call->args.write.offset = offset;
 
     /* Wait for the funcall results */
-    fprintf(stderr, "READ request (path=%s, size=%ld, offset=%ld).\n", path, size, offset);
-    pthread_cond_wait(&elfuse_cond_var, &elfuse_mutex);
-
-    if (elfuse_call.response_state == RESPONSE_SUCCESS) {
-        if (elfuse_call.results.read.bytes_read >= 0) {
-            fprintf(stderr, "READ success (data=%s, size=%d)\n", elfuse_call.results.read.data, elfuse_call.results.read.bytes_read);
-            memcpy(buf, elfuse_call.results.read.data, elfuse_call.results.read.bytes_read);
-            free(elfuse_call.results.read.data);
-            res = elfuse_call.results.read.bytes_read;
+    elfuse_log_debug("WRITE request (path=%s, size=%ld, offset=%ld)", path, size, offset);
+    elfuse_call_wait(mount, call);
+
+    if (call->response_state == RESPONSE_SUCCESS) {
+        elfuse_log_debug("WRITE success (size=%d)", call->results.write.size);
+        if (call->results.write.size >= 0) {
+            res = call->results.write.size;
         } else {
-            fprintf(stderr, "READ success (no data, size=%d)\n", elfuse_call.results.read.bytes_read);
             res = -ENOENT;
         }
-    } else if (elfuse_call.response_state == RESPONSE_UNDEFINED) {
-        fprintf(stderr, "READ fail (operation undefined)\n");
+    } else if (call->response_state == RESPONSE_UNDEFINED) {
+        elfuse_log_debug("WRITE fail (operation undefined)");
         res = -ENOSYS;
-    } else if (elfuse_call.response_state == RESPONSE_SIGNAL_ERROR) {
-        fprintf(stderr, "READ fail (elfuse signal with errno %d)\n", elfuse_call.response_err_code);
-        res = -elfuse_call.response_err_code;
+    } else if (call->response_state == RESPONSE_SIGNAL_ERROR) {
+        elfuse_log_debug("WRITE fail (elfuse signal with errno %d)", call->response_err_code);
+        res = -call->response_err_code;
     } else {
-        fprintf(stderr, "READ fail (unknown error\n)");
+        elfuse_log_warn("WRITE fail (unknown error)");
         res = -ENOSYS;
     }
 
-    elfuse_call.request_state = WAITING_NONE;
-    pthread_mutex_unlock(&elfuse_mutex);
+    /* The size might have changed */
+    elfuse_cache_remove(&mount->attr_cache, path, false);
+    elfuse_invalidate_content(mount, path);
+
+    elfuse_call_finish(mount, call, res, res > 0 ? res : 0);
 
     return res;
 }
 
+/* Hand buffered writes to Emacs, return 0 or -errno */
 static int
-elfuse_write(const char *path, const char *buf, size_t size, off_t offset,
-                        struct fuse_file_info *fi)
+elfuse_flush_file(struct elfuse_mount *mount, const char *path, struct elfuse_file *file)
 {
-    (void) fi;
+    /* A flush on age failed, the writer hears of it now */
+    int error = file->pending_error;
+    file->pending_error = 0;
+    if (file->pending_length == 0)
+        return error;
+
+    size_t length = file->pending_length;
+    file->pending_length = 0;
+    elfuse_pending_remove(mount, file);
+    int res = elfuse_write_call(mount, path, file->pending, length, file->pending_offset);
+    if (res < 0)
+        return res;
+
+    /* The writer was told everything was written */
+    return (size_t) res < length ? -EIO : 0;
+}
 
+static int
+elfuse_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+    struct elfuse_mount *mount = elfuse_current_mount();
+    elfuse_trace(mount, TRACE_CREATE, path, NULL, fi->flags, 0);
+    (void) mode;
     int res = 0;
 
-    pthread_mutex_lock(&elfuse_mutex);
+    /* No need to bother Emacs without a handler */
+    const char *relative;
+    int route = elfuse_route(mount, path, ELFUSE_OP_BIT(OP_CREATE), &relative);
+    if (route < 0)
+        return route;
 
     /* Function to call */
-    elfuse_call.request_state = WAITING_WRITE;
-    elfuse_call.response_state = RESPONSE_NOTREADY;
+    struct elfuse_call_state *call = elfuse_call_new(WAITING_CREATE);
+    if (call == NULL)
+        return -ENOMEM;
 
     /* Set function args */
-    elfuse_call.args.write.path = path;
-    elfuse_call.args.write.buf = buf;
-    elfuse_call.args.write.size = size;
-    elfuse_call.args.write.offset = offset;
+    call->route = route;
+    call->args.create.path = relative;
 
     /* Wait for the funcall results */
-    fprintf(stderr, "WRITE request (path=%s, size=%ld, offset=%ld).\n", path, size, offset);
-    pthread_cond_wait(&elfuse_cond_var, &elfuse_mutex);
+    elfuse_log_debug("CREATE request (path=%s)", path);
+    elfuse_call_wait(mount, call);
 
-    if (elfuse_call.response_state == RESPONSE_SUCCESS) {
-        fprintf(stderr, "WRITE success (size=%d)\n", elfuse_call.results.write.size);
-        if (elfuse_call.results.write.size >= 0) {
-            res = elfuse_call.results.write.size;
+    /* Got the results, see if everything's fine */
+    if (call->response_state == RESPONSE_SUCCESS) {
+        elfuse_log_debug("CREATE success (code=%d)", call->results.create.code);
+        if (call->results.create.code == CREATE_DONE) {
+            struct elfuse_file *file = elfuse_file_new();
+            fi->fh = (uintptr_t) file;
+            res = file != NULL ? 0 : -ENOMEM;
         } else {
             res = -ENOENT;
         }
-    } else if (elfuse_call.response_state == RESPONSE_UNDEFINED) {
-        fprintf(stderr, "WRITE fail (operation undefined)\n");
+    } else if (call->response_state == RESPONSE_UNDEFINED) {
+        elfuse_log_debug("CREATE fail (operation undefined)");
         res = -ENOSYS;
-    } else if (elfuse_call.response_state == RESPONSE_SIGNAL_ERROR) {
-        fprintf(stderr, "WRITE fail (elfuse signal with errno %d)\n", elfuse_call.response_err_code);
-        res = -elfuse_call.response_err_code;
+    } else if (call->response_state == RESPONSE_SIGNAL_ERROR) {
+        elfuse_log_debug("CREATE fail (elfuse signal with errno %d)", call->response_err_code);
+        res = -call->response_err_code;
     } else {
-        fprintf(stderr, "WRITE fail (unknown error\n)");
+        elfuse_log_warn("CREATE fail (unknown error)");
         res = -ENOSYS;
     }
 
-    elfuse_call.request_state = WAITING_NONE;
-    pthread_mutex_unlock(&elfuse_mutex);
+    /* The file might have been cached as missing */
+    elfuse_cache_remove(&mount->attr_cache, path, false);
+    elfuse_cache_remove(&mount->negative_cache, path, false);
+    elfuse_invalidate_content(mount, path);
+
+    elfuse_call_finish(mount, call, res, 0);
 
     return res;
 }
 
 static int
-elfuse_truncate(const char *path, off_t size)
+elfuse_rename(const char *oldpath, const char *newpath)
 {
-    size_t res = 0;
+    struct elfuse_mount *mount = elfuse_current_mount();
+    elfuse_trace(mount, TRACE_RENAME, oldpath, newpath, 0, 0);
+    int res = 0;
 
-    pthread_mutex_lock(&elfuse_mutex);
+    /* No need to bother Emacs without a handler */
+    const char *relative_old;
+    const char *relative_new;
+    int route = elfuse_route(mount, oldpath, ELFUSE_OP_BIT(OP_RENAME), &relative_old);
+    if (route < 0)
+        return route;
+    int new_route = elfuse_route(mount, newpath, ELFUSE_OP_BIT(OP_RENAME), &relative_new);
+    if (new_route < 0)
+        return new_route;
+
+    /* Handlers only know about their own subtree */
+    if (new_route != route)
+        return -EXDEV;
 
     /* Function to call */
-    elfuse_call.request_state = WAITING_TRUNCATE;
-    elfuse_call.response_state = RESPONSE_NOTREADY;
+    struct elfuse_call_state *call = elfuse_call_new(WAITING_RENAME);
+    if (call == NULL)
+        return -ENOMEM;
 
     /* Set function args */
-    elfuse_call.args.write.path = path;
-    elfuse_call.args.write.size = size;
+    call->route = route;
+    call->args.rename.oldpath = relative_old;
+    call->args.rename.newpath = relative_new;
 
     /* Wait for the funcall results */
-    fprintf(stderr, "TRUNCATE request (path=%s, size=%ld).\n", path, size);
-    pthread_cond_wait(&elfuse_cond_var, &elfuse_mutex);
+    elfuse_log_debug("RENAME request (oldpath=%s, newpath=%s)", oldpath, newpath);
+    elfuse_call_wait(mount, call);
 
-    if (elfuse_call.response_state == RESPONSE_SUCCESS) {
-        fprintf(stderr, "TRUNCATE success (code=%d)\n", elfuse_call.results.truncate.code);
-        if (elfuse_call.results.truncate.code == TRUNCATE_DONE) {
+    if (call->response_state == RESPONSE_SUCCESS) {
+        if (call->results.rename.code == RENAME_DONE) {
+            elfuse_log_debug("RENAME success (code=DONE)");
             res = 0;
         } else {
+            elfuse_log_debug("RENAME success (code=UNKNOWN)");
             res = -ENOENT;
         }
-    } else if (elfuse_call.response_state == RESPONSE_UNDEFINED) {
-        fprintf(stderr, "TRUNCATE fail (operation undefined)\n");
+    } else if (call->response_state == RESPONSE_UNDEFINED) {
+        elfuse_log_debug("RENAME fail (operation undefined)");
         res = -ENOSYS;
-    } else if (elfuse_call.response_state == RESPONSE_SIGNAL_ERROR) {
-        fprintf(stderr, "TRUNCATE fail (elfuse signal with errno %d)\n", elfuse_call.response_err_code);
-        res = -elfuse_call.response_err_code;
+    } else if (call->response_state == RESPONSE_SIGNAL_ERROR) {
+        elfuse_log_debug("RENAME fail (elfuse signal with errno %d)", call->response_err_code);
+        res = -call->response_err_code;
     } else {
-        fprintf(stderr, "TRUNCATE fail (unknown error\n)");
+        elfuse_log_warn("RENAME fail (unknown error)");
         res = -ENOSYS;
     }
 
-    elfuse_call.request_state = WAITING_NONE;
-    pthread_mutex_unlock(&elfuse_mutex);
+    /* Whatever was known about both paths and their children is stale now */
+    elfuse_cache_remove(&mount->attr_cache, oldpath, true);
+    elfuse_cache_remove(&mount->attr_cache, newpath, true);
+    elfuse_cache_remove(&mount->negative_cache, newpath, true);
+    elfuse_cache_remove(&mount->block_cache, oldpath, true);
+    elfuse_cache_remove(&mount->block_cache, newpath, true);
+
+    elfuse_call_finish(mount, call, res, 0);
 
     return res;
 }
 
+/* Translate file attributes reported by Emacs to a stat buffer */
 static int
-elfuse_unlink(const char *path)
+elfuse_fill_stat(struct stat *stbuf, const struct elfuse_results_getattr *attr)
 {
-    size_t res = 0;
+    memset(stbuf, 0, sizeof(struct stat));
+    if (attr->code == GETATTR_FILE) {
+        stbuf->st_mode = S_IFREG | 0666;
+        stbuf->st_nlink = 1;
+        stbuf->st_size = attr->file_size;
+        return 0;
+    } else if (attr->code == GETATTR_DIR) {
+        stbuf->st_mode = S_IFDIR | 0755;
+        stbuf->st_nlink = 2;
+        return 0;
+    }
+    return -ENOENT;
+}
+
+static int
+elfuse_getattr(const char *path, struct stat *stbuf)
+{
+    struct elfuse_mount *mount = elfuse_current_mount();
+    elfuse_trace(mount, TRACE_GETATTR, path, NULL, 0, 0);
+    int res = 0;
+
+    elfuse_learn_node(mount, path);
 
-    pthread_mutex_lock(&elfuse_mutex);
+    /* Recently seen attributes are answered without asking Emacs */
+    struct elfuse_results_getattr cached;
+    if (elfuse_cache_get(&mount->attr_cache, path, &cached)) {
+        ELFUSE_PROBE2(cache_hit, "attr", path);
+        return elfuse_fill_stat(stbuf, &cached);
+    }
+    if (elfuse_cache_get(&mount->negative_cache, path, NULL)) {
+        ELFUSE_PROBE2(cache_hit, "negative", path);
+        return -ENOENT;
+    }
+    ELFUSE_PROBE2(cache_miss, "attr", path);
+    uint64_t generation = elfuse_cache_generation(&mount->attr_cache);
+    uint64_t negative_generation = elfuse_cache_generation(&mount->negative_cache);
+
+    /* No need to bother Emacs without a handler */
+    const char *relative;
+    int route = elfuse_route(mount, path, ELFUSE_OP_BIT(OP_GETATTR), &relative);
+    if (route < 0) {
+        if (!elfuse_synthetic_dir(mount, path))
+            return route;
+        struct elfuse_results_getattr dir = { .code = GETATTR_DIR };
+        return elfuse_fill_stat(stbuf, &dir);
+    }
 
     /* Function to call */
-    elfuse_call.request_state = WAITING_UNLINK;
-    elfuse_call.response_state = RESPONSE_NOTREADY;
+    struct elfuse_call_state *call = elfuse_call_new(WAITING_GETATTR);
+    if (call == NULL)
+        return -ENOMEM;
 
     /* Set function args */
-    elfuse_call.args.unlink.path = path;
+    call->route = route;
+    call->args.getattr.path = relative;
+    call->results.getattr.ttl = -1;
 
     /* Wait for the funcall results */
-    fprintf(stderr, "UNLINK request (path=%s).\n", path);
-    pthread_cond_wait(&elfuse_cond_var, &elfuse_mutex);
+    elfuse_log_debug("GETATTR request (path=%s)", path);
+    elfuse_call_wait(mount, call);
 
-    if (elfuse_call.response_state == RESPONSE_SUCCESS) {
-        fprintf(stderr, "UNLINK success (code=%d)\n", elfuse_call.results.unlink.code);
-        if (elfuse_call.results.unlink.code == UNLINK_DONE) {
-            res = 0;
+    /* Got the results, see if everything's fine */
+    if (call->response_state == RESPONSE_SUCCESS) {
+        res = elfuse_fill_stat(stbuf, &call->results.getattr);
+        if (call->results.getattr.code == GETATTR_FILE) {
+            elfuse_log_debug("GETATTR success (file %s)", path);
+        } else if (call->results.getattr.code == GETATTR_DIR) {
+            elfuse_log_debug("GETATTR success (dir %s)", path);
         } else {
-            res = -ENOENT;
+            elfuse_log_debug("GETATTR success (unknown %s)", path);
+        }
+
+        if (res == 0) {
+            double ttl = call->results.getattr.ttl;
+            elfuse_cache_put(&mount->attr_cache, path, &call->results.getattr,
+                             ttl >= 0 ? ttl : mount->attr_cache_ttl, generation);
         }
-    } else if (elfuse_call.response_state == RESPONSE_UNDEFINED) {
-        fprintf(stderr, "TRUNCATE fail (operation undefined)\n");
+    } else if (call->response_state == RESPONSE_UNDEFINED) {
+        elfuse_log_debug("GETATTR fail (operation undefined)");
         res = -ENOSYS;
-    } else if (elfuse_call.response_state == RESPONSE_SIGNAL_ERROR) {
-        fprintf(stderr, "TRUNCATE fail (elfuse signal with errno %d)\n", elfuse_call.response_err_code);
-        res = -elfuse_call.response_err_code;
+    } else if (call->response_state == RESPONSE_SIGNAL_ERROR) {
+        elfuse_log_debug("GETATTR fail (elfuse signal with errno %d)", call->response_err_code);
+        res = -call->response_err_code;
     } else {
-        fprintf(stderr, "TRUNCATE fail (unknown error\n)");
+        elfuse_log_warn("GETATTR fail (unknown error)");
         res = -ENOSYS;
     }
 
-    elfuse_call.request_state = WAITING_NONE;
-    pthread_mutex_unlock(&elfuse_mutex);
+    /* Remember misses, be it a signal or an unknown file type */
+    if (res == -ENOENT)
+        elfuse_cache_put(&mount->negative_cache, path, NULL,
+                         mount->negative_cache_ttl, negative_generation);
+
+    elfuse_call_finish(mount, call, res, 0);
+
     return res;
 }
 
-static struct fuse_operations elfuse_oper = {
-    .create	= elfuse_create,
-    .rename	= elfuse_rename,
-    .getattr	= elfuse_getattr,
-    .readdir	= elfuse_readdir,
-    .open	= elfuse_open,
-    .release	= elfuse_release,
-    .read	= elfuse_read,
-    .write	= elfuse_write,
-    .truncate	= elfuse_truncate,
-    .unlink	= elfuse_unlink,
-};
+/* Cache the attributes of a file listed in the DIRPATH directory, saving
+ * the getattr round trips that usually follow a listing */
+static void
+elfuse_seed_attr(struct elfuse_mount *mount, const char *dirpath, const struct elfuse_readdir_entry *entry, uint64_t generation)
+{
+    if (strcmp(entry->name, ".") == 0 || strcmp(entry->name, "..") == 0)
+        return;
 
-static struct fuse *fuse;
+    size_t dirpath_length = strlen(dirpath);
+    if (dirpath_length > 0 && dirpath[dirpath_length - 1] == '/')
+        dirpath_length--;
 
-static void elfuse_cleanup_mount(void *mountpoint) {
-    fprintf(stderr, "Elfuse: unmounting\n");
-    fuse_unmount(mountpoint, NULL);
-    free(mountpoint);
-}
+    size_t path_size = dirpath_length + 1 + strlen(entry->name) + 1;
+    char path[path_size];
+    snprintf(path, path_size, "%.*s/%s", (int) dirpath_length, dirpath, entry->name);
 
-static void elfuse_cleanup_fuse(void *buf) {
-    fprintf(stderr, "Elfuse: cleanup fuse\n");
-    fuse_destroy(fuse);
-    free(buf);
+    double ttl = entry->attr.ttl >= 0 ? entry->attr.ttl : mount->attr_cache_ttl;
+    elfuse_cache_put(&mount->attr_cache, path, &entry->attr, ttl, generation);
+    elfuse_cache_remove(&mount->negative_cache, path, false);
 }
 
-void *
-elfuse_fuse_loop(void* mountpath)
-{
-    int argc = 2;
-    char* argv[] = {
-        "",
-        mountpath
-    };
-
+/* Listing state of an open directory: the page of entries the kernel is
+ * currently reading through */
+struct elfuse_dir_stream {
+    bool loaded;
 
-    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
-    char *mountpoint;
-    int err = -1;
+    struct elfuse_readdir_entry *entries;
+    size_t entries_size;
 
-    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
-    pthread_mutex_lock(&elfuse_mutex);
+    /* Kernel offset of the first entry on the page */
+    off_t page_start;
 
-    /* Parse arguments */
-    if (fuse_parse_cmdline(&args, &mountpoint, NULL, NULL) == -1) {
-        fprintf(stderr, "Elfuse: failed parsing the command line\n");
-        free(mountpath);
-        free(mountpoint);
+    /* Cursor the page was requested with and the one of the next page */
+    int64_t cursor;
+    int64_t next_cursor;
+    bool more;
+};
 
-        elfuse_init_code = INIT_ERR_ARGS;
-        pthread_cond_signal(&elfuse_cond_var);
-        pthread_mutex_unlock(&elfuse_mutex);
+static void
+elfuse_free_entries(struct elfuse_readdir_entry *entries, size_t entries_size)
+{
+    for (size_t i = 0; i < entries_size; i++)
+        free(entries[i].name);
+    free(entries);
+}
 
-        pthread_exit(NULL);
-    }
-    free(mountpath);
+static int
+elfuse_opendir(const char *path, struct fuse_file_info *fi)
+{
+    struct elfuse_mount *mount = elfuse_current_mount();
+    elfuse_trace(mount, TRACE_READDIR, path, NULL, 0, 0);
+    elfuse_learn_node(mount, path);
 
+    struct elfuse_dir_stream *stream = calloc(1, sizeof(*stream));
+    if (stream == NULL)
+        return -ENOMEM;
 
-    /* Mount the FUSE FS */
-    struct fuse_chan *ch = fuse_mount(mountpoint, &args);
-    if (ch == NULL) {
-        fprintf(stderr, "Elfuse: failed mounting\n");
+    fi->fh = (uintptr_t) stream;
+    return 0;
+}
 
-        elfuse_init_code = INIT_ERR_MOUNT;
-        pthread_cond_signal(&elfuse_cond_var);
-        pthread_mutex_unlock(&elfuse_mutex);
+static int
+elfuse_releasedir(const char *path, struct fuse_file_info *fi)
+{
+    (void) path;
 
-        pthread_exit(NULL);
+    struct elfuse_dir_stream *stream = (struct elfuse_dir_stream *) (uintptr_t) fi->fh;
+    if (stream != NULL) {
+        elfuse_free_entries(stream->entries, stream->entries_size);
+        free(stream);
     }
-    pthread_cleanup_push(elfuse_cleanup_mount, mountpoint);
-
-    /* Create the FUSE instance */
-    fuse = fuse_new(ch, &args, &elfuse_oper, sizeof(elfuse_oper), NULL);
-    if (fuse == NULL) {
-        fprintf(stderr, "Elfuse: failed creating FUSE\n");
+    return 0;
+}
 
-        elfuse_init_code = INIT_ERR_CREATE;
-        pthread_cond_signal(&elfuse_cond_var);
-        pthread_mutex_unlock(&elfuse_mutex);
+/* Append the next component of every route below PATH that ENTRIES don't
+ * list yet, routes show up in the directories above them */
+static int
+elfuse_add_route_entries(struct elfuse_mount *mount, const char *path,
+                         struct elfuse_readdir_entry **entries, size_t *entries_size)
+{
+    char **children = elfuse_routes_children(&mount->routes, path);
+    if (children == NULL)
+        return 0;
+
+    size_t count = 0;
+    while (children[count] != NULL)
+        count++;
+    struct elfuse_readdir_entry *grown = realloc(*entries, (*entries_size + count) * sizeof(grown[0]));
+    if (grown == NULL) {
+        elfuse_routes_free_children(children);
+        return -ENOMEM;
+    }
+    *entries = grown;
+
+    /* The entries take over the names */
+    size_t size = *entries_size;
+    for (size_t i = 0; i < count; i++) {
+        bool listed = false;
+        for (size_t j = 0; j < *entries_size && !listed; j++)
+            listed = strcmp(grown[j].name, children[i]) == 0;
+        if (listed) {
+            free(children[i]);
+            continue;
+        }
+        memset(&grown[size], 0, sizeof(grown[size]));
+        grown[size].name = children[i];
+        size++;
+    }
+    free(children);
+    *entries_size = size;
+
+    return 0;
+}
+
+/* Let STREAM hold the page of ENTRIES requested with CURSOR */
+static void
+elfuse_set_dir_page(struct elfuse_dir_stream *stream, struct elfuse_readdir_entry *entries, size_t entries_size,
+                    int64_t cursor, int64_t next_cursor, bool more)
+{
+    elfuse_free_entries(stream->entries, stream->entries_size);
+    stream->entries = entries;
+    stream->entries_size = entries_size;
+    stream->cursor = cursor;
+    stream->next_cursor = next_cursor;
+    stream->more = more;
+    stream->loaded = true;
+}
+
+/* List a directory that only leads to routes */
+static int
+elfuse_fetch_synthetic_dir(struct elfuse_mount *mount, const char *path, struct elfuse_dir_stream *stream)
+{
+    size_t entries_size = 2;
+    struct elfuse_readdir_entry *entries = calloc(entries_size, sizeof(entries[0]));
+    if (entries == NULL)
+        return -ENOMEM;
+    entries[0].name = strdup(".");
+    entries[1].name = strdup("..");
+
+    if (entries[0].name == NULL || entries[1].name == NULL
+        || elfuse_add_route_entries(mount, path, &entries, &entries_size) < 0) {
+        elfuse_free_entries(entries, entries_size);
+        return -ENOMEM;
+    }
+
+    elfuse_set_dir_page(stream, entries, entries_size, 0, 0, false);
+    return 0;
+}
+
+/* Replace the current page of STREAM with the one starting at CURSOR */
+static int
+elfuse_fetch_dir_page(struct elfuse_mount *mount, const char *path, struct elfuse_dir_stream *stream, int64_t cursor)
+{
+    int res = 0;
+
+    /* No need to bother Emacs without a handler */
+    const char *relative;
+    int route = elfuse_route(mount, path, ELFUSE_OP_BIT(OP_READDIR) | ELFUSE_OP_BIT(OP_READDIR_PAGE), &relative);
+    if (route < 0) {
+        if (!elfuse_synthetic_dir(mount, path))
+            return route;
+        return elfuse_fetch_synthetic_dir(mount, path, stream);
+    }
+
+    /* Function to call */
+    struct elfuse_call_state *call = elfuse_call_new(WAITING_READDIR);
+    if (call == NULL)
+        return -ENOMEM;
+
+    /* Set function args */
+    call->route = route;
+    call->args.readdir.path = relative;
+    call->args.readdir.cursor = cursor;
+    uint64_t generation = elfuse_cache_generation(&mount->attr_cache);
+
+    /* Wait for results */
+    elfuse_log_debug("READDIR request (path=%s, cursor=%ld)", path, (long) cursor);
+    elfuse_call_wait(mount, call);
+
+    /* Got the results, see if everything's fine */
+    if (call->response_state == RESPONSE_SUCCESS) {
+        size_t entries_size = call->results.readdir.entries_size;
+        elfuse_log_debug("READDIR success (files found = %ld)", entries_size);
+        for (size_t i = 0; i < entries_size; i++) {
+            struct elfuse_readdir_entry *entry = &call->results.readdir.entries[i];
+            if (entry->has_attr)
+                elfuse_seed_attr(mount, path, entry, generation);
+        }
+
+        /* Routes below the directory come with the first page */
+        if (cursor == 0)
+            res = elfuse_add_route_entries(mount, path, &call->results.readdir.entries,
+                                           &call->results.readdir.entries_size);
+
+        /* The stream takes over the entries */
+        if (res == 0) {
+            elfuse_set_dir_page(stream, call->results.readdir.entries, call->results.readdir.entries_size,
+                                cursor, call->results.readdir.next_cursor, call->results.readdir.more);
+            call->results.readdir.entries = NULL;
+            call->results.readdir.entries_size = 0;
+        }
+    } else if (call->response_state == RESPONSE_UNDEFINED) {
+        elfuse_log_debug("READDIR fail (operation undefined)");
+        res = -ENOSYS;
+    } else if (call->response_state == RESPONSE_SIGNAL_ERROR) {
+        elfuse_log_debug("READDIR fail (elfuse signal with errno %d)", call->response_err_code);
+        res = -call->response_err_code;
+    } else {
+        elfuse_log_warn("READDIR fail (unknown error)");
+        res = -ENOSYS;
+    }
+
+    elfuse_free_entries(call->results.readdir.entries, call->results.readdir.entries_size);
+    elfuse_call_finish(mount, call, res, 0);
+
+    return res;
+}
+
+static int
+elfuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+			 off_t offset, struct fuse_file_info *fi)
+{
+    struct elfuse_mount *mount = elfuse_current_mount();
+    struct elfuse_dir_stream *stream = (struct elfuse_dir_stream *) (uintptr_t) fi->fh;
+    int res = 0;
+
+    /* Entries are numbered across pages, the offset of an entry passed to
+     * filler is the number of the entry that follows it. Only a single page
+     * is kept around, going back (rewinddir) starts the listing over. */
+    if (!stream->loaded || offset < stream->page_start) {
+        res = elfuse_fetch_dir_page(mount, path, stream, 0);
+        if (res != 0)
+            return res;
+        stream->page_start = 0;
+    }
+
+    while (offset >= stream->page_start + (off_t) stream->entries_size) {
+        if (!stream->more)
+            return 0;
+
+        /* A handler that doesn't move forward has nothing else to list */
+        if (stream->entries_size == 0 && stream->next_cursor == stream->cursor)
+            return 0;
+
+        off_t next_page_start = stream->page_start + stream->entries_size;
+        res = elfuse_fetch_dir_page(mount, path, stream, stream->next_cursor);
+        if (res != 0)
+            return res;
+        stream->page_start = next_page_start;
+    }
+
+    for (off_t i = offset; i < stream->page_start + (off_t) stream->entries_size; i++) {
+        struct elfuse_readdir_entry *entry = &stream->entries[i - stream->page_start];
+        struct stat st;
+        const struct stat *stp = NULL;
+        if (entry->has_attr) {
+            elfuse_fill_stat(&st, &entry->attr);
+            stp = &st;
+        }
+
+        /* The kernel buffer is full, it will come back for the rest */
+        if (filler(buf, entry->name, stp, i + 1) != 0)
+            break;
+    }
+
+    return 0;
+}
+
+static int
+elfuse_open(const char *path, struct fuse_file_info *fi)
+{
+    struct elfuse_mount *mount = elfuse_current_mount();
+    elfuse_trace(mount, TRACE_OPEN, path, NULL, fi->flags, 0);
+    int res = 0;
+
+    elfuse_learn_node(mount, path);
+
+    /* No need to bother Emacs without a handler */
+    const char *relative;
+    int route = elfuse_route(mount, path, ELFUSE_OP_BIT(OP_OPEN), &relative);
+    if (route < 0)
+        return route;
+
+    /* The open handler doesn't see the flags, files without a write handler
+     * are read-only */
+    if (((fi->flags & O_ACCMODE) != O_RDONLY || (fi->flags & O_TRUNC))
+        && elfuse_route(mount, path, ELFUSE_OP_BIT(OP_WRITE), &relative) < 0)
+        return -EACCES;
+
+    /* Function to call */
+    struct elfuse_call_state *call = elfuse_call_new(WAITING_OPEN);
+    if (call == NULL)
+        return -ENOMEM;
+
+    /* Set callback args */
+    call->route = route;
+    call->args.open.path = relative;
+
+    /* Wait for results */
+    elfuse_log_debug("OPEN request (path=%s)", path);
+    elfuse_call_wait(mount, call);
+
+    if (call->response_state == RESPONSE_SUCCESS) {
+        elfuse_log_debug("OPEN success (code=%d)", call->results.open.code);
+
+        if (call->results.open.code == OPEN_FOUND) {
+            struct elfuse_file *file = elfuse_file_new();
+            fi->fh = (uintptr_t) file;
+            res = file != NULL ? 0 : -ENOMEM;
+        } else {
+            res = -EACCES;
+        }
+    } else if (call->response_state == RESPONSE_UNDEFINED) {
+        elfuse_log_debug("OPEN fail (operation undefined)");
+        res = -ENOSYS;
+    } else if (call->response_state == RESPONSE_SIGNAL_ERROR) {
+        elfuse_log_debug("OPEN fail (elfuse signal with errno %d)", call->response_err_code);
+        res = -call->response_err_code;
+    } else {
+        elfuse_log_warn("OPEN fail (unknown error)");
+        res = -ENOSYS;
+    }
+
+    elfuse_call_finish(mount, call, res, 0);
+
+    return res;
+}
+
+static int
+elfuse_release(const char *path, struct fuse_file_info *fi)
+{
+    struct elfuse_mount *mount = elfuse_current_mount();
+    elfuse_trace(mount, TRACE_RELEASE, path, NULL, 0, 0);
+    int res = 0;
+
+    /* Too late to tell the writer, flush had its chance. The flush thread
+     * may be flushing the file on age, it is done once the lock is taken. */
+    struct elfuse_file *file = (struct elfuse_file *) (uintptr_t) fi->fh;
+    pthread_mutex_lock(&file->lock);
+    if (elfuse_flush_file(mount, path, file) < 0)
+        elfuse_log_warn("RELEASE lost buffered writes (path=%s)", path);
+    pthread_mutex_unlock(&file->lock);
+    elfuse_file_free(file);
+    fi->fh = 0;
+
+    /* No need to bother Emacs without a handler */
+    const char *relative;
+    int route = elfuse_route(mount, path, ELFUSE_OP_BIT(OP_RELEASE), &relative);
+    if (route < 0)
+        return route;
+
+    /* Function to call */
+    struct elfuse_call_state *call = elfuse_call_new(WAITING_RELEASE);
+    if (call == NULL)
+        return -ENOMEM;
+
+    /* Set callback args */
+    call->route = route;
+    call->args.release.path = relative;
+
+    /* Wait for results */
+    elfuse_log_debug("RELEASE request (path=%s)", path);
+    elfuse_call_wait(mount, call);
+
+    if (call->response_state == RESPONSE_SUCCESS) {
+        elfuse_log_debug("RELEASE success (code=%d)", call->results.release.code);
+
+        if (call->results.release.code == RELEASE_FOUND) {
+            res = 0;
+        } else {
+            res = -EACCES;
+        }
+    } else if (call->response_state == RESPONSE_UNDEFINED) {
+        elfuse_log_debug("RELEASE fail (operation undefined)");
+        res = -ENOSYS;
+    } else if (call->response_state == RESPONSE_SIGNAL_ERROR) {
+        elfuse_log_debug("RELEASE fail (elfuse signal with errno %d)", call->response_err_code);
+        res = -call->response_err_code;
+    } else {
+        elfuse_log_warn("RELEASE fail (unknown error)");
+        res = -ENOSYS;
+    }
+
+    elfuse_call_finish(mount, call, res, 0);
+
+    return res;
+}
+
+/* Ask Emacs for SIZE bytes at OFFSET, return the number of bytes read into
+ * *DATA (to be freed) or -errno */
+static int
+elfuse_read_call(struct elfuse_mount *mount, const char *path, size_t size, off_t offset, char **data)
+{
+    int res = 0;
+
+    /* No need to bother Emacs without a handler */
+    const char *relative;
+    int route = elfuse_route(mount, path, ELFUSE_OP_BIT(OP_READ), &relative);
+    if (route < 0)
+        return route;
+
+    /* Function to call */
+    struct elfuse_call_state *call = elfuse_call_new(WAITING_READ);
+    if (call == NULL)
+        return -ENOMEM;
+
+    /* Set function args */
+    call->route = route;
+    call->args.read.path = relative;
+    call->args.read.offset = offset;
+    call->args.read.size = size;
+
+    /* Wait for the funcall results */
+    elfuse_log_debug("READ request (path=%s, size=%ld, offset=%ld)", path, size, offset);
+    elfuse_call_wait(mount, call);
+
+    if (call->response_state == RESPONSE_SUCCESS) {
+        if (call->results.read.bytes_read >= 0) {
+            elfuse_log_debug("READ success (size=%d)", call->results.read.bytes_read);
+            *data = call->results.read.data;
+            /* Never more than asked for */
+            res = (size_t) call->results.read.bytes_read < size ? call->results.read.bytes_read : (int) size;
+        } else {
+            elfuse_log_debug("READ success (no data, size=%d)", call->results.read.bytes_read);
+            free(call->results.read.data);
+            res = -ENOENT;
+        }
+    } else if (call->response_state == RESPONSE_UNDEFINED) {
+        elfuse_log_debug("READ fail (operation undefined)");
+        res = -ENOSYS;
+    } else if (call->response_state == RESPONSE_SIGNAL_ERROR) {
+        elfuse_log_debug("READ fail (elfuse signal with errno %d)", call->response_err_code);
+        res = -call->response_err_code;
+    } else {
+        elfuse_log_warn("READ fail (unknown error)");
+        res = -ENOSYS;
+    }
+
+    elfuse_call_finish(mount, call, res, res > 0 ? res : 0);
+
+    return res;
+}
+
+static bool
+elfuse_block_cache_enabled(struct elfuse_mount *mount)
+{
+    return mount->read_cache_ttl > 0 && mount->read_cache_size >= ELFUSE_BLOCK_SIZE;
+}
+
+static bool
+elfuse_get_block(struct elfuse_mount *mount, const char *path, uint64_t index, struct elfuse_block *block)
+{
+    char key[strlen(path) + 32];
+    snprintf(key, sizeof(key), "%s/%" PRIu64, path, index);
+    if (!elfuse_cache_get(&mount->block_cache, key, block)) {
+        ELFUSE_PROBE2(cache_miss, "block", path);
+        return false;
+    }
+    ELFUSE_PROBE2(cache_hit, "block", path);
+    return true;
+}
+
+static void
+elfuse_put_block(struct elfuse_mount *mount, const char *path, uint64_t index, const char *data, size_t length, uint64_t generation)
+{
+    struct elfuse_block block;
+    block.length = length;
+    memcpy(block.data, data, length);
+
+    char key[strlen(path) + 32];
+    snprintf(key, sizeof(key), "%s/%" PRIu64, path, index);
+    elfuse_cache_put_member(&mount->block_cache, path, key, &block, mount->read_cache_ttl, generation);
+}
+
+/* Copy what the current window holds at POSITION, return the number of bytes
+ * copied or -1 if the window doesn't cover POSITION */
+static ssize_t
+elfuse_read_window(struct elfuse_mount *mount, const char *path, struct elfuse_file *file, char *buf, size_t size, off_t position)
+{
+    if (file->window == NULL && !file->window_eof)
+        return -1;
+
+    /* Dropped if the contents of the file were invalidated since it was read */
+    if (file->window_generation != elfuse_cache_group_generation(&mount->block_cache, path)) {
+        free(file->window);
+        file->window = NULL;
+        file->window_eof = false;
+        return -1;
+    }
+
+    off_t window_end = file->window_offset + file->window_length;
+    if (position < file->window_offset || position > window_end)
+        return -1;
+    if (position == window_end)
+        return file->window_eof ? 0 : -1;
+
+    size_t length = window_end - position < (off_t) size ? (size_t) (window_end - position) : size;
+    memcpy(buf, file->window + (position - file->window_offset), length);
+    return length;
+}
+
+static int
+elfuse_read_locked(struct elfuse_mount *mount, const char *path, struct elfuse_file *file, char *buf, size_t size, off_t offset)
+{
+    /* Reading back buffered writes */
+    int res = elfuse_flush_file(mount, path, file);
+    if (res < 0)
+        return res;
+
+    bool cache = elfuse_block_cache_enabled(mount);
+    uint64_t generation = elfuse_cache_group_generation(&mount->block_cache, path);
+    size_t done = 0;
+
+    /* Two reads in a row picking up where the previous one stopped make
+     * for sequential access, anything else starts over */
+    if (offset == file->next_offset) {
+        file->sequential_reads++;
+    } else {
+        file->sequential_reads = 0;
+        file->window_size = 0;
+    }
+    file->next_offset = offset + size;
+    bool readahead = file->sequential_reads >= 2 && mount->readahead_max > 0;
+
+    /* Serve whatever leading blocks are cached, without bothering Emacs */
+    while (cache && done < size) {
+        off_t position = offset + done;
+        size_t skip = position % ELFUSE_BLOCK_SIZE;
+        struct elfuse_block block;
+        if (!elfuse_get_block(mount, path, position / ELFUSE_BLOCK_SIZE, &block))
+            break;
+
+        if (block.length <= skip)
+            return done;
+        size_t length = block.length - skip < size - done ? block.length - skip : size - done;
+        memcpy(buf + done, block.data + skip, length);
+        done += length;
+
+        /* The end of the file */
+        if (block.length < ELFUSE_BLOCK_SIZE)
+            return done;
+    }
+
+    /* Then whatever the last window holds */
+    if (done < size) {
+        ssize_t length = elfuse_read_window(mount, path, file, buf + done, size - done, offset + done);
+        if (length == 0)
+            return done;
+        if (length > 0)
+            done += length;
+    }
+    if (done == size)
+        return done;
+
+    /* Ask for whole blocks so that all of them can be cached, and for a
+     * window growing up to the readahead_max of the mount when reading sequentially */
+    off_t position = offset + done;
+    off_t start = position;
+    off_t end = offset + size;
+    if (readahead) {
+        if (file->window_size == 0)
+            file->window_size = 4 * ELFUSE_BLOCK_SIZE;
+        else if (file->window_size < mount->readahead_max)
+            file->window_size *= 2;
+        if (file->window_size > mount->readahead_max)
+            file->window_size = mount->readahead_max;
+        if (end < position + (off_t) file->window_size)
+            end = position + file->window_size;
+    }
+    if (cache) {
+        start -= start % ELFUSE_BLOCK_SIZE;
+        if (end % ELFUSE_BLOCK_SIZE != 0)
+            end += ELFUSE_BLOCK_SIZE - end % ELFUSE_BLOCK_SIZE;
+    }
+
+    char *data = NULL;
+    res = elfuse_read_call(mount, path, end - start, start, &data);
+    if (res < 0) {
+        free(data);
+        return done > 0 ? (int) done : res;
+    }
+    size_t data_length = res;
+
+    /* A short block, possibly an empty one, marks the end of the file */
+    for (size_t block_start = 0; cache && block_start < (size_t) (end - start); block_start += ELFUSE_BLOCK_SIZE) {
+        size_t length = 0;
+        if (data_length > block_start)
+            length = data_length - block_start < ELFUSE_BLOCK_SIZE ? data_length - block_start : ELFUSE_BLOCK_SIZE;
+        elfuse_put_block(mount, path, (start + block_start) / ELFUSE_BLOCK_SIZE, data + block_start, length, generation);
+        if (length < ELFUSE_BLOCK_SIZE)
+            break;
+    }
+
+    size_t skip = position - start;
+    if (data_length > skip) {
+        size_t length = data_length - skip < size - done ? data_length - skip : size - done;
+        memcpy(buf + done, data + skip, length);
+        done += length;
+    }
+
+    /* Keep the window for the reads to come */
+    if (readahead) {
+        free(file->window);
+        file->window = data;
+        file->window_offset = start;
+        file->window_length = data_length;
+        file->window_eof = data_length < (size_t) (end - start);
+        file->window_generation = generation;
+    } else {
+        free(data);
+    }
+
+    return done;
+}
+
+static int
+elfuse_read(const char *path, char *buf, size_t size, off_t offset,
+		      struct fuse_file_info *fi)
+{
+    struct elfuse_mount *mount = elfuse_current_mount();
+    elfuse_trace(mount, TRACE_READ, path, NULL, offset, size);
+    struct elfuse_file *file = (struct elfuse_file *) (uintptr_t) fi->fh;
+
+    pthread_mutex_lock(&file->lock);
+    int res = elfuse_read_locked(mount, path, file, buf, size, offset);
+    pthread_mutex_unlock(&file->lock);
+
+    return res;
+}
+
+static int
+elfuse_write_locked(struct elfuse_mount *mount, const char *path, struct elfuse_file *file, const char *buf, size_t size, off_t offset)
+{
+    int res;
+
+    /* Only contiguous writes are gathered */
+    if (file->pending_length > 0 && offset != file->pending_offset + (off_t) file->pending_length) {
+        res = elfuse_flush_file(mount, path, file);
+        if (res < 0)
+            return res;
+    }
+
+    if (file->pending_length + size > file->pending_capacity) {
+        size_t capacity = file->pending_capacity > 0 ? file->pending_capacity : 64 * 1024;
+        while (capacity < file->pending_length + size)
+            capacity *= 2;
+        char *pending = realloc(file->pending, capacity);
+        if (pending == NULL)
+            return -ENOMEM;
+        file->pending = pending;
+        file->pending_capacity = capacity;
+    }
+
+    bool first = file->pending_length == 0;
+    if (first) {
+        file->pending_offset = offset;
+        file->pending_since = elfuse_monotonic_time();
+    }
+    memcpy(file->pending + file->pending_length, buf, size);
+    file->pending_length += size;
+    if (first)
+        elfuse_pending_add(mount, file, path);
+
+    if (file->pending_length >= mount->write_back_size
+        || elfuse_monotonic_time() - file->pending_since >= mount->write_back_age) {
+        res = elfuse_flush_file(mount, path, file);
+        if (res < 0)
+            return res;
+    }
+
+    return size;
+}
+
+static int
+elfuse_write(const char *path, const char *buf, size_t size, off_t offset,
+                        struct fuse_file_info *fi)
+{
+    struct elfuse_mount *mount = elfuse_current_mount();
+    elfuse_trace(mount, TRACE_WRITE, path, NULL, offset, size);
+    struct elfuse_file *file = (struct elfuse_file *) (uintptr_t) fi->fh;
+    if (!mount->write_back)
+        return elfuse_write_call(mount, path, buf, size, offset);
+
+    pthread_mutex_lock(&file->lock);
+    int res = elfuse_write_locked(mount, path, file, buf, size, offset);
+    pthread_mutex_unlock(&file->lock);
+
+    return res;
+}
+
+/* Called on every close(), the last chance to report failed writes */
+static int
+elfuse_flush(const char *path, struct fuse_file_info *fi)
+{
+    struct elfuse_mount *mount = elfuse_current_mount();
+    struct elfuse_file *file = (struct elfuse_file *) (uintptr_t) fi->fh;
+
+    pthread_mutex_lock(&file->lock);
+    int res = elfuse_flush_file(mount, path, file);
+    pthread_mutex_unlock(&file->lock);
+
+    return res;
+}
+
+static int
+elfuse_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    (void) datasync;
+    elfuse_trace(elfuse_current_mount(), TRACE_FSYNC, path, NULL, 0, 0);
+    return elfuse_flush(path, fi);
+}
+
+static int
+elfuse_fgetattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi)
+{
+    /* The size should account for buffered writes */
+    int res = elfuse_flush(path, fi);
+    if (res < 0)
+        return res;
+    return elfuse_getattr(path, stbuf);
+}
+
+static int
+elfuse_truncate(const char *path, off_t size)
+{
+    struct elfuse_mount *mount = elfuse_current_mount();
+    elfuse_trace(mount, TRACE_TRUNCATE, path, NULL, 0, size);
+    size_t res = 0;
+
+    /* No need to bother Emacs without a handler */
+    const char *relative;
+    int route = elfuse_route(mount, path, ELFUSE_OP_BIT(OP_TRUNCATE), &relative);
+    if (route < 0)
+        return route;
+
+    /* Function to call */
+    struct elfuse_call_state *call = elfuse_call_new(WAITING_TRUNCATE);
+    if (call == NULL)
+        return -ENOMEM;
+
+    /* Set function args */
+    call->route = route;
+    call->args.truncate.path = relative;
+    call->args.truncate.size = size;
+
+    /* Wait for the funcall results */
+    elfuse_log_debug("TRUNCATE request (path=%s, size=%ld)", path, size);
+    elfuse_call_wait(mount, call);
+
+    if (call->response_state == RESPONSE_SUCCESS) {
+        elfuse_log_debug("TRUNCATE success (code=%d)", call->results.truncate.code);
+        if (call->results.truncate.code == TRUNCATE_DONE) {
+            res = 0;
+        } else {
+            res = -ENOENT;
+        }
+    } else if (call->response_state == RESPONSE_UNDEFINED) {
+        elfuse_log_debug("TRUNCATE fail (operation undefined)");
+        res = -ENOSYS;
+    } else if (call->response_state == RESPONSE_SIGNAL_ERROR) {
+        elfuse_log_debug("TRUNCATE fail (elfuse signal with errno %d)", call->response_err_code);
+        res = -call->response_err_code;
+    } else {
+        elfuse_log_warn("TRUNCATE fail (unknown error)");
+        res = -ENOSYS;
+    }
+
+    elfuse_cache_remove(&mount->attr_cache, path, false);
+    elfuse_invalidate_content(mount, path);
+
+    elfuse_call_finish(mount, call, res, 0);
+
+    return res;
+}
+
+static int
+elfuse_ftruncate(const char *path, off_t size, struct fuse_file_info *fi)
+{
+    /* Buffered writes go first */
+    int res = elfuse_flush(path, fi);
+    if (res < 0)
+        return res;
+    return elfuse_truncate(path, size);
+}
+
+static int
+elfuse_unlink(const char *path)
+{
+    struct elfuse_mount *mount = elfuse_current_mount();
+    elfuse_trace(mount, TRACE_UNLINK, path, NULL, 0, 0);
+    size_t res = 0;
+
+    /* No need to bother Emacs without a handler */
+    const char *relative;
+    int route = elfuse_route(mount, path, ELFUSE_OP_BIT(OP_UNLINK), &relative);
+    if (route < 0)
+        return route;
+
+    /* Function to call */
+    struct elfuse_call_state *call = elfuse_call_new(WAITING_UNLINK);
+    if (call == NULL)
+        return -ENOMEM;
+
+    /* Set function args */
+    call->route = route;
+    call->args.unlink.path = relative;
+
+    /* Wait for the funcall results */
+    elfuse_log_debug("UNLINK request (path=%s)", path);
+    elfuse_call_wait(mount, call);
+
+    if (call->response_state == RESPONSE_SUCCESS) {
+        elfuse_log_debug("UNLINK success (code=%d)", call->results.unlink.code);
+        if (call->results.unlink.code == UNLINK_DONE) {
+            res = 0;
+        } else {
+            res = -ENOENT;
+        }
+    } else if (call->response_state == RESPONSE_UNDEFINED) {
+        elfuse_log_debug("UNLINK fail (operation undefined)");
+        res = -ENOSYS;
+    } else if (call->response_state == RESPONSE_SIGNAL_ERROR) {
+        elfuse_log_debug("UNLINK fail (elfuse signal with errno %d)", call->response_err_code);
+        res = -call->response_err_code;
+    } else {
+        elfuse_log_warn("UNLINK fail (unknown error)");
+        res = -ENOSYS;
+    }
+
+    elfuse_cache_remove(&mount->attr_cache, path, false);
+    elfuse_invalidate_content(mount, path);
+
+    elfuse_call_finish(mount, call, res, 0);
+    return res;
+}
+
+static struct fuse_operations elfuse_oper = {
+    .create	= elfuse_create,
+    .rename	= elfuse_rename,
+    .getattr	= elfuse_getattr,
+    .opendir	= elfuse_opendir,
+    .readdir	= elfuse_readdir,
+    .releasedir	= elfuse_releasedir,
+    .open	= elfuse_open,
+    .release	= elfuse_release,
+    .read	= elfuse_read,
+    .write	= elfuse_write,
+    .truncate	= elfuse_truncate,
+    .ftruncate	= elfuse_ftruncate,
+    .fgetattr	= elfuse_fgetattr,
+    .unlink	= elfuse_unlink,
+    .flush	= elfuse_flush,
+    .fsync	= elfuse_fsync,
+};
+
+/* Memory mounts, answered right away on the FUSE thread */
+
+static struct elfuse_memfs *
+elfuse_current_memfs(void)
+{
+    return elfuse_current_mount()->memfs;
+}
+
+static int
+elfuse_memory_getattr(const char *path, struct stat *stbuf)
+{
+    return elfuse_memfs_getattr(elfuse_current_memfs(), path, stbuf);
+}
+
+struct elfuse_memory_dir {
+    void *buf;
+    fuse_fill_dir_t filler;
+};
+
+static int
+elfuse_memory_fill(void *data, const char *name, const struct stat *stbuf)
+{
+    struct elfuse_memory_dir *dir = data;
+    return dir->filler(dir->buf, name, stbuf, 0);
+}
+
+/* The whole directory at once, FUSE keeps it until closedir */
+static int
+elfuse_memory_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                      off_t offset, struct fuse_file_info *fi)
+{
+    (void) offset; (void) fi;
+    struct elfuse_memory_dir dir = { buf, filler };
+    filler(buf, ".", NULL, 0);
+    filler(buf, "..", NULL, 0);
+    return elfuse_memfs_list(elfuse_current_memfs(), path, elfuse_memory_fill, &dir);
+}
+
+static int
+elfuse_memory_open(const char *path, struct fuse_file_info *fi)
+{
+    (void) fi;
+    struct stat stbuf;
+    int res = elfuse_memfs_getattr(elfuse_current_memfs(), path, &stbuf);
+    if (res == 0 && S_ISDIR(stbuf.st_mode))
+        res = -EISDIR;
+    return res;
+}
+
+static int
+elfuse_memory_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+    (void) mode;
+    int res = elfuse_memfs_create(elfuse_current_memfs(), path, false);
+    if (res == -EEXIST && !(fi->flags & O_EXCL))
+        res = elfuse_memory_open(path, fi);
+    return res;
+}
 
-        pthread_exit(NULL);
+static int
+elfuse_memory_mkdir(const char *path, mode_t mode)
+{
+    (void) mode;
+    return elfuse_memfs_create(elfuse_current_memfs(), path, true);
+}
+
+static int
+elfuse_memory_read(const char *path, char *buf, size_t size, off_t offset,
+                   struct fuse_file_info *fi)
+{
+    (void) fi;
+    return elfuse_memfs_read(elfuse_current_memfs(), path, buf, size, offset);
+}
+
+static int
+elfuse_memory_write(const char *path, const char *buf, size_t size, off_t offset,
+                    struct fuse_file_info *fi)
+{
+    (void) fi;
+    return elfuse_memfs_write(elfuse_current_memfs(), path, buf, size, offset);
+}
+
+static int
+elfuse_memory_truncate(const char *path, off_t size)
+{
+    return elfuse_memfs_truncate(elfuse_current_memfs(), path, size);
+}
+
+static int
+elfuse_memory_unlink(const char *path)
+{
+    return elfuse_memfs_unlink(elfuse_current_memfs(), path, false);
+}
+
+static int
+elfuse_memory_rmdir(const char *path)
+{
+    return elfuse_memfs_unlink(elfuse_current_memfs(), path, true);
+}
+
+static int
+elfuse_memory_rename(const char *oldpath, const char *newpath)
+{
+    return elfuse_memfs_rename(elfuse_current_memfs(), oldpath, newpath);
+}
+
+static struct fuse_operations elfuse_memory_oper = {
+    .create	= elfuse_memory_create,
+    .rename	= elfuse_memory_rename,
+    .getattr	= elfuse_memory_getattr,
+    .readdir	= elfuse_memory_readdir,
+    .mkdir	= elfuse_memory_mkdir,
+    .rmdir	= elfuse_memory_rmdir,
+    .open	= elfuse_memory_open,
+    .read	= elfuse_memory_read,
+    .write	= elfuse_memory_write,
+    .truncate	= elfuse_memory_truncate,
+    .unlink	= elfuse_memory_unlink,
+};
+
+static const struct fuse_operations *
+elfuse_mount_oper(struct elfuse_mount *mount)
+{
+    return mount->memfs != NULL ? &elfuse_memory_oper : &elfuse_oper;
+}
+
+/* Loopback requests, made the way the kernel would through the same
+ * callbacks */
+
+/* Entries of a directory, and the offset of the one after the last */
+struct elfuse_loopback_dir {
+    off_t next;
+    int entries;
+};
+
+static int
+elfuse_loopback_fill(void *buf, const char *name, const struct stat *stbuf, off_t offset)
+{
+    (void) name; (void) stbuf;
+    struct elfuse_loopback_dir *dir = buf;
+    dir->next = offset;
+    dir->entries++;
+    return 0;
+}
+
+int
+elfuse_loopback_getattr(struct elfuse_mount *mount, const char *path)
+{
+    struct stat stbuf;
+    elfuse_current_loopback = mount;
+    int res = elfuse_mount_oper(mount)->getattr(path, &stbuf);
+    elfuse_current_loopback = NULL;
+    return res;
+}
+
+int
+elfuse_loopback_readdir(struct elfuse_mount *mount, const char *path)
+{
+    const struct fuse_operations *oper = elfuse_mount_oper(mount);
+    struct fuse_file_info fi = { 0 };
+    elfuse_current_loopback = mount;
+    int res = oper->opendir != NULL ? oper->opendir(path, &fi) : 0;
+    if (res == 0) {
+        /* Page through like the kernel does, entries carry the offset of
+         * the next one unless they all come at once */
+        off_t offset = 0;
+        int entries = 0;
+        for (;;) {
+            struct elfuse_loopback_dir dir = { offset, 0 };
+            res = oper->readdir(path, &dir, elfuse_loopback_fill, offset, &fi);
+            entries += dir.entries;
+            if (res != 0 || dir.next == offset || dir.next == 0)
+                break;
+            offset = dir.next;
+        }
+        if (oper->releasedir != NULL)
+            oper->releasedir(path, &fi);
+        if (res == 0)
+            res = entries;
     }
-    /* Prepare a working buffer */
-    size_t bufsize = fuse_chan_bufsize(ch);
-    char *buf = malloc(bufsize);
-    if (!buf) {
-        fprintf(stderr, "Elfuse: failed to allocate the read buffer\n");
+    elfuse_current_loopback = NULL;
+    return res;
+}
 
-        elfuse_init_code = INIT_ERR_ALLOC;
-        pthread_cond_signal(&elfuse_cond_var);
-        pthread_mutex_unlock(&elfuse_mutex);
+int
+elfuse_loopback_open(struct elfuse_mount *mount, const char *path, int flags, uint64_t *fh)
+{
+    const struct fuse_operations *oper = elfuse_mount_oper(mount);
+    struct fuse_file_info fi = { .flags = flags };
+    elfuse_current_loopback = mount;
+    int res = (flags & O_CREAT) ? oper->create(path, 0644, &fi) : oper->open(path, &fi);
+    elfuse_current_loopback = NULL;
+    *fh = fi.fh;
+    return res;
+}
 
-        pthread_exit(NULL);
+int
+elfuse_loopback_read(struct elfuse_mount *mount, const char *path, uint64_t fh, char *buf, size_t size, off_t offset)
+{
+    struct fuse_file_info fi = { .fh = fh };
+    elfuse_current_loopback = mount;
+    int res = elfuse_mount_oper(mount)->read(path, buf, size, offset, &fi);
+    elfuse_current_loopback = NULL;
+    return res;
+}
+
+int
+elfuse_loopback_write(struct elfuse_mount *mount, const char *path, uint64_t fh, const char *buf, size_t size, off_t offset)
+{
+    struct fuse_file_info fi = { .fh = fh };
+    elfuse_current_loopback = mount;
+    int res = elfuse_mount_oper(mount)->write(path, buf, size, offset, &fi);
+    elfuse_current_loopback = NULL;
+    return res;
+}
+
+int
+elfuse_loopback_release(struct elfuse_mount *mount, const char *path, uint64_t fh)
+{
+    const struct fuse_operations *oper = elfuse_mount_oper(mount);
+    struct fuse_file_info fi = { .fh = fh };
+    elfuse_current_loopback = mount;
+    int res = oper->flush != NULL ? oper->flush(path, &fi) : 0;
+    int released = oper->release != NULL ? oper->release(path, &fi) : 0;
+    elfuse_current_loopback = NULL;
+    return res != 0 ? res : released;
+}
+
+int
+elfuse_loopback_unlink(struct elfuse_mount *mount, const char *path)
+{
+    elfuse_current_loopback = mount;
+    int res = elfuse_mount_oper(mount)->unlink(path);
+    elfuse_current_loopback = NULL;
+    return res;
+}
+
+static void elfuse_cleanup_mount(void *mountpoint) {
+    elfuse_log_info("unmounting %s", (char *) mountpoint);
+    fuse_unmount(mountpoint, NULL);
+    free(mountpoint);
+}
+
+static void elfuse_cleanup_fuse(void *data) {
+    struct elfuse_mount *mount = data;
+    elfuse_log_info("cleanup fuse");
+    fuse_destroy(mount->fuse);
+    mount->fuse = NULL;
+    mount->chan = NULL;
+}
+
+static void elfuse_cleanup_flush(void *data) {
+    struct elfuse_mount *mount = data;
+
+    pthread_mutex_lock(&mount->pending_lock);
+    bool running = mount->flush_running;
+    mount->flush_running = false;
+    pthread_cond_signal(&mount->pending_cond);
+    pthread_mutex_unlock(&mount->pending_lock);
+    if (running)
+        pthread_join(mount->flush_thread, NULL);
+}
+
+static void elfuse_cleanup_notify(void *data) {
+    struct elfuse_mount *mount = data;
+
+    pthread_mutex_lock(&mount->notify_lock);
+    mount->notify_running = false;
+    pthread_cond_signal(&mount->notify_cond);
+    pthread_mutex_unlock(&mount->notify_lock);
+    pthread_join(mount->notify_thread, NULL);
+
+    /* Nothing left to invalidate once unmounted */
+    while (mount->notify_head) {
+        struct elfuse_notification *notification = mount->notify_head;
+        mount->notify_head = notification->next;
+        free(notification);
     }
-    pthread_cleanup_push(elfuse_cleanup_fuse, buf);
+    mount->notify_tail = NULL;
+}
 
-    /* Let Emacs know that init was a success */
-    elfuse_init_code = INIT_DONE;
-    pthread_cond_signal(&elfuse_cond_var);
-    pthread_mutex_unlock(&elfuse_mutex);
+static void elfuse_cleanup_workers(void *data) {
+    struct elfuse_mount *mount = data;
+    elfuse_log_info("stopping %d worker(s)", mount->workers_size);
+    for (int i = 0; i < mount->workers_size; i++)
+        pthread_cancel(mount->workers[i]);
+    for (int i = 0; i < mount->workers_size; i++)
+        pthread_join(mount->workers[i], NULL);
+    free(mount->workers);
+    mount->workers = NULL;
+    mount->workers_size = 0;
+
+    /* Spares are only started from the Emacs thread, which waits for this
+     * one to finish */
+    for (int i = 0; i < mount->max_deferred; i++) {
+        if (mount->spares[i].started)
+            pthread_cancel(mount->spares[i].thread);
+    }
+    for (int i = 0; i < mount->max_deferred; i++) {
+        if (mount->spares[i].started)
+            pthread_join(mount->spares[i].thread, NULL);
+        mount->spares[i].started = false;
+    }
+    mount->spares_running = 0;
+}
+
+static void
+elfuse_send_notification(struct elfuse_mount *mount, const struct elfuse_notification *notification)
+{
+    const char *path = notification->path;
+    char parent[strlen(path) + 1];
+    const char *name = elfuse_split_path(path, parent);
+    uint64_t nodeid;
+    int err;
+
+    /* Drop the directory entry, the next access looks the path up again */
+    if (*name != '\0' && elfuse_cache_get(&mount->node_cache, parent, &nodeid)) {
+        err = fuse_lowlevel_notify_inval_entry(mount->chan, nodeid, name, strlen(name));
+        if (err < 0 && err != -ENOENT)
+            elfuse_log_warn("failed to invalidate entry %s (%d)", path, err);
+    }
+
+    if (notification->kind == NOTIFY_DELETED) {
+        elfuse_cache_remove(&mount->node_cache, path, true);
+        return;
+    }
+
+    /* Attributes and cached contents of the node itself */
+    if (elfuse_cache_get(&mount->node_cache, path, &nodeid)) {
+        err = fuse_lowlevel_notify_inval_inode(mount->chan, nodeid, 0, 0);
+        if (err < 0 && err != -ENOENT)
+            elfuse_log_warn("failed to invalidate inode of %s (%d)", path, err);
+    }
+}
+
+/* When the oldest buffered writes are due, INFINITY if there are none.
+ * Needs pending_lock. */
+static double
+elfuse_pending_deadline(struct elfuse_mount *mount)
+{
+    if (mount->pending_head == NULL)
+        return INFINITY;
+    return mount->pending_head->pending_since + mount->write_back_age;
+}
+
+/* Hand the buffered writes due to Emacs, return false if some were left
+ * because their file was busy */
+static bool
+elfuse_flush_aged(struct elfuse_mount *mount)
+{
+    for (;;) {
+        double now = elfuse_monotonic_time();
+        struct elfuse_file *file = NULL;
+        bool busy = false;
+
+        /* Files are locked before the list elsewhere, hence only tried */
+        pthread_mutex_lock(&mount->pending_lock);
+        for (struct elfuse_file *pending = mount->pending_head; pending != NULL; pending = pending->pending_next) {
+            if (pending->pending_since + mount->write_back_age > now)
+                break;
+            if (pthread_mutex_trylock(&pending->lock) == 0) {
+                file = pending;
+                break;
+            }
+            busy = true;
+        }
+        pthread_mutex_unlock(&mount->pending_lock);
+        if (file == NULL)
+            return !busy;
+
+        /* Holding the lock keeps release from freeing the file */
+        int res = elfuse_flush_file(mount, file->pending_path, file);
+        if (res < 0) {
+            elfuse_log_warn("WRITE failed flushing on age (path=%s, errno=%d)", file->pending_path, -res);
+            file->pending_error = res;
+        }
+        pthread_mutex_unlock(&file->lock);
+    }
+}
+
+/* Buffered writes are flushed on age from a thread of their own, it waits
+ * for Emacs like any request */
+static void *
+elfuse_flush_loop(void *data)
+{
+    struct elfuse_mount *mount = data;
+    double retry = 0;
+
+    pthread_mutex_lock(&mount->pending_lock);
+    while (mount->flush_running) {
+        double deadline = elfuse_pending_deadline(mount);
+        if (deadline < retry)
+            deadline = retry;
+
+        if (deadline <= elfuse_monotonic_time()) {
+            pthread_mutex_unlock(&mount->pending_lock);
+            /* Files busy right now are tried again a little later */
+            retry = elfuse_flush_aged(mount) ? 0 : elfuse_monotonic_time() + 0.01;
+            pthread_mutex_lock(&mount->pending_lock);
+        } else if (isinf(deadline)) {
+            pthread_cond_wait(&mount->pending_cond, &mount->pending_lock);
+        } else {
+            struct timespec until = {
+                .tv_sec = deadline,
+                .tv_nsec = (deadline - floor(deadline)) * 1e9,
+            };
+            pthread_cond_timedwait(&mount->pending_cond, &mount->pending_lock, &until);
+        }
+    }
+    pthread_mutex_unlock(&mount->pending_lock);
+
+    return NULL;
+}
+
+/* Notifications are sent from a thread of their own: the kernel may need a
+ * lock held by a request that is waiting for Emacs. Nothing else runs on
+ * it, so invalidations never wait for Emacs themselves. */
+static void *
+elfuse_notify_loop(void *data)
+{
+    struct elfuse_mount *mount = data;
+
+    pthread_mutex_lock(&mount->notify_lock);
+    for (;;) {
+        while (mount->notify_running && mount->notify_head == NULL)
+            pthread_cond_wait(&mount->notify_cond, &mount->notify_lock);
+        if (!mount->notify_running)
+            break;
+
+        struct elfuse_notification *notification = mount->notify_head;
+        mount->notify_head = notification->next;
+        if (mount->notify_head == NULL)
+            mount->notify_tail = NULL;
+
+        pthread_mutex_unlock(&mount->notify_lock);
+        elfuse_send_notification(mount, notification);
+        free(notification);
+        pthread_mutex_lock(&mount->notify_lock);
+    }
+    pthread_mutex_unlock(&mount->notify_lock);
+
+    return NULL;
+}
+
+/* Whether the current spare should leave, it is counted out if so */
+static bool
+elfuse_spare_surplus(struct elfuse_mount *mount)
+{
+    pthread_mutex_lock(&mount->lock);
+    bool surplus = mount->spares_running > mount->parked;
+    if (surplus) {
+        mount->spares_running--;
+        elfuse_current_spare->exited = true;
+    }
+    pthread_mutex_unlock(&mount->lock);
+    return surplus;
+}
+
+static void *
+elfuse_worker_loop(void *data)
+{
+    struct elfuse_mount *mount = data;
+    struct fuse_chan *ch = mount->chan;
+    struct fuse_session *se = fuse_get_session(mount->fuse);
+    int err = -1;
+
+    /* Only receiving a request is cancellable, never processing one */
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+    /* Prepare a working buffer, one per worker */
+    size_t bufsize = fuse_chan_bufsize(ch);
+    char *buf = malloc(bufsize);
+    if (!buf) {
+        elfuse_log_error("failed to allocate the read buffer");
+        return NULL;
+    }
+    pthread_cleanup_push(free, buf);
 
-    /* Go-go-go! */
-    fprintf(stderr, "Elfuse: starting main loop\n");
-    struct fuse_session *se = fuse_get_session(fuse);
     while (!fuse_session_exited(se)) {
         struct fuse_chan *tmpch = ch;
         struct fuse_buf fbuf = {
@@ -625,13 +2387,226 @@ elfuse_fuse_loop(void* mountpath)
 
         if (err == -EINTR)
             continue;
-        if (err <= 0)
+        if (err <= 0) {
+            /* Unmounted from the outside, let other workers know */
+            fuse_session_exit(se);
             break;
+        }
 
+        /* Let the handlers see node ids, unless the request is still in a pipe */
+        if (!(fbuf.flags & FUSE_BUF_IS_FD) && (size_t) err >= sizeof(struct fuse_in_header))
+            elfuse_current_in = fbuf.mem;
         fuse_session_process_buf(se, &fbuf, tmpch);
+        elfuse_current_in = NULL;
+
+        /* Spares leave once more of them run than calls are parked */
+        if (elfuse_current_spare != NULL && elfuse_spare_surplus(mount))
+            break;
+    }
+
+    /* Free the working buffer */
+    pthread_cleanup_pop(true);
+
+    return NULL;
+}
+
+static void *
+elfuse_spare_loop(void *data)
+{
+    struct elfuse_spare *spare = data;
+    elfuse_current_spare = spare;
+    return elfuse_worker_loop(spare->mount);
+}
+
+enum elfuse_mount_option_type
+elfuse_mount_option_type(const char *name)
+{
+    for (size_t i = 0; i < sizeof(elfuse_mount_option_table)/sizeof(elfuse_mount_option_table[0]); i++) {
+        if (strcmp(elfuse_mount_option_table[i].name, name) == 0)
+            return elfuse_mount_option_table[i].type;
+    }
+    return MOUNT_OPTION_UNKNOWN;
+}
+
+bool
+elfuse_mount_option_add(const char *name, double value)
+{
+    char option[128];
+    int option_length;
+
+    /* Not FUSE options */
+    if (strcmp(name, "loopback") == 0) {
+        elfuse_mount_loopback = value != 0;
+        return true;
+    }
+    if (strcmp(name, "memory") == 0) {
+        elfuse_mount_memory = value != 0;
+        return true;
+    }
+
+    switch (elfuse_mount_option_type(name)) {
+    case MOUNT_OPTION_FLAG:
+        if (value == 0)
+            return true;
+        option_length = snprintf(option, sizeof(option), "%s", name);
+        break;
+    case MOUNT_OPTION_SECONDS:
+        if (!(value >= 0 && value <= 1e9))
+            return false;
+        option_length = snprintf(option, sizeof(option), "%s=%g", name, value);
+        break;
+    case MOUNT_OPTION_BYTES:
+        /* The kernel takes 32 bit sizes */
+        if (!(value >= 1 && value <= UINT32_MAX) || value != (uint32_t) value)
+            return false;
+        option_length = snprintf(option, sizeof(option), "%s=%" PRIu32, name, (uint32_t) value);
+        break;
+    default:
+        return false;
+    }
+
+    if (option_length < 0 || (size_t) option_length >= sizeof(option))
+        return false;
+
+    /* Separating comma and the terminating NUL */
+    size_t length = strlen(elfuse_mount_options);
+    if (length + 1 + option_length + 1 > sizeof(elfuse_mount_options))
+        return false;
+
+    snprintf(elfuse_mount_options + length, sizeof(elfuse_mount_options) - length,
+             "%s%s", length > 0 ? "," : "", option);
+    return true;
+}
+
+void
+elfuse_mount_options_clear(void)
+{
+    elfuse_mount_options[0] = '\0';
+    elfuse_mount_loopback = false;
+    elfuse_mount_memory = false;
+}
+
+/* Let the thread waiting in elfuse_mount_start know how init went, called
+ * with the mount lock held */
+static void
+elfuse_init_done(struct elfuse_mount *mount, enum elfuse_init_code_enum code)
+{
+    mount->init_code = code;
+    pthread_cond_signal(&mount->init_cond);
+    pthread_mutex_unlock(&mount->lock);
+}
+
+static void *
+elfuse_fuse_loop(void *data)
+{
+    struct elfuse_mount *mount = data;
+    int argc = mount->options[0] != '\0' ? 4 : 2;
+    char* argv[] = {
+        "",
+        mount->path,
+        "-o",
+        mount->options,
+    };
+
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    char *mountpoint;
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    pthread_mutex_lock(&mount->lock);
+
+    /* Parse arguments */
+    if (fuse_parse_cmdline(&args, &mountpoint, NULL, NULL) == -1) {
+        elfuse_log_error("failed parsing the command line");
+        free(mountpoint);
+        elfuse_init_done(mount, INIT_ERR_ARGS);
+        pthread_exit(NULL);
+    }
+
+    /* Mount the FUSE FS */
+    struct fuse_chan *ch = fuse_mount(mountpoint, &args);
+    if (ch == NULL) {
+        elfuse_log_error("failed mounting %s", mountpoint);
+        free(mountpoint);
+        elfuse_init_done(mount, INIT_ERR_MOUNT);
+        pthread_exit(NULL);
+    }
+    pthread_cleanup_push(elfuse_cleanup_mount, mountpoint);
+
+    /* Create the FUSE instance, handlers find the mount in their context */
+    const struct fuse_operations *oper = elfuse_mount_oper(mount);
+    mount->fuse = fuse_new(ch, &args, oper, sizeof(*oper), mount);
+    if (mount->fuse == NULL) {
+        elfuse_log_error("failed creating FUSE");
+        elfuse_init_done(mount, INIT_ERR_CREATE);
+        pthread_exit(NULL);
+    }
+    mount->chan = ch;
+    pthread_cleanup_push(elfuse_cleanup_fuse, mount);
+
+    /* Launch the notify thread */
+    mount->notify_running = true;
+    if (pthread_create(&mount->notify_thread, NULL, elfuse_notify_loop, mount) != 0) {
+        elfuse_log_error("failed to launch the notify thread");
+        mount->notify_running = false;
+        elfuse_init_done(mount, INIT_ERR_ALLOC);
+        pthread_exit(NULL);
+    }
+    pthread_cleanup_push(elfuse_cleanup_notify, mount);
+
+    /* Launch the flush thread, only needed with write-back */
+    if (mount->write_back) {
+        mount->flush_running = true;
+        if (pthread_create(&mount->flush_thread, NULL, elfuse_flush_loop, mount) != 0) {
+            elfuse_log_error("failed to launch the flush thread");
+            mount->flush_running = false;
+            elfuse_init_done(mount, INIT_ERR_ALLOC);
+            pthread_exit(NULL);
+        }
+    }
+    pthread_cleanup_push(elfuse_cleanup_flush, mount);
+
+    /* Launch the receiver threads */
+    int thread_count = mount->thread_count > 0 ? mount->thread_count : 1;
+    mount->workers = calloc(thread_count, sizeof(mount->workers[0]));
+    if (!mount->workers) {
+        elfuse_log_error("failed to allocate worker threads");
+        elfuse_init_done(mount, INIT_ERR_ALLOC);
+        pthread_exit(NULL);
     }
+    pthread_cleanup_push(elfuse_cleanup_workers, mount);
 
+    for (mount->workers_size = 0; mount->workers_size < thread_count; mount->workers_size++) {
+        if (pthread_create(&mount->workers[mount->workers_size], NULL, elfuse_worker_loop, mount) != 0) {
+            elfuse_log_error("failed to launch worker %d", mount->workers_size);
+            break;
+        }
+    }
+    if (mount->workers_size == 0) {
+        elfuse_init_done(mount, INIT_ERR_ALLOC);
+        pthread_exit(NULL);
+    }
+
+    /* Let Emacs know that init was a success */
+    elfuse_init_done(mount, INIT_DONE);
+
+    /* Go-go-go! */
+    elfuse_log_info("starting main loop for %s (%d workers)", mount->path, mount->workers_size);
+
+    /* Workers only return once the session is over; cancelling this thread
+     * cancels them all */
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    while (mount->workers_size > 0) {
+        pthread_join(mount->workers[mount->workers_size - 1], NULL);
+        mount->workers_size--;
+    }
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
 
+    /* Cleanup the workers */
+    pthread_cleanup_pop(true);
+    /* Stop the flush thread */
+    pthread_cleanup_pop(true);
+    /* Stop the notify thread */
+    pthread_cleanup_pop(true);
     /* Cleanup FUSE */
     pthread_cleanup_pop(true);
     /* Cleanup the mount point */
@@ -639,3 +2614,172 @@ elfuse_fuse_loop(void* mountpath)
 
     return NULL;
 }
+
+struct elfuse_mount *
+elfuse_mount_new(const char *path)
+{
+    struct elfuse_mount *mount = calloc(1, sizeof(*mount));
+    if (mount == NULL)
+        return NULL;
+
+    mount->path = strdup(path);
+    if (mount->path == NULL) {
+        free(mount);
+        return NULL;
+    }
+    memcpy(mount->options, elfuse_mount_options, sizeof(mount->options));
+    mount->loopback = elfuse_mount_loopback;
+
+    mount->thread_count = elfuse_thread_count;
+    mount->max_deferred = elfuse_max_deferred > 0 ? elfuse_max_deferred : 0;
+    mount->attr_cache_ttl = elfuse_attr_cache_ttl;
+    mount->negative_cache_ttl = elfuse_negative_cache_ttl;
+    mount->read_cache_ttl = elfuse_read_cache_ttl;
+    mount->read_cache_size = elfuse_read_cache_size;
+    mount->readahead_max = elfuse_readahead_max;
+    mount->write_back = elfuse_write_back;
+    mount->write_back_size = elfuse_write_back_size;
+    mount->write_back_age = elfuse_write_back_age;
+
+    pthread_mutex_init(&mount->lock, NULL);
+    pthread_cond_init(&mount->init_cond, NULL);
+    pthread_mutex_init(&mount->pending_lock, NULL);
+    pthread_condattr_t pending_cond_attr;
+    pthread_condattr_init(&pending_cond_attr);
+    pthread_condattr_setclock(&pending_cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&mount->pending_cond, &pending_cond_attr);
+    pthread_condattr_destroy(&pending_cond_attr);
+    pthread_mutex_init(&mount->notify_lock, NULL);
+    pthread_cond_init(&mount->notify_cond, NULL);
+    elfuse_trace_init(&mount->trace);
+    mount->queue_stopped = true;
+
+    /* Prepare the caches and spare receivers */
+    mount->spares = calloc(mount->max_deferred + 1, sizeof(mount->spares[0]));
+    size_t blocks = elfuse_read_cache_size / sizeof(struct elfuse_block);
+    bool attr = elfuse_cache_init(&mount->attr_cache, sizeof(struct elfuse_results_getattr), elfuse_attr_cache_size);
+    bool negative = elfuse_cache_init(&mount->negative_cache, 0, elfuse_negative_cache_size);
+    bool node = elfuse_cache_init(&mount->node_cache, sizeof(uint64_t), elfuse_attr_cache_size);
+    bool block = elfuse_cache_init(&mount->block_cache, sizeof(struct elfuse_block), blocks);
+    bool routes = elfuse_routes_init(&mount->routes);
+    if (mount->spares == NULL || !attr || !negative || !node || !block || !routes) {
+        elfuse_log_error("failed to allocate the caches");
+        elfuse_mount_free(mount);
+        return NULL;
+    }
+    if (elfuse_mount_memory) {
+        mount->memfs = elfuse_memfs_new(elfuse_memory_max_size);
+        if (mount->memfs == NULL) {
+            elfuse_mount_free(mount);
+            return NULL;
+        }
+    }
+
+    uint64_t root_nodeid = FUSE_ROOT_ID;
+    elfuse_cache_put(&mount->node_cache, "/", &root_nodeid, INFINITY,
+                     elfuse_cache_generation(&mount->node_cache));
+
+    return mount;
+}
+
+void
+elfuse_mount_free(struct elfuse_mount *mount)
+{
+    if (mount == NULL)
+        return;
+
+    elfuse_mount_stop(mount);
+
+    elfuse_cache_destroy(&mount->attr_cache);
+    elfuse_cache_destroy(&mount->negative_cache);
+    elfuse_cache_destroy(&mount->node_cache);
+    elfuse_cache_destroy(&mount->block_cache);
+    if (mount->routes.root != NULL)
+        elfuse_routes_destroy(&mount->routes);
+
+    elfuse_memfs_free(mount->memfs);
+    elfuse_trace_destroy(&mount->trace);
+    pthread_cond_destroy(&mount->notify_cond);
+    pthread_mutex_destroy(&mount->notify_lock);
+    pthread_cond_destroy(&mount->pending_cond);
+    pthread_mutex_destroy(&mount->pending_lock);
+    pthread_cond_destroy(&mount->init_cond);
+    pthread_mutex_destroy(&mount->lock);
+    free(mount->spares);
+    free(mount->path);
+    free(mount);
+}
+
+struct elfuse_memfs *
+elfuse_mount_memfs(struct elfuse_mount *mount)
+{
+    return mount->memfs;
+}
+
+struct elfuse_stats *
+elfuse_mount_stats(struct elfuse_mount *mount)
+{
+    return &mount->stats;
+}
+
+const char *
+elfuse_mount_path(const struct elfuse_mount *mount)
+{
+    return mount->path;
+}
+
+enum elfuse_init_code_enum
+elfuse_mount_start(struct elfuse_mount *mount)
+{
+    if (mount->running)
+        return INIT_DONE;
+
+    elfuse_queue_start(mount);
+
+    /* Nothing to mount, requests come from elfuse_loopback_* */
+    if (mount->loopback) {
+        elfuse_log_info("starting loopback mount %s", mount->path);
+        mount->running = true;
+        return INIT_DONE;
+    }
+
+    pthread_mutex_lock(&mount->lock);
+    mount->init_code = INIT_PENDING;
+    if (pthread_create(&mount->thread, NULL, elfuse_fuse_loop, mount) != 0) {
+        mount->init_code = INIT_ERR_ALLOC;
+    } else {
+        while (mount->init_code == INIT_PENDING)
+            pthread_cond_wait(&mount->init_cond, &mount->lock);
+        /* The thread is on its way out on failure */
+        if (mount->init_code != INIT_DONE) {
+            pthread_mutex_unlock(&mount->lock);
+            pthread_join(mount->thread, NULL);
+            pthread_mutex_lock(&mount->lock);
+        }
+    }
+    enum elfuse_init_code_enum code = mount->init_code;
+    pthread_mutex_unlock(&mount->lock);
+
+    if (code == INIT_DONE)
+        mount->running = true;
+    else
+        elfuse_queue_stop(mount);
+    return code;
+}
+
+bool
+elfuse_mount_stop(struct elfuse_mount *mount)
+{
+    if (!mount->running)
+        return false;
+    mount->running = false;
+
+    /* Unblock the workers waiting for Emacs first, they are not cancellable
+     * while doing so */
+    elfuse_queue_stop(mount);
+    if (mount->loopback)
+        return true;
+    pthread_cancel(mount->thread);
+    pthread_join(mount->thread, NULL);
+    return true;
+}
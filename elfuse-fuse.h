@@ -17,18 +17,25 @@
 #define ELFUSE_FUSE_H
 
 #include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
 
-extern pthread_mutex_t elfuse_mutex;
-extern pthread_cond_t elfuse_cond_var;
+/* A mounted file system: its FUSE threads, request queue and caches */
+struct elfuse_mount;
+
+struct elfuse_memfs;
 
 /* Init codes */
 enum elfuse_init_code_enum {
+    INIT_PENDING,
     INIT_DONE,
     INIT_ERR_ARGS,
     INIT_ERR_MOUNT,
     INIT_ERR_CREATE,
     INIT_ERR_ALLOC
-} elfuse_init_code;
+};
 
 /* CREATE args and results */
 struct elfuse_args_create {
@@ -67,16 +74,34 @@ struct elfuse_results_getattr {
         GETATTR_UNKNOWN,
     } code;
     size_t file_size;
+
+    /* Seconds to cache the attributes for, negative for the default */
+    double ttl;
 };
 
 /* READDIR arsg and results */
 struct elfuse_args_readdir {
     const char *path;
+
+    /* Where to resume a paged listing, 0 for the first page */
+    int64_t cursor;
+};
+
+struct elfuse_readdir_entry {
+    char *name;
+
+    /* Set if the handler listed the file attributes as well */
+    bool has_attr;
+    struct elfuse_results_getattr attr;
 };
 
 struct elfuse_results_readdir {
-    char **files;
-    size_t files_size;
+    struct elfuse_readdir_entry *entries;
+    size_t entries_size;
+
+    /* Set if there are more pages, starting at NEXT_CURSOR */
+    bool more;
+    int64_t next_cursor;
 };
 
 /* OPEN args and results */
@@ -152,8 +177,18 @@ struct elfuse_results_unlink {
     } code;
 };
 
-/* A unified data exchange struct. */
+/* A unified data exchange struct, one per request. */
 struct elfuse_call_state {
+    /* Next request in the queue */
+    struct elfuse_call_state *next;
+
+    /* Set and signalled (under the mount lock) once Emacs is done with the request */
+    pthread_cond_t cond;
+    bool done;
+
+    /* Waiting for a deferred reply, see elfuse_call_park */
+    bool parked;
+
     enum elfuse_request_state {
         /* Nothing is waiting */
         WAITING_NONE,
@@ -177,9 +212,22 @@ struct elfuse_call_state {
         RESPONSE_NOTREADY,
         RESPONSE_SIGNAL_ERROR,
         RESPONSE_UNKNOWN_ERROR,
+
+        /* The handler replies later, module side only */
+        RESPONSE_DEFERRED,
     } response_state;
     int response_err_code;
 
+    /* Handlers the request goes to, paths in the args are relative to
+     * their subtree */
+    int route;
+
+    /* Monotonic nanoseconds (elfuse_stats_now) the request was received,
+     * dequeued by Emacs and handled by Lisp, 0 if it wasn't */
+    uint64_t received_ns;
+    uint64_t dequeued_ns;
+    uint64_t handled_ns;
+
     union args {
         struct elfuse_args_create create;
         struct elfuse_args_rename rename;
@@ -206,9 +254,227 @@ struct elfuse_call_state {
         struct elfuse_results_unlink unlink;
     } results;
 
-} elfuse_call;
+};
+
+/* Allocate a request of the given type */
+struct elfuse_call_state *
+elfuse_call_new(enum elfuse_request_state request_state);
+
+void
+elfuse_call_free(struct elfuse_call_state *call);
+
+/* The path a request is about, the old one for renames */
+const char *
+elfuse_call_path(const struct elfuse_call_state *call);
+
+/* Account for the reply RES (-errno on failure) carrying BYTES of data in
+ * the mount statistics and free the request */
+void
+elfuse_call_finish(struct elfuse_mount *mount, struct elfuse_call_state *call, int res, uint64_t bytes);
+
+/* Queue the request and block until Emacs completes it */
+void
+elfuse_call_wait(struct elfuse_mount *mount, struct elfuse_call_state *call);
+
+/* Pop the oldest waiting request, NULL if there's none */
+struct elfuse_call_state *
+elfuse_call_dequeue(struct elfuse_mount *mount);
+
+/* Number of requests waiting for Emacs */
+size_t
+elfuse_queue_length(struct elfuse_mount *mount);
+
+/* Leave CALL waiting for a reply Emacs defers, a spare thread receives
+ * requests in place of the waiting one meanwhile. Return false if the mount
+ * has elfuse_max_deferred calls parked already. */
+bool
+elfuse_call_park(struct elfuse_mount *mount, struct elfuse_call_state *call);
+
+/* Publish the results and wake up the waiting FUSE thread */
+void
+elfuse_call_complete(struct elfuse_mount *mount, struct elfuse_call_state *call,
+                     enum elfuse_response_state response_state);
+
+/* Write a byte to FD whenever the queue of any mount stops being empty, -1
+ * to stop (closes the previous descriptor) */
+void
+elfuse_set_wakeup_fd(int fd);
+
+/* Ops Emacs may handle */
+enum elfuse_op {
+    OP_CREATE,
+    OP_RENAME,
+    OP_READDIR,
+    OP_READDIR_PAGE,
+    OP_GETATTR,
+    OP_OPEN,
+    OP_RELEASE,
+    OP_READ,
+    OP_WRITE,
+    OP_TRUNCATE,
+    OP_UNLINK,
+    OP_COUNT,
+};
+
+#define ELFUSE_OP_BIT(op) (UINT32_C(1) << (op))
+
+/* Send requests for paths below PREFIX ("/" for the whole mount) to the
+ * ROUTE handlers, the longest prefix wins. OPS is a bitmask of the ops they
+ * handle (ELFUSE_OP_BIT), FUSE threads answer ENOSYS on their own for the
+ * others, and ENOENT for paths nothing is routed to. Return false if out
+ * of memory. */
+bool
+elfuse_set_route(struct elfuse_mount *mount, const char *prefix, int route, uint32_t ops);
+
+void
+elfuse_unset_route(struct elfuse_mount *mount, const char *prefix);
+
+/* Defaults for new mounts, each mount keeps the values it was created with */
+
+/* Number of threads receiving FUSE requests, up to ELFUSE_MAX_THREADS */
+extern int elfuse_thread_count;
+#define ELFUSE_MAX_THREADS 64
+
+/* Largest number of requests of a mount left waiting for deferred replies,
+ * each one keeps a thread of its own */
+extern int elfuse_max_deferred;
+
+/* Default lifetime of cached attributes in seconds (0 disables the cache)
+ * and the maximum number of entries */
+extern double elfuse_attr_cache_ttl;
+extern size_t elfuse_attr_cache_size;
+
+/* Lifetime in seconds and maximum number of paths cached as missing */
+extern double elfuse_negative_cache_ttl;
+extern size_t elfuse_negative_cache_size;
+
+/* Lifetime in seconds and memory budget in bytes of cached file contents */
+extern double elfuse_read_cache_ttl;
+extern size_t elfuse_read_cache_size;
+
+/* Largest number of bytes read ahead when a file is read sequentially, 0
+ * disables readahead */
+extern size_t elfuse_readahead_max;
+
+/* Gather contiguous writes to a file and hand them to Emacs at once when
+ * the file is flushed, or when the size (bytes) or age (seconds) limit of
+ * the buffer is reached */
+extern bool elfuse_write_back;
+extern size_t elfuse_write_back_size;
+extern double elfuse_write_back_age;
+
+/* Bytes of file contents a memory mount may hold */
+extern size_t elfuse_memory_max_size;
+
+/* Value kinds of the FUSE mount options Elfuse passes on */
+enum elfuse_mount_option_type {
+    MOUNT_OPTION_UNKNOWN,
+    MOUNT_OPTION_FLAG,
+    MOUNT_OPTION_SECONDS,
+    MOUNT_OPTION_BYTES,
+};
+
+enum elfuse_mount_option_type
+elfuse_mount_option_type(const char *name);
+
+/* Add an option to the next mount created, a non-zero value turns flags on. Return
+ * false if the value is out of range. */
+bool
+elfuse_mount_option_add(const char *name, double value);
+
+void
+elfuse_mount_options_clear(void);
+
+/* Forget cached attributes (including misses) of a path, or everything
+ * cached about all paths */
+void
+elfuse_invalidate_attr(struct elfuse_mount *mount, const char *path);
+
+void
+elfuse_invalidate_all(struct elfuse_mount *mount);
+
+/* Forget cached contents of a file, or of all files below a directory */
+void
+elfuse_invalidate_content(struct elfuse_mount *mount, const char *path);
+
+/* Changes Emacs announces to the kernel */
+enum elfuse_notify_kind {
+    NOTIFY_CHANGED,
+    NOTIFY_DELETED,
+};
+
+/* Forget what Elfuse caches about a path and queue the invalidation of the
+ * kernel caches. Return false if nothing is mounted. */
+bool
+elfuse_notify(struct elfuse_mount *mount, enum elfuse_notify_kind kind, const char *path);
+
+/* Per-request-type counters and latencies of requests the mount sent to
+ * Emacs, see elfuse-stats.h */
+struct elfuse_stats;
+
+struct elfuse_stats *
+elfuse_mount_stats(struct elfuse_mount *mount);
+
+/* Record every request the mount receives to FILENAME, see elfuse-trace.h,
+ * or stop if NULL. Return false if the file can't be written. */
+bool
+elfuse_mount_trace(struct elfuse_mount *mount, const char *filename);
+
+/* The tree a mount started with the memory option serves, see
+ * elfuse-memfs.h, NULL for other mounts */
+struct elfuse_memfs *
+elfuse_mount_memfs(struct elfuse_mount *mount);
+
+/* Requests to a mount started with the loopback option, which takes no
+ * requests from the kernel. They run the same callbacks as kernel requests
+ * and block until Emacs answers, i.e. they can't be made from the Emacs
+ * thread. Return -errno on failure. */
+
+/* 0 on success */
+int
+elfuse_loopback_getattr(struct elfuse_mount *mount, const char *path);
+
+/* List a directory to the end, return the number of entries */
+int
+elfuse_loopback_readdir(struct elfuse_mount *mount, const char *path);
+
+/* Open (create with O_CREAT) a file, store the handle in FH */
+int
+elfuse_loopback_open(struct elfuse_mount *mount, const char *path, int flags, uint64_t *fh);
+
+/* Return the number of bytes read or written */
+int
+elfuse_loopback_read(struct elfuse_mount *mount, const char *path, uint64_t fh, char *buf, size_t size, off_t offset);
+
+int
+elfuse_loopback_write(struct elfuse_mount *mount, const char *path, uint64_t fh, const char *buf, size_t size, off_t offset);
+
+/* Flush and release, like a close(2) */
+int
+elfuse_loopback_release(struct elfuse_mount *mount, const char *path, uint64_t fh);
+
+int
+elfuse_loopback_unlink(struct elfuse_mount *mount, const char *path);
+
+/* Create a mount of PATH with the current defaults and mount options, NULL
+ * if out of memory. Nothing is mounted before elfuse_mount_start. */
+struct elfuse_mount *
+elfuse_mount_new(const char *path);
+
+/* Stop the mount if it's running and free it */
+void
+elfuse_mount_free(struct elfuse_mount *mount);
+
+const char *
+elfuse_mount_path(const struct elfuse_mount *mount);
+
+/* Mount and launch the FUSE threads, block until they are up */
+enum elfuse_init_code_enum
+elfuse_mount_start(struct elfuse_mount *mount);
 
-void *
-elfuse_fuse_loop(void *mountpath);
+/* Fail pending requests, unmount and join the FUSE threads. Return false if
+ * the mount wasn't running. */
+bool
+elfuse_mount_stop(struct elfuse_mount *mount);
 
 #endif //ELFUSE_FUSE_H
@@ -0,0 +1,197 @@
+/* This file is part of Elfuse. */
+
+/* Elfuse is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or */
+/* (at your option) any later version. */
+
+/* Elfuse is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the */
+/* GNU General Public License for more details. */
+
+/* You should have received a copy of the GNU General Public License */
+/* along with Elfuse.  If not, see <http://www.gnu.org/licenses/>. */
+
+#define _XOPEN_SOURCE 700
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "elfuse-log.h"
+
+atomic_int elfuse_log_level = ELFUSE_LOG_WARN;
+
+/* A bounded multi-producer single-consumer ring (after D. Vyukov's queue).
+ * A slot is free for the producer of ticket N once its sequence is N, and
+ * holds a message for the writer once it's N + 1. */
+#define ELFUSE_LOG_SLOTS 1024
+
+struct elfuse_log_slot {
+    atomic_uint_fast64_t sequence;
+    enum elfuse_log_level level;
+    char line[ELFUSE_LOG_LINE];
+};
+
+static struct elfuse_log_slot elfuse_log_ring[ELFUSE_LOG_SLOTS];
+static atomic_uint_fast64_t elfuse_log_head;
+static uint64_t elfuse_log_tail;
+static atomic_uint_fast64_t elfuse_log_dropped;
+
+/* The writer sleeps on the condition variable only while the ring is
+ * empty, producers take the mutex just to wake it up */
+static pthread_mutex_t elfuse_log_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t elfuse_log_cond = PTHREAD_COND_INITIALIZER;
+static atomic_bool elfuse_log_sleeping;
+static bool elfuse_log_running;
+static pthread_t elfuse_log_thread;
+
+static const char *elfuse_log_level_names[] = {
+    [ELFUSE_LOG_ERROR] = "error",
+    [ELFUSE_LOG_WARN] = "warn",
+    [ELFUSE_LOG_INFO] = "info",
+    [ELFUSE_LOG_DEBUG] = "debug",
+};
+
+static void
+elfuse_log_init_ring(void)
+{
+    for (uint64_t i = 0; i < ELFUSE_LOG_SLOTS; i++)
+        atomic_init(&elfuse_log_ring[i].sequence, i);
+}
+
+static pthread_once_t elfuse_log_once = PTHREAD_ONCE_INIT;
+
+void
+elfuse_log_write(enum elfuse_log_level level, const char *format, ...)
+{
+    pthread_once(&elfuse_log_once, elfuse_log_init_ring);
+
+    struct elfuse_log_slot *slot;
+    uint64_t ticket = atomic_load_explicit(&elfuse_log_head, memory_order_relaxed);
+    for (;;) {
+        slot = &elfuse_log_ring[ticket % ELFUSE_LOG_SLOTS];
+        uint64_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        int64_t diff = (int64_t) (sequence - ticket);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&elfuse_log_head, &ticket, ticket + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            /* Full, the writer is behind */
+            atomic_fetch_add_explicit(&elfuse_log_dropped, 1, memory_order_relaxed);
+            return;
+        } else {
+            ticket = atomic_load_explicit(&elfuse_log_head, memory_order_relaxed);
+        }
+    }
+
+    slot->level = level;
+    va_list ap;
+    va_start(ap, format);
+    vsnprintf(slot->line, sizeof(slot->line), format, ap);
+    va_end(ap);
+    atomic_store_explicit(&slot->sequence, ticket + 1, memory_order_release);
+
+    if (atomic_load(&elfuse_log_sleeping) && atomic_exchange(&elfuse_log_sleeping, false)) {
+        pthread_mutex_lock(&elfuse_log_mutex);
+        pthread_cond_signal(&elfuse_log_cond);
+        pthread_mutex_unlock(&elfuse_log_mutex);
+    }
+}
+
+/* Print everything in the ring, return false if it was empty */
+static bool
+elfuse_log_drain(void)
+{
+    bool printed = false;
+
+    for (;;) {
+        struct elfuse_log_slot *slot = &elfuse_log_ring[elfuse_log_tail % ELFUSE_LOG_SLOTS];
+        uint64_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        if (sequence != elfuse_log_tail + 1)
+            break;
+
+        fprintf(stderr, "Elfuse [%s]: %s\n", elfuse_log_level_names[slot->level], slot->line);
+        atomic_store_explicit(&slot->sequence, elfuse_log_tail + ELFUSE_LOG_SLOTS, memory_order_release);
+        elfuse_log_tail++;
+        printed = true;
+    }
+
+    uint64_t dropped = atomic_exchange_explicit(&elfuse_log_dropped, 0, memory_order_relaxed);
+    if (dropped > 0)
+        fprintf(stderr, "Elfuse [warn]: %" PRIuFAST64 " log messages dropped\n", dropped);
+
+    return printed;
+}
+
+static void *
+elfuse_log_loop(void *data)
+{
+    (void) data;
+
+    pthread_mutex_lock(&elfuse_log_mutex);
+    while (elfuse_log_running) {
+        pthread_mutex_unlock(&elfuse_log_mutex);
+        bool printed = elfuse_log_drain();
+        pthread_mutex_lock(&elfuse_log_mutex);
+        if (printed || !elfuse_log_running)
+            continue;
+
+        /* Look again once sleeping is visible to producers, a message
+         * written in between would not wake us up */
+        atomic_store(&elfuse_log_sleeping, true);
+        pthread_mutex_unlock(&elfuse_log_mutex);
+        bool empty = !elfuse_log_drain();
+        pthread_mutex_lock(&elfuse_log_mutex);
+        if (empty && elfuse_log_running && atomic_load(&elfuse_log_sleeping)) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += 1;
+            pthread_cond_timedwait(&elfuse_log_cond, &elfuse_log_mutex, &deadline);
+        }
+        atomic_store(&elfuse_log_sleeping, false);
+    }
+    pthread_mutex_unlock(&elfuse_log_mutex);
+
+    elfuse_log_drain();
+    return NULL;
+}
+
+bool
+elfuse_log_start(void)
+{
+    pthread_once(&elfuse_log_once, elfuse_log_init_ring);
+
+    pthread_mutex_lock(&elfuse_log_mutex);
+    if (!elfuse_log_running) {
+        elfuse_log_running = true;
+        if (pthread_create(&elfuse_log_thread, NULL, elfuse_log_loop, NULL) != 0)
+            elfuse_log_running = false;
+    }
+    bool running = elfuse_log_running;
+    pthread_mutex_unlock(&elfuse_log_mutex);
+
+    return running;
+}
+
+void
+elfuse_log_stop(void)
+{
+    pthread_mutex_lock(&elfuse_log_mutex);
+    if (!elfuse_log_running) {
+        pthread_mutex_unlock(&elfuse_log_mutex);
+        return;
+    }
+    elfuse_log_running = false;
+    pthread_cond_signal(&elfuse_log_cond);
+    pthread_mutex_unlock(&elfuse_log_mutex);
+
+    pthread_join(elfuse_log_thread, NULL);
+}
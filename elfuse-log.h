@@ -0,0 +1,69 @@
+/* This file is part of Elfuse. */
+
+/* Elfuse is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or */
+/* (at your option) any later version. */
+
+/* Elfuse is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the */
+/* GNU General Public License for more details. */
+
+/* You should have received a copy of the GNU General Public License */
+/* along with Elfuse.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef ELFUSE_LOG_H
+#define ELFUSE_LOG_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+enum elfuse_log_level {
+    ELFUSE_LOG_OFF = -1,
+    ELFUSE_LOG_ERROR,
+    ELFUSE_LOG_WARN,
+    ELFUSE_LOG_INFO,
+    ELFUSE_LOG_DEBUG,
+};
+
+/* Messages above this level are compiled out */
+#ifndef ELFUSE_LOG_MAX_LEVEL
+#define ELFUSE_LOG_MAX_LEVEL ELFUSE_LOG_DEBUG
+#endif
+
+/* Messages above this level are dropped at run time */
+extern atomic_int elfuse_log_level;
+
+/* Costs a branch when LEVEL is off, the arguments aren't evaluated then */
+#define elfuse_log(level, ...)                                          \
+    do {                                                                \
+        if ((level) <= ELFUSE_LOG_MAX_LEVEL                             \
+            && (int) (level) <= atomic_load_explicit(&elfuse_log_level, memory_order_relaxed)) \
+            elfuse_log_write((level), __VA_ARGS__);                     \
+    } while (0)
+
+#define elfuse_log_error(...) elfuse_log(ELFUSE_LOG_ERROR, __VA_ARGS__)
+#define elfuse_log_warn(...) elfuse_log(ELFUSE_LOG_WARN, __VA_ARGS__)
+#define elfuse_log_info(...) elfuse_log(ELFUSE_LOG_INFO, __VA_ARGS__)
+#define elfuse_log_debug(...) elfuse_log(ELFUSE_LOG_DEBUG, __VA_ARGS__)
+
+/* Format a message into the ring buffer without blocking, the writer thread
+ * prints it to stderr later. Messages are dropped (and counted) while the
+ * ring is full, and cut at ELFUSE_LOG_LINE bytes. */
+#define ELFUSE_LOG_LINE 256
+
+void
+elfuse_log_write(enum elfuse_log_level level, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/* Launch the writer thread / print what's left and join it. Messages
+ * written while it isn't running wait in the ring. */
+bool
+elfuse_log_start(void);
+
+void
+elfuse_log_stop(void);
+
+#endif //ELFUSE_LOG_H
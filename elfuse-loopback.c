@@ -0,0 +1,246 @@
+/* This file is part of Elfuse. */
+
+/* Elfuse is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or */
+/* (at your option) any later version. */
+
+/* Elfuse is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the */
+/* GNU General Public License for more details. */
+
+/* You should have received a copy of the GNU General Public License */
+/* along with Elfuse.  If not, see <http://www.gnu.org/licenses/>. */
+
+#define _XOPEN_SOURCE 700
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "elfuse-fuse.h"
+#include "elfuse-log.h"
+#include "elfuse-loopback.h"
+#include "elfuse-stats.h"
+
+struct elfuse_loopback_worker {
+    struct elfuse_loopback_run *run;
+    pthread_t thread;
+    bool started;
+    uint64_t errors;
+    uint64_t bytes;
+    uint64_t end_ns;
+};
+
+struct elfuse_loopback_run {
+    struct elfuse_mount *mount;
+    enum elfuse_loopback_workload workload;
+    char *path;
+    size_t size;
+    size_t count;
+
+    /* Requests taken by the threads, and latencies of the finished ones */
+    atomic_size_t taken;
+    atomic_size_t recorded;
+    uint64_t *latencies;
+
+    atomic_int running;
+    atomic_bool stop;
+    bool joined;
+    uint64_t start_ns;
+
+    int thread_count;
+    struct elfuse_loopback_worker workers[];
+};
+
+static bool
+elfuse_loopback_take(struct elfuse_loopback_run *run)
+{
+    if (atomic_load_explicit(&run->stop, memory_order_relaxed))
+        return false;
+    return atomic_fetch_add_explicit(&run->taken, 1, memory_order_relaxed) < run->count;
+}
+
+static void
+elfuse_loopback_record(struct elfuse_loopback_worker *worker, uint64_t start_ns, int res)
+{
+    struct elfuse_loopback_run *run = worker->run;
+    size_t index = atomic_fetch_add_explicit(&run->recorded, 1, memory_order_relaxed);
+    run->latencies[index] = elfuse_stats_now() - start_ns;
+    if (res < 0)
+        worker->errors++;
+    else if (run->workload != LOOPBACK_GETATTR)
+        worker->bytes += res;
+}
+
+static void *
+elfuse_loopback_worker(void *arg)
+{
+    struct elfuse_loopback_worker *worker = arg;
+    struct elfuse_loopback_run *run = worker->run;
+    char *buffer = NULL;
+    uint64_t fh = 0;
+    bool opened = false;
+
+    switch (run->workload) {
+    case LOOPBACK_READ:
+    case LOOPBACK_WRITE:
+        buffer = malloc(run->size);
+        if (buffer == NULL) {
+            worker->errors++;
+            break;
+        }
+        memset(buffer, 'x', run->size);
+        int flags = run->workload == LOOPBACK_READ ? O_RDONLY : O_WRONLY;
+        if (elfuse_loopback_open(run->mount, run->path, flags, &fh) != 0) {
+            worker->errors++;
+            break;
+        }
+        opened = true;
+        break;
+    default:
+        break;
+    }
+
+    off_t offset = 0;
+    while ((buffer == NULL || opened) && elfuse_loopback_take(run)) {
+        uint64_t start_ns = elfuse_stats_now();
+        int res;
+        switch (run->workload) {
+        case LOOPBACK_GETATTR:
+            res = elfuse_loopback_getattr(run->mount, run->path);
+            break;
+        case LOOPBACK_READDIR:
+            res = elfuse_loopback_readdir(run->mount, run->path);
+            break;
+        case LOOPBACK_READ:
+            res = elfuse_loopback_read(run->mount, run->path, fh, buffer, run->size, offset);
+            /* Start over at the end of the file */
+            offset = res > 0 ? offset + res : 0;
+            break;
+        default:
+            res = elfuse_loopback_write(run->mount, run->path, fh, buffer, run->size, offset);
+            offset += run->size;
+            break;
+        }
+        elfuse_loopback_record(worker, start_ns, res);
+    }
+
+    if (opened && elfuse_loopback_release(run->mount, run->path, fh) != 0)
+        worker->errors++;
+    free(buffer);
+
+    worker->end_ns = elfuse_stats_now();
+    atomic_fetch_sub_explicit(&run->running, 1, memory_order_release);
+    return NULL;
+}
+
+struct elfuse_loopback_run *
+elfuse_loopback_run_start(struct elfuse_mount *mount, enum elfuse_loopback_workload workload,
+                          const char *path, size_t size, size_t count, int threads)
+{
+    if (threads < 1)
+        threads = 1;
+    struct elfuse_loopback_run *run = calloc(1, sizeof(*run) + threads * sizeof(run->workers[0]));
+    if (run == NULL)
+        return NULL;
+    run->mount = mount;
+    run->workload = workload;
+    run->path = strdup(path);
+    run->size = size > 0 ? size : 4096;
+    run->count = count;
+    run->latencies = malloc((count > 0 ? count : 1) * sizeof(run->latencies[0]));
+    atomic_init(&run->taken, 0);
+    atomic_init(&run->recorded, 0);
+    atomic_init(&run->running, threads);
+    atomic_init(&run->stop, false);
+    run->thread_count = threads;
+    if (run->path == NULL || run->latencies == NULL) {
+        free(run->path);
+        free(run->latencies);
+        free(run);
+        return NULL;
+    }
+
+    run->start_ns = elfuse_stats_now();
+    for (int i = 0; i < threads; i++) {
+        struct elfuse_loopback_worker *worker = &run->workers[i];
+        worker->run = run;
+        worker->started = pthread_create(&worker->thread, NULL, elfuse_loopback_worker, worker) == 0;
+        if (!worker->started) {
+            elfuse_log_error("failed to launch a loopback thread");
+            atomic_fetch_sub_explicit(&run->running, threads - i, memory_order_release);
+            elfuse_loopback_run_free(run);
+            return NULL;
+        }
+    }
+    return run;
+}
+
+bool
+elfuse_loopback_run_done(struct elfuse_loopback_run *run)
+{
+    return atomic_load_explicit(&run->running, memory_order_acquire) == 0;
+}
+
+static void
+elfuse_loopback_run_join(struct elfuse_loopback_run *run)
+{
+    if (run->joined)
+        return;
+    for (int i = 0; i < run->thread_count; i++) {
+        if (run->workers[i].started)
+            pthread_join(run->workers[i].thread, NULL);
+    }
+    run->joined = true;
+}
+
+static int
+elfuse_loopback_compare(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+void
+elfuse_loopback_run_result(struct elfuse_loopback_run *run, struct elfuse_loopback_result *result)
+{
+    elfuse_loopback_run_join(run);
+
+    memset(result, 0, sizeof(*result));
+    uint64_t end_ns = run->start_ns;
+    for (int i = 0; i < run->thread_count; i++) {
+        struct elfuse_loopback_worker *worker = &run->workers[i];
+        result->errors += worker->errors;
+        result->bytes += worker->bytes;
+        if (worker->end_ns > end_ns)
+            end_ns = worker->end_ns;
+    }
+    result->seconds = (end_ns - run->start_ns) / 1e9;
+
+    size_t requests = atomic_load_explicit(&run->recorded, memory_order_relaxed);
+    result->requests = requests;
+    if (requests > 0) {
+        qsort(run->latencies, requests, sizeof(run->latencies[0]), elfuse_loopback_compare);
+        result->p50_ns = run->latencies[(requests - 1) * 50 / 100];
+        result->p99_ns = run->latencies[(requests - 1) * 99 / 100];
+        result->max_ns = run->latencies[requests - 1];
+    }
+}
+
+void
+elfuse_loopback_run_free(struct elfuse_loopback_run *run)
+{
+    if (run == NULL)
+        return;
+    atomic_store_explicit(&run->stop, true, memory_order_relaxed);
+    elfuse_loopback_run_join(run);
+    free(run->latencies);
+    free(run->path);
+    free(run);
+}
@@ -0,0 +1,67 @@
+/* This file is part of Elfuse. */
+
+/* Elfuse is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or */
+/* (at your option) any later version. */
+
+/* Elfuse is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the */
+/* GNU General Public License for more details. */
+
+/* You should have received a copy of the GNU General Public License */
+/* along with Elfuse.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef ELFUSE_LOOPBACK_H
+#define ELFUSE_LOOPBACK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "elfuse-fuse.h"
+
+/* What each request of a loopback run does */
+enum elfuse_loopback_workload {
+    LOOPBACK_GETATTR,
+    LOOPBACK_READDIR,
+    LOOPBACK_READ,
+    LOOPBACK_WRITE,
+};
+
+struct elfuse_loopback_result {
+    uint64_t requests;
+    uint64_t errors;
+    /* Bytes read or written, entries listed */
+    uint64_t bytes;
+    double seconds;
+    /* Request latencies */
+    uint64_t p50_ns;
+    uint64_t p99_ns;
+    uint64_t max_ns;
+};
+
+/* Driver threads making COUNT requests to a loopback mount between them,
+ * timing each one */
+struct elfuse_loopback_run;
+
+/* Start THREADS threads making requests to PATH, reads and writes of SIZE
+ * bytes go through the file sequentially. NULL if out of memory or threads. */
+struct elfuse_loopback_run *
+elfuse_loopback_run_start(struct elfuse_mount *mount, enum elfuse_loopback_workload workload,
+                          const char *path, size_t size, size_t count, int threads);
+
+/* True once every thread made its requests */
+bool
+elfuse_loopback_run_done(struct elfuse_loopback_run *run);
+
+/* Wait for the threads and sum up */
+void
+elfuse_loopback_run_result(struct elfuse_loopback_run *run, struct elfuse_loopback_result *result);
+
+/* Stop the threads early, wait for them and free the run */
+void
+elfuse_loopback_run_free(struct elfuse_loopback_run *run);
+
+#endif //ELFUSE_LOOPBACK_H
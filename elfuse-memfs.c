@@ -0,0 +1,637 @@
+/* This file is part of Elfuse. */
+
+/* Elfuse is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or */
+/* (at your option) any later version. */
+
+/* Elfuse is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the */
+/* GNU General Public License for more details. */
+
+/* You should have received a copy of the GNU General Public License */
+/* along with Elfuse.  If not, see <http://www.gnu.org/licenses/>. */
+
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "elfuse-cache.h"
+#include "elfuse-memfs.h"
+
+struct elfuse_memfs_node {
+    /* Next node in the same bucket */
+    struct elfuse_memfs_node *chain;
+    uint64_t hash;
+    char *path;
+    /* Last component of the path */
+    const char *name;
+
+    /* Entries of a directory, siblings linked both ways */
+    struct elfuse_memfs_node *parent;
+    struct elfuse_memfs_node *children;
+    struct elfuse_memfs_node *prev;
+    struct elfuse_memfs_node *next;
+
+    bool dir;
+    char *data;
+    size_t size;
+    size_t capacity;
+    struct timespec mtime;
+};
+
+struct elfuse_memfs {
+    pthread_rwlock_t lock;
+
+    struct elfuse_memfs_node **buckets;
+    size_t buckets_size;
+    size_t nodes;
+
+    struct elfuse_memfs_node *root;
+
+    /* Bytes of file contents, writes past max_size fail */
+    size_t size;
+    size_t max_size;
+};
+
+static void
+node_set_path(struct elfuse_memfs_node *node, char *path)
+{
+    node->path = path;
+    node->hash = elfuse_hash_path(path);
+    const char *slash = strrchr(path, '/');
+    node->name = slash != NULL && slash[1] != '\0' ? slash + 1 : path;
+}
+
+static struct elfuse_memfs_node *
+node_new(const char *path, bool dir)
+{
+    struct elfuse_memfs_node *node = calloc(1, sizeof(*node));
+    char *copy = strdup(path);
+    if (node == NULL || copy == NULL) {
+        free(node);
+        free(copy);
+        return NULL;
+    }
+    node_set_path(node, copy);
+    node->dir = dir;
+    clock_gettime(CLOCK_REALTIME, &node->mtime);
+    return node;
+}
+
+static struct elfuse_memfs_node **
+find_slot(struct elfuse_memfs *fs, const char *path, uint64_t hash)
+{
+    struct elfuse_memfs_node **slot = &fs->buckets[hash & (fs->buckets_size - 1)];
+    while (*slot != NULL) {
+        if ((*slot)->hash == hash && strcmp((*slot)->path, path) == 0)
+            break;
+        slot = &(*slot)->chain;
+    }
+    return slot;
+}
+
+static struct elfuse_memfs_node *
+find_node(struct elfuse_memfs *fs, const char *path)
+{
+    return *find_slot(fs, path, elfuse_hash_path(path));
+}
+
+/* Keep about a node per bucket, a failure to grow only makes chains longer */
+static void
+table_grow(struct elfuse_memfs *fs)
+{
+    size_t buckets_size = fs->buckets_size * 2;
+    struct elfuse_memfs_node **buckets = calloc(buckets_size, sizeof(buckets[0]));
+    if (buckets == NULL)
+        return;
+
+    for (size_t i = 0; i < fs->buckets_size; i++) {
+        struct elfuse_memfs_node *node = fs->buckets[i];
+        while (node != NULL) {
+            struct elfuse_memfs_node *chain = node->chain;
+            struct elfuse_memfs_node **bucket = &buckets[node->hash & (buckets_size - 1)];
+            node->chain = *bucket;
+            *bucket = node;
+            node = chain;
+        }
+    }
+    free(fs->buckets);
+    fs->buckets = buckets;
+    fs->buckets_size = buckets_size;
+}
+
+static void
+table_insert(struct elfuse_memfs *fs, struct elfuse_memfs_node *node)
+{
+    if (fs->nodes >= fs->buckets_size)
+        table_grow(fs);
+    struct elfuse_memfs_node **bucket = &fs->buckets[node->hash & (fs->buckets_size - 1)];
+    node->chain = *bucket;
+    *bucket = node;
+    fs->nodes++;
+}
+
+static void
+table_remove(struct elfuse_memfs *fs, struct elfuse_memfs_node *node)
+{
+    struct elfuse_memfs_node **slot = find_slot(fs, node->path, node->hash);
+    *slot = node->chain;
+    node->chain = NULL;
+    fs->nodes--;
+}
+
+static void
+touch(struct elfuse_memfs_node *node)
+{
+    clock_gettime(CLOCK_REALTIME, &node->mtime);
+}
+
+static void
+attach(struct elfuse_memfs_node *parent, struct elfuse_memfs_node *node)
+{
+    node->parent = parent;
+    node->prev = NULL;
+    node->next = parent->children;
+    if (parent->children != NULL)
+        parent->children->prev = node;
+    parent->children = node;
+    touch(parent);
+}
+
+static void
+detach(struct elfuse_memfs_node *node)
+{
+    struct elfuse_memfs_node *parent = node->parent;
+    if (node->prev != NULL)
+        node->prev->next = node->next;
+    else
+        parent->children = node->next;
+    if (node->next != NULL)
+        node->next->prev = node->prev;
+    node->parent = node->prev = node->next = NULL;
+    touch(parent);
+}
+
+/* Drop NODE and everything below it from the table and free them */
+static void
+free_subtree(struct elfuse_memfs *fs, struct elfuse_memfs_node *node)
+{
+    while (node->children != NULL) {
+        struct elfuse_memfs_node *child = node->children;
+        node->children = child->next;
+        free_subtree(fs, child);
+    }
+    table_remove(fs, node);
+    fs->size -= node->size;
+    free(node->data);
+    free(node->path);
+    free(node);
+}
+
+/* The directory PATH would be created in */
+static int
+find_parent(struct elfuse_memfs *fs, const char *path, struct elfuse_memfs_node **parent)
+{
+    const char *slash = strrchr(path, '/');
+    if (slash == NULL || slash[1] == '\0')
+        return -EINVAL;
+
+    size_t length = slash > path ? (size_t) (slash - path) : 1;
+    char parent_path[length + 1];
+    memcpy(parent_path, path, length);
+    parent_path[length] = '\0';
+
+    *parent = find_node(fs, parent_path);
+    if (*parent == NULL)
+        return -ENOENT;
+    if (!(*parent)->dir)
+        return -ENOTDIR;
+    return 0;
+}
+
+static int
+add_node(struct elfuse_memfs *fs, const char *path, bool dir, struct elfuse_memfs_node **added)
+{
+    struct elfuse_memfs_node *parent;
+    int res = find_parent(fs, path, &parent);
+    if (res != 0)
+        return res;
+
+    struct elfuse_memfs_node *node = node_new(path, dir);
+    if (node == NULL)
+        return -ENOMEM;
+    table_insert(fs, node);
+    attach(parent, node);
+    if (added != NULL)
+        *added = node;
+    return 0;
+}
+
+/* Capacity stops doubling there, large files grow by that much at a time */
+#define MEMFS_GROWTH_MAX (1024 * 1024)
+
+/* Make room for SIZE bytes of contents, zero-filling what's new */
+static int
+resize(struct elfuse_memfs *fs, struct elfuse_memfs_node *node, size_t size)
+{
+    if (size > fs->max_size)
+        return -EFBIG;
+    if (size > node->size && size - node->size > fs->max_size - fs->size)
+        return -ENOSPC;
+
+    if (size > node->capacity) {
+        size_t capacity = node->capacity > 0 ? node->capacity : 4096;
+        while (capacity < size && capacity < MEMFS_GROWTH_MAX)
+            capacity *= 2;
+        if (capacity < size)
+            capacity = (size + MEMFS_GROWTH_MAX - 1) / MEMFS_GROWTH_MAX * MEMFS_GROWTH_MAX;
+        char *data = realloc(node->data, capacity);
+        if (data == NULL)
+            return -ENOMEM;
+        node->data = data;
+        node->capacity = capacity;
+    }
+    if (size > node->size)
+        memset(node->data + node->size, 0, size - node->size);
+    fs->size = fs->size - node->size + size;
+    node->size = size;
+    touch(node);
+    return 0;
+}
+
+static void
+fill_stat(const struct elfuse_memfs_node *node, struct stat *stbuf)
+{
+    memset(stbuf, 0, sizeof(*stbuf));
+    if (node->dir) {
+        stbuf->st_mode = S_IFDIR | 0755;
+        stbuf->st_nlink = 2;
+    } else {
+        stbuf->st_mode = S_IFREG | 0666;
+        stbuf->st_nlink = 1;
+        stbuf->st_size = node->size;
+    }
+    stbuf->st_mtim = node->mtime;
+    stbuf->st_ctim = node->mtime;
+}
+
+struct elfuse_memfs *
+elfuse_memfs_new(size_t max_size)
+{
+    struct elfuse_memfs *fs = calloc(1, sizeof(*fs));
+    if (fs == NULL)
+        return NULL;
+    fs->max_size = max_size;
+
+    fs->buckets_size = 64;
+    fs->buckets = calloc(fs->buckets_size, sizeof(fs->buckets[0]));
+    fs->root = node_new("/", true);
+    if (fs->buckets == NULL || fs->root == NULL) {
+        free(fs->buckets);
+        free(fs->root);
+        free(fs);
+        return NULL;
+    }
+    table_insert(fs, fs->root);
+    pthread_rwlock_init(&fs->lock, NULL);
+
+    return fs;
+}
+
+void
+elfuse_memfs_free(struct elfuse_memfs *fs)
+{
+    if (fs == NULL)
+        return;
+    free_subtree(fs, fs->root);
+    pthread_rwlock_destroy(&fs->lock);
+    free(fs->buckets);
+    free(fs);
+}
+
+int
+elfuse_memfs_getattr(struct elfuse_memfs *fs, const char *path, struct stat *stbuf)
+{
+    pthread_rwlock_rdlock(&fs->lock);
+    struct elfuse_memfs_node *node = find_node(fs, path);
+    if (node != NULL)
+        fill_stat(node, stbuf);
+    pthread_rwlock_unlock(&fs->lock);
+    return node != NULL ? 0 : -ENOENT;
+}
+
+int
+elfuse_memfs_list(struct elfuse_memfs *fs, const char *path,
+                  int (*filler)(void *data, const char *name, const struct stat *stbuf), void *data)
+{
+    int res = 0;
+    pthread_rwlock_rdlock(&fs->lock);
+    struct elfuse_memfs_node *node = find_node(fs, path);
+    if (node == NULL) {
+        res = -ENOENT;
+    } else if (!node->dir) {
+        res = -ENOTDIR;
+    } else {
+        for (struct elfuse_memfs_node *child = node->children; child != NULL; child = child->next) {
+            struct stat stbuf;
+            fill_stat(child, &stbuf);
+            if (filler(data, child->name, &stbuf) != 0)
+                break;
+        }
+    }
+    pthread_rwlock_unlock(&fs->lock);
+    return res;
+}
+
+int
+elfuse_memfs_create(struct elfuse_memfs *fs, const char *path, bool dir)
+{
+    pthread_rwlock_wrlock(&fs->lock);
+    int res = find_node(fs, path) != NULL ? -EEXIST : add_node(fs, path, dir, NULL);
+    pthread_rwlock_unlock(&fs->lock);
+    return res;
+}
+
+int
+elfuse_memfs_read(struct elfuse_memfs *fs, const char *path, char *buf, size_t size, off_t offset)
+{
+    int res;
+    pthread_rwlock_rdlock(&fs->lock);
+    struct elfuse_memfs_node *node = find_node(fs, path);
+    if (node == NULL) {
+        res = -ENOENT;
+    } else if (node->dir) {
+        res = -EISDIR;
+    } else if (offset < 0) {
+        res = -EINVAL;
+    } else if ((size_t) offset >= node->size) {
+        res = 0;
+    } else {
+        if (size > node->size - offset)
+            size = node->size - offset;
+        memcpy(buf, node->data + offset, size);
+        res = size;
+    }
+    pthread_rwlock_unlock(&fs->lock);
+    return res;
+}
+
+int
+elfuse_memfs_write(struct elfuse_memfs *fs, const char *path, const char *buf, size_t size, off_t offset)
+{
+    int res;
+    pthread_rwlock_wrlock(&fs->lock);
+    struct elfuse_memfs_node *node = find_node(fs, path);
+    if (node == NULL) {
+        res = -ENOENT;
+    } else if (node->dir) {
+        res = -EISDIR;
+    } else if (offset < 0) {
+        res = -EINVAL;
+    } else if ((uint64_t) offset > fs->max_size) {
+        res = -EFBIG;
+    } else {
+        size_t end = offset + size;
+        res = end > node->size ? resize(fs, node, end) : 0;
+        if (res == 0) {
+            memcpy(node->data + offset, buf, size);
+            touch(node);
+            res = size;
+        }
+    }
+    pthread_rwlock_unlock(&fs->lock);
+    return res;
+}
+
+int
+elfuse_memfs_truncate(struct elfuse_memfs *fs, const char *path, off_t size)
+{
+    int res;
+    pthread_rwlock_wrlock(&fs->lock);
+    struct elfuse_memfs_node *node = find_node(fs, path);
+    if (node == NULL)
+        res = -ENOENT;
+    else if (node->dir)
+        res = -EISDIR;
+    else if (size < 0)
+        res = -EINVAL;
+    else if ((uint64_t) size > fs->max_size)
+        res = -EFBIG;
+    else
+        res = resize(fs, node, size);
+    pthread_rwlock_unlock(&fs->lock);
+    return res;
+}
+
+int
+elfuse_memfs_unlink(struct elfuse_memfs *fs, const char *path, bool dir)
+{
+    int res = 0;
+    pthread_rwlock_wrlock(&fs->lock);
+    struct elfuse_memfs_node *node = find_node(fs, path);
+    if (node == NULL)
+        res = -ENOENT;
+    else if (node == fs->root)
+        res = -EBUSY;
+    else if (node->dir && !dir)
+        res = -EISDIR;
+    else if (!node->dir && dir)
+        res = -ENOTDIR;
+    else if (node->children != NULL)
+        res = -ENOTEMPTY;
+
+    if (res == 0) {
+        detach(node);
+        free_subtree(fs, node);
+    }
+    pthread_rwlock_unlock(&fs->lock);
+    return res;
+}
+
+/* Move NODE and everything below it from path OLDPATH to NEWPATH in the
+ * table */
+static int
+rekey(struct elfuse_memfs *fs, struct elfuse_memfs_node *node, size_t old_length, const char *newpath)
+{
+    size_t new_length = strlen(newpath);
+    size_t rest_length = strlen(node->path + old_length);
+    char *path = malloc(new_length + rest_length + 1);
+    if (path == NULL)
+        return -ENOMEM;
+    memcpy(path, newpath, new_length);
+    memcpy(path + new_length, node->path + old_length, rest_length + 1);
+
+    table_remove(fs, node);
+    free(node->path);
+    node_set_path(node, path);
+    table_insert(fs, node);
+
+    int res = 0;
+    for (struct elfuse_memfs_node *child = node->children; child != NULL && res == 0; child = child->next)
+        res = rekey(fs, child, old_length, newpath);
+    return res;
+}
+
+int
+elfuse_memfs_rename(struct elfuse_memfs *fs, const char *oldpath, const char *newpath)
+{
+    size_t old_length = strlen(oldpath);
+    int res = 0;
+    pthread_rwlock_wrlock(&fs->lock);
+
+    struct elfuse_memfs_node *node = find_node(fs, oldpath);
+    struct elfuse_memfs_node *parent = NULL;
+    if (node == NULL)
+        res = -ENOENT;
+    else if (node == fs->root)
+        res = -EBUSY;
+    else if (strncmp(newpath, oldpath, old_length) == 0 && newpath[old_length] == '/')
+        res = -EINVAL;
+    else
+        res = find_parent(fs, newpath, &parent);
+
+    struct elfuse_memfs_node *target = res == 0 ? find_node(fs, newpath) : NULL;
+    if (target == node) {
+        target = NULL;
+        parent = NULL;
+    } else if (target != NULL) {
+        if (target->dir && !node->dir)
+            res = -EISDIR;
+        else if (!target->dir && node->dir)
+            res = -ENOTDIR;
+        else if (target->children != NULL || target == fs->root)
+            res = -ENOTEMPTY;
+    }
+
+    if (res == 0 && parent != NULL) {
+        if (target != NULL) {
+            detach(target);
+            free_subtree(fs, target);
+        }
+        detach(node);
+        res = rekey(fs, node, old_length, newpath);
+        attach(parent, node);
+    }
+
+    pthread_rwlock_unlock(&fs->lock);
+    return res;
+}
+
+/* Create the missing directories above PATH, like mkdir -p */
+static int
+add_parents(struct elfuse_memfs *fs, const char *path)
+{
+    int res = 0;
+    size_t length = strlen(path);
+    char partial[length + 1];
+    for (size_t i = 1; i < length && res == 0; i++) {
+        if (path[i] != '/')
+            continue;
+        memcpy(partial, path, i);
+        partial[i] = '\0';
+        struct elfuse_memfs_node *dir = find_node(fs, partial);
+        if (dir == NULL)
+            res = add_node(fs, partial, true, NULL);
+        else if (!dir->dir)
+            res = -ENOTDIR;
+    }
+    return res;
+}
+
+int
+elfuse_memfs_mkdirs(struct elfuse_memfs *fs, const char *path)
+{
+    pthread_rwlock_wrlock(&fs->lock);
+    int res = add_parents(fs, path);
+    if (res == 0) {
+        struct elfuse_memfs_node *node = find_node(fs, path);
+        if (node == NULL)
+            res = add_node(fs, path, true, NULL);
+        else if (!node->dir)
+            res = -ENOTDIR;
+    }
+    pthread_rwlock_unlock(&fs->lock);
+    return res;
+}
+
+int
+elfuse_memfs_put(struct elfuse_memfs *fs, const char *path, const char *data, size_t size)
+{
+    pthread_rwlock_wrlock(&fs->lock);
+    int res = add_parents(fs, path);
+
+    struct elfuse_memfs_node *node = NULL;
+    if (res == 0) {
+        node = find_node(fs, path);
+        if (node == NULL)
+            res = add_node(fs, path, false, &node);
+        else if (node->dir)
+            res = -EISDIR;
+    }
+    if (res == 0) {
+        fs->size -= node->size;
+        node->size = 0;
+        res = resize(fs, node, size);
+        if (res == 0 && size > 0)
+            memcpy(node->data, data, size);
+    }
+
+    pthread_rwlock_unlock(&fs->lock);
+    return res;
+}
+
+int
+elfuse_memfs_get(struct elfuse_memfs *fs, const char *path, char **data, size_t *size)
+{
+    int res = 0;
+    pthread_rwlock_rdlock(&fs->lock);
+    struct elfuse_memfs_node *node = find_node(fs, path);
+    if (node == NULL) {
+        res = -ENOENT;
+    } else if (node->dir) {
+        res = -EISDIR;
+    } else {
+        *data = malloc(node->size > 0 ? node->size : 1);
+        if (*data == NULL) {
+            res = -ENOMEM;
+        } else {
+            if (node->size > 0)
+                memcpy(*data, node->data, node->size);
+            *size = node->size;
+        }
+    }
+    pthread_rwlock_unlock(&fs->lock);
+    return res;
+}
+
+int
+elfuse_memfs_remove(struct elfuse_memfs *fs, const char *path)
+{
+    int res = 0;
+    pthread_rwlock_wrlock(&fs->lock);
+    struct elfuse_memfs_node *node = find_node(fs, path);
+    if (node == NULL) {
+        res = -ENOENT;
+    } else if (node == fs->root) {
+        /* The root stays, empty */
+        while (node->children != NULL) {
+            struct elfuse_memfs_node *child = node->children;
+            detach(child);
+            free_subtree(fs, child);
+        }
+    } else {
+        detach(node);
+        free_subtree(fs, node);
+    }
+    pthread_rwlock_unlock(&fs->lock);
+    return res;
+}
@@ -0,0 +1,84 @@
+/* This file is part of Elfuse. */
+
+/* Elfuse is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or */
+/* (at your option) any later version. */
+
+/* Elfuse is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the */
+/* GNU General Public License for more details. */
+
+/* You should have received a copy of the GNU General Public License */
+/* along with Elfuse.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef ELFUSE_MEMFS_H
+#define ELFUSE_MEMFS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/* A thread-safe file tree in memory, nodes in a path-keyed hash table.
+ * Everything returns -errno on failure. */
+struct elfuse_memfs;
+
+/* An empty tree, just "/", holding at most MAX_SIZE bytes of file
+ * contents. NULL if out of memory. */
+struct elfuse_memfs *
+elfuse_memfs_new(size_t max_size);
+
+void
+elfuse_memfs_free(struct elfuse_memfs *fs);
+
+int
+elfuse_memfs_getattr(struct elfuse_memfs *fs, const char *path, struct stat *stbuf);
+
+/* Call FILLER with DATA for every entry of the directory PATH, stop early
+ * if it returns non-zero. Return 0. */
+int
+elfuse_memfs_list(struct elfuse_memfs *fs, const char *path,
+                  int (*filler)(void *data, const char *name, const struct stat *stbuf), void *data);
+
+/* Create an empty file or directory in an existing directory */
+int
+elfuse_memfs_create(struct elfuse_memfs *fs, const char *path, bool dir);
+
+/* Return the number of bytes read or written */
+int
+elfuse_memfs_read(struct elfuse_memfs *fs, const char *path, char *buf, size_t size, off_t offset);
+
+int
+elfuse_memfs_write(struct elfuse_memfs *fs, const char *path, const char *buf, size_t size, off_t offset);
+
+int
+elfuse_memfs_truncate(struct elfuse_memfs *fs, const char *path, off_t size);
+
+/* Remove a file, or an empty directory if DIR is set */
+int
+elfuse_memfs_unlink(struct elfuse_memfs *fs, const char *path, bool dir);
+
+/* Move a file or directory, replacing a file or empty directory at NEWPATH */
+int
+elfuse_memfs_rename(struct elfuse_memfs *fs, const char *oldpath, const char *newpath);
+
+/* Set the contents of the file PATH, creating it and its parent
+ * directories if needed */
+int
+elfuse_memfs_put(struct elfuse_memfs *fs, const char *path, const char *data, size_t size);
+
+/* Create the directory PATH and its parents, unless they exist */
+int
+elfuse_memfs_mkdirs(struct elfuse_memfs *fs, const char *path);
+
+/* Copy the contents of the file PATH to a malloc'ed *DATA */
+int
+elfuse_memfs_get(struct elfuse_memfs *fs, const char *path, char **data, size_t *size);
+
+/* Remove PATH and, if it's a directory, everything below it */
+int
+elfuse_memfs_remove(struct elfuse_memfs *fs, const char *path);
+
+#endif //ELFUSE_MEMFS_H
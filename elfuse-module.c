@@ -13,26 +13,182 @@
 /* You should have received a copy of the GNU General Public License */
 /* along with Elfuse.  If not, see <http://www.gnu.org/licenses/>. */
 
+#define _XOPEN_SOURCE 700
+
 #include <stdbool.h>
 #include <stdarg.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
 #include <signal.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "emacs-module.h"
 #include "elfuse-fuse.h"
+#include "elfuse-log.h"
+#include "elfuse-loopback.h"
+#include "elfuse-memfs.h"
+#include "elfuse-probes.h"
+#include "elfuse-stats.h"
 
 int plugin_is_GPL_compatible;
 
-static bool elfuse_is_started = false;
-static pthread_t fuse_thread;
-
+/* Global references, interned once */
 static emacs_value nil;
 static emacs_value t;
 static emacs_value elfuse_op_error;
+static emacs_value Qfile;
+static emacs_value Qdir;
+static emacs_value Qinteger;
+static emacs_value Qstring;
+static emacs_value Qvconcat;
+static emacs_value Qinput_pending_p;
+static emacs_value Qcar;
+static emacs_value Qcdr;
+static emacs_value Qcons;
+static emacs_value Qlist;
+static emacs_value Qvector;
+
+/* Handlers of a subtree of a mount, global references */
+struct route {
+    char *prefix;
+    emacs_value handlers[OP_COUNT];
+};
+
+/* A mount as Lisp sees it, a user pointer */
+struct mount {
+    struct elfuse_mount *fuse;
+
+    /* Indexed by route id, the first one is "/" (elfuse--register-op) */
+    struct route *routes;
+    size_t routes_size;
+
+    /* Next running mount */
+    struct mount *next;
+    bool running;
+
+    /* Global reference to the mount's own user pointer, keeping it from the
+     * GC while running or while one of its handlers runs, since handlers
+     * may stop the mount */
+    emacs_value self;
+    int handlers_running;
+
+    /* Driver threads of a loopback mount, elfuse--loopback-start */
+    struct elfuse_loopback_run *loopback_run;
+};
+
+/* Running mounts, serviced by elfuse--check-ops */
+static struct mount *mounts = NULL;
+
+/* A request whose handler returned without a reply (elfuse--defer), its
+ * FUSE thread waits until elfuse--reply or the mount stops */
+struct deferred {
+    intmax_t token;
+    struct mount *mount;
+    struct elfuse_call_state *call;
+
+    /* The handler of the request while it is still running */
+    struct handling *handling;
+
+    struct deferred *next;
+};
+
+/* The request a handler is running for, innermost first */
+struct handling {
+    struct mount *mount;
+    struct elfuse_call_state *call;
+    struct deferred *deferred;
+
+    /* Set once elfuse--reply answered it or elfuse--stop failed it, the
+     * call is gone then */
+    bool replied;
+
+    struct handling *outer;
+};
+
+static struct deferred *deferred_calls = NULL;
+static intmax_t deferred_last_token = 0;
+static struct handling *handling = NULL;
+
+static void
+complete_call(struct mount *mount, struct elfuse_call_state *call, enum elfuse_response_state response_state)
+{
+    ELFUSE_PROBE3(handler_end, call->request_state, elfuse_call_path(call), response_state);
+    elfuse_call_complete(mount->fuse, call, response_state);
+}
+
+static struct deferred *
+deferred_take(intmax_t token)
+{
+    for (struct deferred **link = &deferred_calls; *link != NULL; link = &(*link)->next) {
+        struct deferred *entry = *link;
+        if (entry->token == token) {
+            *link = entry->next;
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/* Answer a deferred request, the handler still running for it must not
+ * touch the call anymore */
+static void
+deferred_complete(struct deferred *entry, enum elfuse_response_state response_state)
+{
+    if (entry->handling != NULL) {
+        entry->handling->replied = true;
+        entry->handling->deferred = NULL;
+    }
+    complete_call(entry->mount, entry->call, response_state);
+    free(entry);
+}
+
+/* Fail the deferred requests of a stopping MOUNT */
+static void
+deferred_fail(struct mount *mount)
+{
+    struct deferred **link = &deferred_calls;
+    while (*link != NULL) {
+        struct deferred *entry = *link;
+        if (entry->mount == mount) {
+            *link = entry->next;
+            deferred_complete(entry, RESPONSE_UNKNOWN_ERROR);
+        } else {
+            link = &entry->next;
+        }
+    }
+}
+
+/* Fail the requests of a stopping MOUNT whose handlers are still running,
+ * e.g. the one calling elfuse--stop. Their FUSE threads can't be cancelled
+ * while waiting for a reply, the mount would never stop. */
+static void
+handling_fail(struct mount *mount)
+{
+    for (struct handling *current = handling; current != NULL; current = current->outer) {
+        if (current->mount == mount && !current->replied) {
+            current->replied = true;
+            complete_call(mount, current->call, RESPONSE_UNKNOWN_ERROR);
+        }
+    }
+}
+
+static const char *elfuse_op_names[OP_COUNT] = {
+    [OP_CREATE] = "create",
+    [OP_RENAME] = "rename",
+    [OP_READDIR] = "readdir",
+    [OP_READDIR_PAGE] = "readdir-page",
+    [OP_GETATTR] = "getattr",
+    [OP_OPEN] = "open",
+    [OP_RELEASE] = "release",
+    [OP_READ] = "read",
+    [OP_WRITE] = "write",
+    [OP_TRUNCATE] = "truncate",
+    [OP_UNLINK] = "unlink",
+};
 
 static void
 message (emacs_env *env, const char *format, ...)
@@ -71,11 +227,53 @@ provide (emacs_env *env, const char *feature)
     env->funcall (env, Qprovide, 1, args);
 }
 
+static double
+extract_number(emacs_env *env, emacs_value Nnumber)
+{
+    if (env->eq(env, env->type_of(env, Nnumber), Qinteger))
+        return env->extract_integer(env, Nnumber);
+    return env->extract_float(env, Nnumber);
+}
+
+static char *
+copy_string(emacs_env *env, emacs_value Sstring)
+{
+    ptrdiff_t buffer_length;
+    env->copy_string_contents(env, Sstring, NULL, &buffer_length);
+    char *string = malloc(buffer_length);
+    if (string != NULL)
+        env->copy_string_contents(env, Sstring, string, &buffer_length);
+    return string;
+}
+
+/* Parse a [type size ttl] attribute vector starting at index START, only
+ * the type is mandatory. Return true if the file type is known. */
 static bool
-fboundp (emacs_env *env, emacs_value Sfun) {
-    emacs_value Qfboundp = env->intern (env, "fboundp");
-    emacs_value args[] = { Sfun };
-    return env->is_not_nil(env, env->funcall (env, Qfboundp, 1, args));
+extract_attr(emacs_env *env, emacs_value Vattr, ptrdiff_t start, struct elfuse_results_getattr *attr)
+{
+    ptrdiff_t size = env->vec_size(env, Vattr);
+    emacs_value Qfiletype = env->vec_get(env, Vattr, start);
+
+    attr->file_size = 0;
+    if (size > start + 1)
+        attr->file_size = env->extract_integer(env, env->vec_get(env, Vattr, start + 1));
+
+    attr->ttl = -1;
+    if (size > start + 2) {
+        emacs_value Nttl = env->vec_get(env, Vattr, start + 2);
+        if (env->is_not_nil(env, Nttl))
+            attr->ttl = extract_number(env, Nttl);
+    }
+
+    if (env->eq(env, Qfiletype, Qfile)) {
+        attr->code = GETATTR_FILE;
+    } else if (env->eq(env, Qfiletype, Qdir)) {
+        attr->code = GETATTR_DIR;
+    } else {
+        attr->code = GETATTR_UNKNOWN;
+    }
+
+    return attr->code != GETATTR_UNKNOWN;
 }
 
 static void
@@ -92,295 +290,1388 @@ extract_symbol_name(emacs_env *env, emacs_value Qsymbol, char* buffer, ptrdiff_t
     }
 }
 
-static emacs_value
-Felfuse_mount (emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+/* Pass a (:entry-timeout 1.0 :kernel-cache t ...) plist on to the next
+ * mount. Return false and tell the user if an option is not valid. */
+static bool
+extract_mount_options(emacs_env *env, emacs_value Loptions)
 {
-    (void)nargs; (void)data;
+    elfuse_mount_options_clear();
 
-    if (!elfuse_is_started) {
-        emacs_value Qpath = args[0];
-
-        ptrdiff_t buffer_length;
-        env->copy_string_contents(env, Qpath, NULL, &buffer_length);
-        char *path = malloc(buffer_length);
-        env->copy_string_contents(env, Qpath, path, &buffer_length);
+    emacs_value Voptions = env->funcall(env, Qvconcat, 1, &Loptions);
+    if (env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+        env->non_local_exit_clear(env);
+        message(env, "Elfuse: mount options must be a plist");
+        return false;
+    }
 
-        pthread_mutex_lock(&elfuse_mutex);
+    ptrdiff_t size = env->vec_size(env, Voptions);
+    if (size % 2 != 0) {
+        message(env, "Elfuse: mount options must be a plist");
+        return false;
+    }
 
-        if (pthread_create(&fuse_thread, NULL, elfuse_fuse_loop, path) != 0) {
-            char *msg = "Elfuse: failed to launch a FUSE thread";
-            message(env, msg);
-            fprintf(stderr, "%s\n", msg);
+    for (ptrdiff_t i = 0; i < size; i += 2) {
+        emacs_value Qkey = env->vec_get(env, Voptions, i);
+        emacs_value Value = env->vec_get(env, Voptions, i + 1);
 
-            pthread_mutex_unlock(&elfuse_mutex);
-            return nil;
+        ptrdiff_t name_size;
+        extract_symbol_name(env, Qkey, NULL, &name_size);
+        if (env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+            env->non_local_exit_clear(env);
+            message(env, "Elfuse: mount option names must be keywords");
+            return false;
+        }
+        char key[name_size];
+        extract_symbol_name(env, Qkey, key, &name_size);
+
+        /* :entry-timeout is FUSE's entry_timeout */
+        char *name = key[0] == ':' ? key + 1 : key;
+        for (char *c = name; *c; c++) {
+            if (*c == '-')
+                *c = '_';
         }
 
-        pthread_cond_wait(&elfuse_cond_var, &elfuse_mutex);
-
-        emacs_value res = nil;
-        char *msg;
-        switch (elfuse_init_code) {
-        case INIT_DONE:
-            elfuse_is_started = true;
-            res = t;
-            break;
-        case INIT_ERR_ARGS:
-            msg = "Elfuse: failed to launch a FUSE thread\n";
-            message(env, msg);
-            fprintf(stderr, "%s", msg);
-            res = nil;
-            break;
-        case INIT_ERR_MOUNT:
-            msg = "Elfuse: failed to mount on %s\n";
-            message(env, msg, path);
-            fprintf(stderr, "Elfuse: failed to mount on %s\n", path);
-            res = nil;
-            break;
-        case INIT_ERR_ALLOC:
-            msg = "Elfuse: failed to launch a FUSE thread";
-            message(env, msg);
-            fprintf(stderr, "%s", msg);
-            res = nil;
-            break;
-        case INIT_ERR_CREATE:
-            msg = "Elfuse: failed to create FUSE instance %d\n";
-            message(env, msg, elfuse_init_code);
-            fprintf(stderr, msg, elfuse_init_code);
-            res = nil;
+        double number;
+        switch (elfuse_mount_option_type(name)) {
+        case MOUNT_OPTION_UNKNOWN:
+            message(env, "Elfuse: unknown mount option %s", key);
+            return false;
+        case MOUNT_OPTION_FLAG:
+            number = env->is_not_nil(env, Value) ? 1 : 0;
             break;
         default:
-            msg = "Elfuse: failed to launch a FUSE thread";
-            message(env, msg);
-            fprintf(stderr, "%s", msg);
-            res = nil;
+            number = extract_number(env, Value);
+            if (env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+                env->non_local_exit_clear(env);
+                message(env, "Elfuse: mount option %s takes a number", key);
+                return false;
+            }
             break;
         }
 
-        pthread_mutex_unlock(&elfuse_mutex);
-        return res;
+        if (!elfuse_mount_option_add(name, number)) {
+            message(env, "Elfuse: invalid value for mount option %s", key);
+            return false;
+        }
     }
-    return nil;
+
+    return true;
 }
 
-static emacs_value
-Felfuse_stop (emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+static void
+mount_finalize(void *data)
+{
+    struct mount *mount = data;
+
+    /* Lisp keeps running mounts around, elfuse--stop gets rid of them */
+    if (mount->running)
+        return;
+    elfuse_mount_free(mount->fuse);
+    for (size_t i = 0; i < mount->routes_size; i++)
+        free(mount->routes[i].prefix);
+    free(mount->routes);
+    free(mount);
+}
+
+/* The mount behind a user pointer, NULL (and a message) for anything else */
+static struct mount *
+extract_mount(emacs_env *env, emacs_value Umount)
 {
-    (void)env; (void)nargs; (void)args; (void)data;
+    void (*finalizer)(void *) = env->get_user_finalizer(env, Umount);
+    if (env->non_local_exit_check(env) != emacs_funcall_exit_return || finalizer != mount_finalize) {
+        env->non_local_exit_clear(env);
+        message(env, "Elfuse: not a mount");
+        return NULL;
+    }
+    return env->get_user_ptr(env, Umount);
+}
 
-    if (!elfuse_is_started) {
-        return nil;
+/* Copy a route prefix like "/org/", "/org" or "org//" as "/org", NULL if
+ * out of memory */
+static char *
+extract_prefix(emacs_env *env, emacs_value Sprefix)
+{
+    char *string = copy_string(env, Sprefix);
+    if (string == NULL)
+        return NULL;
+
+    char *prefix = malloc(strlen(string) + 2);
+    if (prefix != NULL) {
+        char *end = prefix;
+        for (char *component = strtok(string, "/"); component; component = strtok(NULL, "/"))
+            end += sprintf(end, "/%s", component);
+        if (end == prefix)
+            strcpy(prefix, "/");
     }
+    free(string);
+    return prefix;
+}
 
-    elfuse_is_started = false;
+/* Id of the route of PREFIX, -1 if there's none. Ids are never reused, a
+ * request still queued for a dropped route finds no handlers. */
+static int
+mount_find_route(struct mount *mount, const char *prefix)
+{
+    for (size_t i = 0; i < mount->routes_size; i++) {
+        if (mount->routes[i].prefix != NULL && strcmp(mount->routes[i].prefix, prefix) == 0)
+            return i;
+    }
+    return -1;
+}
 
-    if (pthread_cancel(fuse_thread) != 0) {
-        char* msg = "Elfuse: failed to cancel the FUSE thread\n";
-        fprintf(stderr, "%s", msg);
-        message(env, msg);
-        return nil;
+/* Add a route without handlers, it takes over PREFIX. Return -1 if out of
+ * memory. */
+static int
+mount_add_route(struct mount *mount, char *prefix)
+{
+    struct route *routes = realloc(mount->routes, (mount->routes_size + 1) * sizeof(routes[0]));
+    if (routes == NULL)
+        return -1;
+    mount->routes = routes;
+
+    struct route *route = &mount->routes[mount->routes_size];
+    memset(route, 0, sizeof(*route));
+    route->prefix = prefix;
+    return mount->routes_size++;
+}
+
+/* Let FUSE threads know which ops a route handles */
+static bool
+mount_publish_route(struct mount *mount, int route)
+{
+    uint32_t ops = 0;
+    for (int op = 0; op < OP_COUNT; op++) {
+        if (mount->routes[route].handlers[op] != NULL)
+            ops |= ELFUSE_OP_BIT(op);
+    }
+    return elfuse_set_route(mount->fuse, mount->routes[route].prefix, route, ops);
+}
+
+static void
+mount_set_handler(emacs_env *env, struct mount *mount, int route, enum elfuse_op op, emacs_value Ffunction)
+{
+    emacs_value *handlers = mount->routes[route].handlers;
+    if (handlers[op] != NULL) {
+        env->free_global_ref(env, handlers[op]);
+        handlers[op] = NULL;
     }
+    if (env->is_not_nil(env, Ffunction))
+        handlers[op] = env->make_global_ref(env, Ffunction);
+}
 
-    pthread_cond_signal(&elfuse_cond_var);
+static void
+mount_clear_handlers(emacs_env *env, struct mount *mount, int route)
+{
+    for (int op = 0; op < OP_COUNT; op++)
+        mount_set_handler(env, mount, route, op, nil);
+}
 
-    if (pthread_join(fuse_thread, NULL) != 0) {
-        char* msg = "Elfuse: failed to join the FUSE thread\n";
-        fprintf(stderr, "%s", msg);
-        message(env, msg);
-        return nil;
+/* Register the handler of an OP symbol, return false (and tell the user) if
+ * there's no such op */
+static bool
+mount_register(emacs_env *env, struct mount *mount, int route, emacs_value Qop, emacs_value Ffunction)
+{
+    ptrdiff_t size;
+    extract_symbol_name(env, Qop, NULL, &size);
+    if (env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+        env->non_local_exit_clear(env);
+        message(env, "Elfuse: ops are symbols");
+        return false;
     }
+    char name[size];
+    extract_symbol_name(env, Qop, name, &size);
 
-    return t;
+    for (int op = 0; op < OP_COUNT; op++) {
+        if (strcmp(elfuse_op_names[op], name) == 0) {
+            mount_set_handler(env, mount, route, op, Ffunction);
+            return true;
+        }
+    }
+
+    message(env, "Elfuse: unknown op %s", name);
+    return false;
+}
+
+static bool
+mount_route(emacs_env *env, struct mount *mount, emacs_value Sprefix, emacs_value Lhandlers);
+
+/* Register an ((OP . FUNCTION) ...) alist of handlers. The handlers of the
+ * whole mount may include ("/prefix" (OP . FUNCTION) ...) routes. */
+static bool
+mount_register_all(emacs_env *env, struct mount *mount, int route, emacs_value Lhandlers)
+{
+    emacs_value Vhandlers = env->funcall(env, Qvconcat, 1, &Lhandlers);
+    if (env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+        env->non_local_exit_clear(env);
+        message(env, "Elfuse: handlers must be an alist of ops and functions");
+        return false;
+    }
+
+    ptrdiff_t size = env->vec_size(env, Vhandlers);
+    for (ptrdiff_t i = 0; i < size; i++) {
+        emacs_value Chandler = env->vec_get(env, Vhandlers, i);
+        emacs_value Qop = env->funcall(env, Qcar, 1, &Chandler);
+        emacs_value Ffunction = env->funcall(env, Qcdr, 1, &Chandler);
+        if (env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+            env->non_local_exit_clear(env);
+            message(env, "Elfuse: handlers must be an alist of ops and functions");
+            return false;
+        }
+
+        bool registered;
+        if (route == 0 && env->eq(env, env->type_of(env, Qop), Qstring))
+            registered = mount_route(env, mount, Qop, Ffunction);
+        else
+            registered = mount_register(env, mount, route, Qop, Ffunction);
+        if (!registered)
+            return false;
+    }
+
+    return true;
 }
 
-static int handle_create(emacs_env *env, const char *path);
-static int handle_rename(emacs_env *env, const char *oldpath, const char *newpath);
-static int handle_readdir(emacs_env *env, const char *path);
-static int handle_getattr(emacs_env *env, const char *path);
-static int handle_open(emacs_env *env, const char *path);
-static int handle_release(emacs_env *env, const char *path);
-static int handle_read(emacs_env *env, const char *path, size_t offset, size_t size);
-static int handle_write(emacs_env *env, const char *path, const char *buf, size_t size, size_t offset);
-static int handle_truncate(emacs_env *env, const char *path, size_t size);
-static int handle_unlink(emacs_env *env, const char *path);
+/* Replace the handlers of the PREFIX subtree */
+static bool
+mount_route(emacs_env *env, struct mount *mount, emacs_value Sprefix, emacs_value Lhandlers)
+{
+    char *prefix = extract_prefix(env, Sprefix);
+    if (prefix == NULL)
+        return false;
+
+    int route = mount_find_route(mount, prefix);
+    if (route >= 0) {
+        free(prefix);
+        mount_clear_handlers(env, mount, route);
+    } else {
+        route = mount_add_route(mount, prefix);
+        if (route < 0) {
+            free(prefix);
+            return false;
+        }
+    }
 
-static int non_local_op_exit(emacs_env *env, enum emacs_funcall_exit exit_status, emacs_value exit_symbol, emacs_value exit_data);
+    bool registered = mount_register_all(env, mount, route, Lhandlers);
+    if (!registered)
+        mount_clear_handlers(env, mount, route);
+    return mount_publish_route(mount, route) && registered;
+}
 
 static emacs_value
-Felfuse_check_ops(emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+Felfuse_mount (emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
 {
-    (void)env; (void)nargs; (void)args; (void)data;
+    (void)data;
 
-    if (!elfuse_is_started) {
-        message(env, "Elfuse loop is not running, abort.");
+    emacs_value Qpath = args[0];
+
+    if (!extract_mount_options(env, nargs > 2 ? args[2] : nil)) {
         return nil;
     }
 
-    if (pthread_mutex_trylock(&elfuse_mutex) != 0)
-        return t;
+    intmax_t thread_count = 1;
+    if (nargs > 1 && env->is_not_nil(env, args[1])) {
+        thread_count = env->extract_integer(env, args[1]);
+        if (env->non_local_exit_check(env) != emacs_funcall_exit_return)
+            return nil;
+    }
+    if (thread_count < 1)
+        thread_count = 1;
+    if (thread_count > ELFUSE_MAX_THREADS)
+        thread_count = ELFUSE_MAX_THREADS;
+    elfuse_thread_count = thread_count;
+
+    char *path = copy_string(env, Qpath);
+    if (path == NULL) {
+        return nil;
+    }
 
-    switch (elfuse_call.request_state) {
-    case WAITING_CREATE:
-        elfuse_call.response_state = handle_create(env, elfuse_call.args.create.path);
-        break;
-    case WAITING_RENAME:
-        elfuse_call.response_state = handle_rename(env, elfuse_call.args.rename.oldpath, elfuse_call.args.rename.newpath);
-        break;
-    case WAITING_READDIR:
-        elfuse_call.response_state = handle_readdir(env, elfuse_call.args.readdir.path);
-        break;
-    case WAITING_GETATTR:
-        elfuse_call.response_state = handle_getattr(env, elfuse_call.args.getattr.path);
-        break;
-    case WAITING_OPEN:
-        elfuse_call.response_state = handle_open(env, elfuse_call.args.open.path);
-        break;
-    case WAITING_RELEASE:
-        elfuse_call.response_state = handle_release(env, elfuse_call.args.open.path);
-        break;
-    case WAITING_READ:
-        elfuse_call.response_state = handle_read(
-            env, elfuse_call.args.read.path, elfuse_call.args.read.offset, elfuse_call.args.read.size
-        );
-        break;
-    case WAITING_WRITE:
-        elfuse_call.response_state = handle_write(
-            env, elfuse_call.args.write.path, elfuse_call.args.write.buf, elfuse_call.args.write.size, elfuse_call.args.write.offset
-        );
+    struct mount *mount = calloc(1, sizeof(*mount));
+    char *root = strdup("/");
+    if (mount != NULL)
+        mount->fuse = elfuse_mount_new(path);
+    if (mount == NULL || mount->fuse == NULL || root == NULL || mount_add_route(mount, root) != 0) {
+        message(env, "Elfuse: failed to allocate a mount");
+        if (mount != NULL)
+            elfuse_mount_free(mount->fuse);
+        free(mount);
+        free(root);
+        free(path);
+        return nil;
+    }
+    emacs_value Umount = env->make_user_ptr(env, mount_finalize, mount);
+
+    /* Handlers go first, the kernel may send requests as soon as it's mounted */
+    if ((nargs > 3 && !mount_register_all(env, mount, 0, args[3])) || !mount_publish_route(mount, 0)) {
+        for (size_t route = 0; route < mount->routes_size; route++)
+            mount_clear_handlers(env, mount, route);
+        free(path);
+        return nil;
+    }
+
+    /* The writer thread runs as long as something is mounted */
+    elfuse_log_start();
+    enum elfuse_init_code_enum code = elfuse_mount_start(mount->fuse);
+
+    emacs_value res = nil;
+    switch (code) {
+    case INIT_DONE:
+        mount->running = true;
+        mount->self = env->make_global_ref(env, Umount);
+        mount->next = mounts;
+        mounts = mount;
+        res = Umount;
         break;
-    case WAITING_TRUNCATE:
-        elfuse_call.response_state = handle_truncate(env, elfuse_call.args.truncate.path, elfuse_call.args.truncate.size);
+    case INIT_ERR_MOUNT:
+        message(env, "Elfuse: failed to mount on %s", path);
+        elfuse_log_error("failed to mount on %s", path);
         break;
-    case WAITING_UNLINK:
-        elfuse_call.response_state = handle_unlink(env, elfuse_call.args.unlink.path);
+    case INIT_ERR_CREATE:
+        message(env, "Elfuse: failed to create FUSE instance %d", code);
+        elfuse_log_error("failed to create FUSE instance %d", code);
         break;
-    case WAITING_NONE:
+    default:
+        message(env, "Elfuse: failed to launch a FUSE thread");
+        elfuse_log_error("failed to launch a FUSE thread");
         break;
     }
 
-    pthread_mutex_unlock(&elfuse_mutex);
-    pthread_cond_signal(&elfuse_cond_var);
+    if (!mount->running) {
+        for (size_t route = 0; route < mount->routes_size; route++)
+            mount_clear_handlers(env, mount, route);
+        if (mounts == NULL)
+            elfuse_log_stop();
+    }
+    free(path);
+    return res;
+}
 
-    return t;
+/* Let the GC have a stopped mount */
+static void
+mount_release(emacs_env *env, struct mount *mount)
+{
+    if (mount->self != NULL) {
+        env->free_global_ref(env, mount->self);
+        mount->self = NULL;
+    }
 }
 
-static int
-handle_create(emacs_env *env, const char *path)
+static emacs_value
+Felfuse_stop (emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
 {
-    fprintf(stderr, "CREATE handle (path=%s).\n", path);
+    (void)nargs; (void)data;
 
-    emacs_value Qcreate = env->intern(env, "elfuse--create-op");
-    if (!fboundp(env, Qcreate)) {
-        return RESPONSE_UNDEFINED;
+    struct mount *mount = extract_mount(env, args[0]);
+    if (mount == NULL || !mount->running) {
+        return nil;
     }
 
-    /* Build args and execute the function call itself */
-    emacs_value args[] = {
-        env->make_string(env, path, strlen(path)),
-    };
-    emacs_value Ires_code = env->funcall(env, Qcreate, sizeof(args)/sizeof(args[0]), args);
+    for (struct mount **link = &mounts; *link != NULL; link = &(*link)->next) {
+        if (*link == mount) {
+            *link = mount->next;
+            break;
+        }
+    }
+    mount->running = false;
+    mount->next = NULL;
+
+    /* Release FUSE threads still waiting for a reply and unmount */
+    deferred_fail(mount);
+    handling_fail(mount);
+    if (!elfuse_mount_stop(mount->fuse)) {
+        message(env, "Elfuse: failed to stop the FUSE thread");
+        elfuse_log_error("failed to stop the FUSE thread");
+        return nil;
+    }
 
-    /* Handle possible non-local exits (signals or throws) */
-    emacs_value exit_symbol, exit_data;
-    enum emacs_funcall_exit exit_status = env->non_local_exit_get(
-        env, &exit_symbol, &exit_data
-    );
-    if (exit_status != emacs_funcall_exit_return) {
-        env->non_local_exit_clear(env);
-        return non_local_op_exit(env, exit_status, exit_symbol, exit_data);
+    /* Requests of loopback threads fail from now on, they finish quickly */
+    elfuse_loopback_run_free(mount->loopback_run);
+    mount->loopback_run = NULL;
+
+    for (size_t route = 0; route < mount->routes_size; route++)
+        mount_clear_handlers(env, mount, route);
+
+    if (mounts == NULL) {
+        elfuse_set_wakeup_fd(-1);
+        elfuse_log_stop();
     }
 
-    /* Handle proper response */
-    int res_code = env->extract_integer(env, Ires_code);
-    elfuse_call.results.create.code = res_code >= 0 ? CREATE_DONE : CREATE_FAIL;
+    /* A running handler of the mount keeps it until it returns */
+    if (mount->handlers_running == 0)
+        mount_release(env, mount);
 
-    return RESPONSE_SUCCESS;
+    return t;
 }
 
-static int
-handle_rename(emacs_env *env, const char *oldpath, const char *newpath)
+static emacs_value
+Felfuse_register_op (emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
 {
-    fprintf(stderr, "RENAME handle (oldpath=%s, newpath=%s).\n", oldpath, newpath);
+    (void)nargs; (void)data;
 
-    emacs_value Qrename = env->intern(env, "elfuse--rename-op");
-    if (!fboundp(env, Qrename)) {
-        return RESPONSE_UNDEFINED;
+    struct mount *mount = extract_mount(env, args[0]);
+    if (mount == NULL || !mount->running) {
+        return nil;
     }
 
-    /* Build args and execute the function call itself */
-    emacs_value args[] = {
-        env->make_string(env, oldpath, strlen(oldpath)),
-        env->make_string(env, newpath, strlen(newpath)),
-    };
-    emacs_value Ires_code = env->funcall(env, Qrename, sizeof(args)/sizeof(args[0]), args);
+    if (!mount_register(env, mount, 0, args[1], args[2]))
+        return nil;
+    return mount_publish_route(mount, 0) ? t : nil;
+}
 
-    /* Handle possible non-local exits (signals or throws) */
-    emacs_value exit_symbol, exit_data;
-    enum emacs_funcall_exit exit_status = env->non_local_exit_get(
-        env, &exit_symbol, &exit_data
-    );
-    if (exit_status != emacs_funcall_exit_return) {
-        env->non_local_exit_clear(env);
-        return non_local_op_exit(env, exit_status, exit_symbol, exit_data);
+static emacs_value
+Felfuse_route (emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+{
+    (void)nargs; (void)data;
+
+    struct mount *mount = extract_mount(env, args[0]);
+    if (mount == NULL || !mount->running) {
+        return nil;
     }
 
-    /* Handle proper response */
-    int res_code = env->extract_integer(env, Ires_code);
-    elfuse_call.results.rename.code = res_code >= 0 ? RENAME_DONE : RENAME_UNKNOWN;
+    return mount_route(env, mount, args[1], args[2]) ? t : nil;
+}
 
-    return RESPONSE_SUCCESS;
+static emacs_value
+Felfuse_unroute (emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+{
+    (void)nargs; (void)data;
+
+    struct mount *mount = extract_mount(env, args[0]);
+    if (mount == NULL || !mount->running) {
+        return nil;
+    }
+
+    char *prefix = extract_prefix(env, args[1]);
+    if (prefix == NULL) {
+        return nil;
+    }
+    int route = mount_find_route(mount, prefix);
+    free(prefix);
+    if (route < 0) {
+        return nil;
+    }
+
+    mount_clear_handlers(env, mount, route);
+    if (route == 0) {
+        /* The whole mount keeps its (empty) route */
+        mount_publish_route(mount, route);
+    } else {
+        elfuse_unset_route(mount->fuse, mount->routes[route].prefix);
+        free(mount->routes[route].prefix);
+        mount->routes[route].prefix = NULL;
+    }
+    return t;
 }
 
-static int
-handle_readdir(emacs_env *env, const char *path)
+/* Read a non-negative number of seconds for the option NAME, false (and
+ * a message) for anything else */
+static bool
+extract_option_seconds(emacs_env *env, const char *name, emacs_value Nvalue, double *seconds)
 {
-    fprintf(stderr, "READDIR handle (path=%s).\n", path);
+    double value = extract_number(env, Nvalue);
+    if (env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+        env->non_local_exit_clear(env);
+        message(env, "Elfuse: option %s takes a number", name);
+        return false;
+    }
+    if (!(value >= 0)) {
+        message(env, "Elfuse: option %s can't be negative", name);
+        return false;
+    }
+    *seconds = value;
+    return true;
+}
 
-    emacs_value Qreaddir = env->intern(env, "elfuse--readdir-op");
-    if (!fboundp(env, Qreaddir)) {
-        return RESPONSE_UNDEFINED;
+/* Read an integer from 0 to MAX for the option NAME, false (and a message)
+ * for anything else */
+static bool
+extract_option_count(emacs_env *env, const char *name, emacs_value Nvalue, intmax_t max, intmax_t *count)
+{
+    intmax_t value = env->extract_integer(env, Nvalue);
+    if (env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+        env->non_local_exit_clear(env);
+        message(env, "Elfuse: option %s takes an integer", name);
+        return false;
+    }
+    if (value < 0 || value > max) {
+        message(env, "Elfuse: option %s must be between 0 and %jd", name, max);
+        return false;
     }
+    *count = value;
+    return true;
+}
 
-    /* Build args and execute the function call itself */
-    emacs_value args[] = {
-        env->make_string(env, path, strlen(path))
-    };
-    emacs_value file_vector = env->funcall(env, Qreaddir, sizeof(args)/sizeof(args[0]), args);
+static emacs_value
+Felfuse_set_option (emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+{
+    (void)nargs; (void)data;
 
-    /* Handle possible non-local exits (signals or throws) */
-    emacs_value exit_symbol, exit_data;
-    enum emacs_funcall_exit exit_status = env->non_local_exit_get(
-        env, &exit_symbol, &exit_data
-    );
-    if (exit_status != emacs_funcall_exit_return) {
+    emacs_value Qoption = args[0];
+    emacs_value Nvalue = args[1];
+
+    ptrdiff_t size;
+    extract_symbol_name(env, Qoption, NULL, &size);
+    if (env->non_local_exit_check(env) != emacs_funcall_exit_return) {
         env->non_local_exit_clear(env);
-        return non_local_op_exit(env, exit_status, exit_symbol, exit_data);
+        message(env, "Elfuse: option names must be symbols");
+        return nil;
+    }
+    char name[size];
+    extract_symbol_name(env, Qoption, name, &size);
+
+    /* Values are checked before anything is set, a bad one changes nothing */
+    double seconds;
+    intmax_t count;
+    if (env->eq(env, Qoption, env->intern(env, "attr-cache-ttl"))) {
+        if (!extract_option_seconds(env, name, Nvalue, &seconds))
+            return nil;
+        elfuse_attr_cache_ttl = seconds;
+    } else if (env->eq(env, Qoption, env->intern(env, "attr-cache-size"))) {
+        if (!extract_option_count(env, name, Nvalue, SIZE_MAX / 2, &count))
+            return nil;
+        elfuse_attr_cache_size = count;
+    } else if (env->eq(env, Qoption, env->intern(env, "negative-cache-ttl"))) {
+        if (!extract_option_seconds(env, name, Nvalue, &seconds))
+            return nil;
+        elfuse_negative_cache_ttl = seconds;
+    } else if (env->eq(env, Qoption, env->intern(env, "negative-cache-size"))) {
+        if (!extract_option_count(env, name, Nvalue, SIZE_MAX / 2, &count))
+            return nil;
+        elfuse_negative_cache_size = count;
+    } else if (env->eq(env, Qoption, env->intern(env, "read-cache-ttl"))) {
+        if (!extract_option_seconds(env, name, Nvalue, &seconds))
+            return nil;
+        elfuse_read_cache_ttl = seconds;
+    } else if (env->eq(env, Qoption, env->intern(env, "read-cache-size"))) {
+        if (!extract_option_count(env, name, Nvalue, SIZE_MAX / 2, &count))
+            return nil;
+        elfuse_read_cache_size = count;
+    } else if (env->eq(env, Qoption, env->intern(env, "readahead-max"))) {
+        if (!extract_option_count(env, name, Nvalue, INT_MAX, &count))
+            return nil;
+        elfuse_readahead_max = count;
+    } else if (env->eq(env, Qoption, env->intern(env, "write-back"))) {
+        elfuse_write_back = env->is_not_nil(env, Nvalue);
+    } else if (env->eq(env, Qoption, env->intern(env, "write-back-size"))) {
+        if (!extract_option_count(env, name, Nvalue, SIZE_MAX / 2, &count))
+            return nil;
+        elfuse_write_back_size = count;
+    } else if (env->eq(env, Qoption, env->intern(env, "write-back-age"))) {
+        if (!extract_option_seconds(env, name, Nvalue, &seconds))
+            return nil;
+        elfuse_write_back_age = seconds;
+    } else if (env->eq(env, Qoption, env->intern(env, "memory-max-size"))) {
+        if (!extract_option_count(env, name, Nvalue, SIZE_MAX / 2, &count))
+            return nil;
+        elfuse_memory_max_size = count;
+    } else if (env->eq(env, Qoption, env->intern(env, "max-deferred"))) {
+        if (!extract_option_count(env, name, Nvalue, INT_MAX / 2, &count))
+            return nil;
+        elfuse_max_deferred = count;
+    } else if (env->eq(env, Qoption, env->intern(env, "log-level"))) {
+        /* Unlike the others, applies to running mounts right away */
+        int level = ELFUSE_LOG_OFF;
+        if (env->eq(env, Nvalue, env->intern(env, "error")))
+            level = ELFUSE_LOG_ERROR;
+        else if (env->eq(env, Nvalue, env->intern(env, "warn")))
+            level = ELFUSE_LOG_WARN;
+        else if (env->eq(env, Nvalue, env->intern(env, "info")))
+            level = ELFUSE_LOG_INFO;
+        else if (env->eq(env, Nvalue, env->intern(env, "debug")))
+            level = ELFUSE_LOG_DEBUG;
+        atomic_store_explicit(&elfuse_log_level, level, memory_order_relaxed);
+    } else {
+        message(env, "Elfuse: unknown option %s", name);
+        return nil;
+    }
+
+    return t;
+}
+
+/* Keywords of request types in elfuse--stats */
+static const char *elfuse_request_keywords[] = {
+    [WAITING_CREATE] = ":create",
+    [WAITING_RENAME] = ":rename",
+    [WAITING_GETATTR] = ":getattr",
+    [WAITING_READDIR] = ":readdir",
+    [WAITING_OPEN] = ":open",
+    [WAITING_RELEASE] = ":release",
+    [WAITING_READ] = ":read",
+    [WAITING_WRITE] = ":write",
+    [WAITING_TRUNCATE] = ":truncate",
+    [WAITING_UNLINK] = ":unlink",
+};
+
+static emacs_value
+make_stats_histogram(emacs_env *env, struct elfuse_stats_histogram *histogram)
+{
+    emacs_value buckets[ELFUSE_STATS_BUCKETS];
+    for (int bucket = 0; bucket < ELFUSE_STATS_BUCKETS; bucket++)
+        buckets[bucket] = env->make_integer(env, atomic_load_explicit(&histogram->buckets[bucket], memory_order_relaxed));
+
+    emacs_value plist[] = {
+        env->intern(env, ":sum-ns"),
+        env->make_integer(env, atomic_load_explicit(&histogram->sum_ns, memory_order_relaxed)),
+        env->intern(env, ":buckets"),
+        env->funcall(env, Qvector, ELFUSE_STATS_BUCKETS, buckets),
+    };
+    return env->funcall(env, Qlist, sizeof(plist) / sizeof(plist[0]), plist);
+}
+
+static emacs_value
+Felfuse_stats (emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+{
+    (void)nargs; (void)data;
+
+    struct mount *mount = extract_mount(env, args[0]);
+    if (mount == NULL) {
+        return nil;
+    }
+    struct elfuse_stats *stats = elfuse_mount_stats(mount->fuse);
+
+    emacs_value plist[2 * (WAITING_UNLINK + 1)];
+    ptrdiff_t plist_size = 0;
+    for (int request = WAITING_CREATE; request <= WAITING_UNLINK; request++) {
+        struct elfuse_stats_op *op = &stats->ops[request];
+        uint64_t count = atomic_load_explicit(&op->count, memory_order_relaxed);
+        if (count == 0)
+            continue;
+
+        emacs_value op_plist[] = {
+            env->intern(env, ":count"),
+            env->make_integer(env, count),
+            env->intern(env, ":errors"),
+            env->make_integer(env, atomic_load_explicit(&op->errors, memory_order_relaxed)),
+            env->intern(env, ":bytes"),
+            env->make_integer(env, atomic_load_explicit(&op->bytes, memory_order_relaxed)),
+            env->intern(env, ":queue-wait"),
+            make_stats_histogram(env, &op->latency[LATENCY_QUEUE]),
+            env->intern(env, ":lisp"),
+            make_stats_histogram(env, &op->latency[LATENCY_LISP]),
+            env->intern(env, ":total"),
+            make_stats_histogram(env, &op->latency[LATENCY_TOTAL]),
+        };
+        plist[plist_size++] = env->intern(env, elfuse_request_keywords[request]);
+        plist[plist_size++] = env->funcall(env, Qlist, sizeof(op_plist) / sizeof(op_plist[0]), op_plist);
+    }
+
+    return env->funcall(env, Qlist, plist_size, plist);
+}
+
+static emacs_value
+Felfuse_reset_stats (emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+{
+    (void)nargs; (void)data;
+
+    struct mount *mount = extract_mount(env, args[0]);
+    if (mount == NULL) {
+        return nil;
+    }
+    elfuse_stats_reset(elfuse_mount_stats(mount->fuse));
+
+    return t;
+}
+
+static emacs_value
+Felfuse_trace (emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+{
+    (void)nargs; (void)data;
+
+    struct mount *mount = extract_mount(env, args[0]);
+    if (mount == NULL) {
+        return nil;
+    }
+
+    char *filename = NULL;
+    if (env->is_not_nil(env, args[1])) {
+        filename = copy_string(env, args[1]);
+        if (filename == NULL) {
+            return nil;
+        }
+    }
+    bool res = elfuse_mount_trace(mount->fuse, filename);
+    if (!res) {
+        message(env, "Elfuse: failed to open %s", filename);
+    }
+    free(filename);
+
+    return res ? t : nil;
+}
+
+static const char *elfuse_loopback_workloads[] = {
+    [LOOPBACK_GETATTR] = "getattr",
+    [LOOPBACK_READDIR] = "readdir",
+    [LOOPBACK_READ] = "read",
+    [LOOPBACK_WRITE] = "write",
+};
+
+static emacs_value
+Felfuse_loopback_start (emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+{
+    (void)nargs; (void)data;
+
+    struct mount *mount = extract_mount(env, args[0]);
+    if (mount == NULL || !mount->running) {
+        return nil;
+    }
+    if (mount->loopback_run != NULL) {
+        message(env, "Elfuse: a loopback run is in progress");
+        return nil;
+    }
+
+    int workload = -1;
+    for (int i = LOOPBACK_GETATTR; i <= LOOPBACK_WRITE; i++) {
+        if (env->eq(env, args[1], env->intern(env, elfuse_loopback_workloads[i])))
+            workload = i;
+    }
+    if (workload < 0) {
+        message(env, "Elfuse: unknown loopback workload");
+        return nil;
+    }
+
+    char *path = copy_string(env, args[2]);
+    if (path == NULL) {
+        return nil;
+    }
+    intmax_t count = env->extract_integer(env, args[3]);
+    intmax_t threads = env->extract_integer(env, args[4]);
+    intmax_t size = env->extract_integer(env, args[5]);
+    if (env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+        free(path);
+        return nil;
+    }
+
+    mount->loopback_run = elfuse_loopback_run_start(mount->fuse, workload, path,
+                                                    size > 0 ? size : 0, count > 0 ? count : 0, threads);
+    free(path);
+    if (mount->loopback_run == NULL) {
+        message(env, "Elfuse: failed to start a loopback run");
+        return nil;
+    }
+
+    return t;
+}
+
+static emacs_value
+Felfuse_loopback_result (emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+{
+    (void)nargs; (void)data;
+
+    /* The threads wait for this very thread, never join them early */
+    struct mount *mount = extract_mount(env, args[0]);
+    if (mount == NULL || mount->loopback_run == NULL || !elfuse_loopback_run_done(mount->loopback_run)) {
+        return nil;
+    }
+
+    struct elfuse_loopback_result result;
+    elfuse_loopback_run_result(mount->loopback_run, &result);
+    elfuse_loopback_run_free(mount->loopback_run);
+    mount->loopback_run = NULL;
+
+    emacs_value plist[] = {
+        env->intern(env, ":requests"),
+        env->make_integer(env, result.requests),
+        env->intern(env, ":errors"),
+        env->make_integer(env, result.errors),
+        env->intern(env, ":bytes"),
+        env->make_integer(env, result.bytes),
+        env->intern(env, ":seconds"),
+        env->make_float(env, result.seconds),
+        env->intern(env, ":p50-ns"),
+        env->make_integer(env, result.p50_ns),
+        env->intern(env, ":p99-ns"),
+        env->make_integer(env, result.p99_ns),
+        env->intern(env, ":max-ns"),
+        env->make_integer(env, result.max_ns),
+    };
+    return env->funcall(env, Qlist, sizeof(plist) / sizeof(plist[0]), plist);
+}
+
+/* The tree of a memory mount, NULL (and a message) for anything else */
+static struct elfuse_memfs *
+extract_memfs(emacs_env *env, emacs_value Umount)
+{
+    struct mount *mount = extract_mount(env, Umount);
+    if (mount == NULL)
+        return NULL;
+    struct elfuse_memfs *fs = elfuse_mount_memfs(mount->fuse);
+    if (fs == NULL)
+        message(env, "Elfuse: not a memory mount");
+    return fs;
+}
+
+static emacs_value
+Felfuse_memory_put (emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+{
+    (void)nargs; (void)data;
+
+    struct elfuse_memfs *fs = extract_memfs(env, args[0]);
+    if (fs == NULL) {
+        return nil;
+    }
+    char *path = extract_prefix(env, args[1]);
+    if (path == NULL) {
+        return nil;
+    }
+
+    int res;
+    if (env->is_not_nil(env, args[2])) {
+        ptrdiff_t buffer_length;
+        env->copy_string_contents(env, args[2], NULL, &buffer_length);
+        char *contents = malloc(buffer_length);
+        if (contents == NULL || !env->copy_string_contents(env, args[2], contents, &buffer_length)) {
+            free(contents);
+            free(path);
+            return nil;
+        }
+        res = elfuse_memfs_put(fs, path, contents, buffer_length - 1);
+        free(contents);
+    } else {
+        res = elfuse_memfs_mkdirs(fs, path);
+    }
+    if (res != 0) {
+        message(env, "Elfuse: failed to create %s: %s", path, strerror(-res));
+    }
+    free(path);
+
+    return res == 0 ? t : nil;
+}
+
+static emacs_value
+Felfuse_memory_get (emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+{
+    (void)nargs; (void)data;
+
+    struct elfuse_memfs *fs = extract_memfs(env, args[0]);
+    if (fs == NULL) {
+        return nil;
+    }
+    char *path = extract_prefix(env, args[1]);
+    if (path == NULL) {
+        return nil;
+    }
+
+    char *contents;
+    size_t size;
+    int res = elfuse_memfs_get(fs, path, &contents, &size);
+    free(path);
+    if (res != 0) {
+        return nil;
+    }
+
+    /* Files written through the mount hold whatever bytes they were given */
+    emacs_value Scontents;
+    if (env->size >= (ptrdiff_t) sizeof(struct emacs_env_28))
+        Scontents = env->make_unibyte_string(env, contents, size);
+    else
+        Scontents = env->make_string(env, contents, size);
+    free(contents);
+
+    return Scontents;
+}
+
+struct memory_list {
+    emacs_env *env;
+    emacs_value *entries;
+    size_t entries_size;
+    size_t entries_capacity;
+};
+
+static int
+memory_list_add(void *data, const char *name, const struct stat *stbuf)
+{
+    struct memory_list *list = data;
+    emacs_env *env = list->env;
+
+    if (list->entries_size == list->entries_capacity) {
+        size_t capacity = list->entries_capacity > 0 ? list->entries_capacity * 2 : 64;
+        emacs_value *entries = realloc(list->entries, capacity * sizeof(entries[0]));
+        if (entries == NULL)
+            return 1;
+        list->entries = entries;
+        list->entries_capacity = capacity;
+    }
+
+    bool dir = S_ISDIR(stbuf->st_mode);
+    emacs_value entry[] = {
+        env->make_string(env, name, strlen(name)),
+        dir ? Qdir : Qfile,
+        env->make_integer(env, dir ? 0 : stbuf->st_size),
+    };
+    list->entries[list->entries_size++] = env->funcall(env, Qlist, sizeof(entry) / sizeof(entry[0]), entry);
+    return 0;
+}
+
+static emacs_value
+Felfuse_memory_list (emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+{
+    (void)nargs; (void)data;
+
+    struct elfuse_memfs *fs = extract_memfs(env, args[0]);
+    if (fs == NULL) {
+        return nil;
+    }
+    char *path = extract_prefix(env, args[1]);
+    if (path == NULL) {
+        return nil;
+    }
+
+    struct memory_list list = { env, NULL, 0, 0 };
+    int res = elfuse_memfs_list(fs, path, memory_list_add, &list);
+    free(path);
+
+    emacs_value res_value = nil;
+    if (res == 0) {
+        res_value = env->funcall(env, Qvector, list.entries_size, list.entries);
+    }
+    free(list.entries);
+
+    return res_value;
+}
+
+static emacs_value
+Felfuse_memory_delete (emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+{
+    (void)nargs; (void)data;
+
+    struct elfuse_memfs *fs = extract_memfs(env, args[0]);
+    if (fs == NULL) {
+        return nil;
+    }
+    char *path = extract_prefix(env, args[1]);
+    if (path == NULL) {
+        return nil;
+    }
+    int res = elfuse_memfs_remove(fs, path);
+    free(path);
+
+    return res == 0 ? t : nil;
+}
+
+static emacs_value
+Felfuse_invalidate_attr (emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+{
+    (void)nargs; (void)data;
+
+    struct mount *mount = extract_mount(env, args[0]);
+    if (mount == NULL) {
+        return nil;
+    }
+
+    char *path = copy_string(env, args[1]);
+    if (path == NULL) {
+        return nil;
+    }
+    elfuse_invalidate_attr(mount->fuse, path);
+    free(path);
+
+    return t;
+}
+
+static emacs_value
+Felfuse_invalidate_content (emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+{
+    (void)nargs; (void)data;
+
+    struct mount *mount = extract_mount(env, args[0]);
+    if (mount == NULL) {
+        return nil;
+    }
+
+    char *path = copy_string(env, args[1]);
+    if (path == NULL) {
+        return nil;
+    }
+    elfuse_invalidate_content(mount->fuse, path);
+    free(path);
+
+    return t;
+}
+
+static emacs_value
+Felfuse_invalidate_all (emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+{
+    (void)nargs; (void)data;
+
+    struct mount *mount = extract_mount(env, args[0]);
+    if (mount == NULL) {
+        return nil;
+    }
+
+    elfuse_invalidate_all(mount->fuse);
+    return t;
+}
+
+static emacs_value
+notify(emacs_env *env, enum elfuse_notify_kind kind, emacs_value Umount, emacs_value Spath)
+{
+    struct mount *mount = extract_mount(env, Umount);
+    if (mount == NULL) {
+        return nil;
+    }
+
+    char *path = copy_string(env, Spath);
+    if (path == NULL) {
+        return nil;
+    }
+    bool queued = elfuse_notify(mount->fuse, kind, path);
+    free(path);
+
+    return queued ? t : nil;
+}
+
+static emacs_value
+Felfuse_notify_changed (emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+{
+    (void)nargs; (void)data;
+    return notify(env, NOTIFY_CHANGED, args[0], args[1]);
+}
+
+static emacs_value
+Felfuse_notify_deleted (emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+{
+    (void)nargs; (void)data;
+    return notify(env, NOTIFY_DELETED, args[0], args[1]);
+}
+
+static emacs_value
+Felfuse_set_wakeup_channel (emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+{
+    (void)nargs; (void)data;
+
+    /* Channels to pipe processes only appeared in Emacs 28 */
+    if (env->size < (ptrdiff_t) sizeof(struct emacs_env_28)) {
+        return nil;
+    }
+
+    int fd = env->open_channel(env, args[0]);
+    if (env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+        env->non_local_exit_clear(env);
+        return nil;
+    }
+
+    elfuse_set_wakeup_fd(fd);
+    return t;
+}
+
+static int handle_create(emacs_env *env, emacs_value *handlers, struct elfuse_call_state *call, const char *path);
+static int handle_rename(emacs_env *env, emacs_value *handlers, struct elfuse_call_state *call, const char *oldpath, const char *newpath);
+static int handle_readdir(emacs_env *env, emacs_value *handlers, struct elfuse_call_state *call, const char *path, int64_t cursor);
+static int handle_getattr(emacs_env *env, emacs_value *handlers, struct elfuse_call_state *call, const char *path);
+static int handle_open(emacs_env *env, emacs_value *handlers, struct elfuse_call_state *call, const char *path);
+static int handle_release(emacs_env *env, emacs_value *handlers, struct elfuse_call_state *call, const char *path);
+static int handle_read(emacs_env *env, emacs_value *handlers, struct elfuse_call_state *call, const char *path, size_t offset, size_t size);
+static int handle_write(emacs_env *env, emacs_value *handlers, struct elfuse_call_state *call, const char *path, const char *buf, size_t size, size_t offset);
+static int handle_truncate(emacs_env *env, emacs_value *handlers, struct elfuse_call_state *call, const char *path, size_t size);
+static int handle_unlink(emacs_env *env, emacs_value *handlers, struct elfuse_call_state *call, const char *path);
+
+static int handle_result(emacs_env *env, struct elfuse_call_state *call, emacs_value value);
+static int extract_result(emacs_env *env, struct elfuse_call_state *call, emacs_value value);
+static int extract_readdir(emacs_env *env, struct elfuse_call_state *call, emacs_value listing);
+static int non_local_op_exit(emacs_env *env, struct elfuse_call_state *call, enum emacs_funcall_exit exit_status, emacs_value exit_symbol, emacs_value exit_data);
+
+static void
+handle_call(emacs_env *env, struct mount *mount, struct elfuse_call_state *call)
+{
+    enum elfuse_response_state response_state = RESPONSE_UNKNOWN_ERROR;
+    emacs_value *handlers = mount->routes[call->route].handlers;
+    ELFUSE_PROBE2(handler_start, call->request_state, elfuse_call_path(call));
+
+    /* Handlers may run elfuse--check-ops themselves, e.g. through timers */
+    struct handling current = {
+        .mount = mount,
+        .call = call,
+        .outer = handling,
+    };
+    handling = &current;
+    switch (call->request_state) {
+    case WAITING_CREATE:
+        response_state = handle_create(env, handlers, call, call->args.create.path);
+        break;
+    case WAITING_RENAME:
+        response_state = handle_rename(env, handlers, call, call->args.rename.oldpath, call->args.rename.newpath);
+        break;
+    case WAITING_READDIR:
+        response_state = handle_readdir(env, handlers, call, call->args.readdir.path, call->args.readdir.cursor);
+        break;
+    case WAITING_GETATTR:
+        response_state = handle_getattr(env, handlers, call, call->args.getattr.path);
+        break;
+    case WAITING_OPEN:
+        response_state = handle_open(env, handlers, call, call->args.open.path);
+        break;
+    case WAITING_RELEASE:
+        response_state = handle_release(env, handlers, call, call->args.release.path);
+        break;
+    case WAITING_READ:
+        response_state = handle_read(
+            env, handlers, call, call->args.read.path, call->args.read.offset, call->args.read.size
+        );
+        break;
+    case WAITING_WRITE:
+        response_state = handle_write(
+            env, handlers, call, call->args.write.path, call->args.write.buf, call->args.write.size, call->args.write.offset
+        );
+        break;
+    case WAITING_TRUNCATE:
+        response_state = handle_truncate(env, handlers, call, call->args.truncate.path, call->args.truncate.size);
+        break;
+    case WAITING_UNLINK:
+        response_state = handle_unlink(env, handlers, call, call->args.unlink.path);
+        break;
+    case WAITING_NONE:
+        break;
+    }
+    handling = current.outer;
+
+    /* Answered already, or parked until elfuse--reply unless the handler
+     * failed after deferring */
+    if (current.replied)
+        return;
+    if (current.deferred != NULL) {
+        current.deferred->handling = NULL;
+        if (response_state == RESPONSE_DEFERRED)
+            return;
+        free(deferred_take(current.deferred->token));
+    }
+
+    complete_call(mount, call, response_state);
+}
+
+static double
+monotonic_seconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static bool
+should_yield(emacs_env *env)
+{
+    if (env->size >= (ptrdiff_t) sizeof(struct emacs_env_26) && env->should_quit(env))
+        return true;
+
+    return env->is_not_nil(env, env->funcall(env, Qinput_pending_p, 0, NULL));
+}
+
+static emacs_value
+Felfuse_check_ops(emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+{
+    (void)data;
+
+    if (mounts == NULL) {
+        message(env, "Elfuse loop is not running, abort.");
+        return nil;
+    }
+
+    /* Without a budget only a single request is handled */
+    double budget = 0;
+    if (nargs > 0 && env->is_not_nil(env, args[0])) {
+        budget = extract_number(env, args[0]);
+        if (env->non_local_exit_check(env) != emacs_funcall_exit_return)
+            return nil;
+    }
+    double deadline = monotonic_seconds() + budget;
+
+    /* One request per mount and round, a busy mount can't starve the others.
+     * Handlers may stop mounts, so the list is walked again every round, and
+     * from the start once the mount of the last request is gone. */
+    bool out_of_time = false;
+    bool handled = true;
+    while (handled && !out_of_time) {
+        handled = false;
+        struct mount *mount = mounts;
+        while (mount != NULL && !out_of_time) {
+            struct elfuse_call_state *call = elfuse_call_dequeue(mount->fuse);
+            if (call == NULL) {
+                mount = mount->next;
+                continue;
+            }
+            mount->handlers_running++;
+            handle_call(env, mount, call);
+            mount->handlers_running--;
+            handled = true;
+
+            struct mount *next = mount->running ? mount->next : mounts;
+            if (!mount->running && mount->handlers_running == 0)
+                mount_release(env, mount);
+            mount = next;
+
+            out_of_time = monotonic_seconds() >= deadline || should_yield(env);
+        }
+    }
+
+    size_t queued = 0;
+    for (struct mount *mount = mounts; mount != NULL; mount = mount->next)
+        queued += elfuse_queue_length(mount->fuse);
+    return env->make_integer(env, queued);
+}
+
+static emacs_value
+Felfuse_defer(emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+{
+    (void)nargs; (void)args; (void)data;
+
+    if (handling == NULL || handling->replied) {
+        message(env, "Elfuse: no request to defer");
+        return nil;
+    }
+
+    /* Deferring twice hands out the same token */
+    if (handling->deferred == NULL) {
+        struct deferred *entry = calloc(1, sizeof(*entry));
+        if (entry == NULL)
+            return nil;
+        if (!elfuse_call_park(handling->mount->fuse, handling->call)) {
+            free(entry);
+            elfuse_log_warn("too many deferred requests, answer right away");
+            return nil;
+        }
+
+        entry->token = ++deferred_last_token;
+        entry->mount = handling->mount;
+        entry->call = handling->call;
+        entry->handling = handling;
+        entry->next = deferred_calls;
+        deferred_calls = entry;
+        handling->deferred = entry;
+    }
+    return env->make_integer(env, handling->deferred->token);
+}
+
+/* The deferred request behind a token, NULL if it was answered, failed or
+ * its mount stopped meanwhile */
+static struct deferred *
+extract_deferred(emacs_env *env, emacs_value Itoken)
+{
+    intmax_t token = env->extract_integer(env, Itoken);
+    if (env->non_local_exit_check(env) != emacs_funcall_exit_return)
+        return NULL;
+    return deferred_take(token);
+}
+
+static emacs_value
+Felfuse_reply(emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+{
+    (void)nargs; (void)data;
+
+    struct deferred *entry = extract_deferred(env, args[0]);
+    if (entry == NULL)
+        return nil;
+
+    /* A malformed result fails the request and signals the caller */
+    enum elfuse_response_state response_state = extract_result(env, entry->call, args[1]);
+    if (env->non_local_exit_check(env) != emacs_funcall_exit_return)
+        response_state = RESPONSE_UNKNOWN_ERROR;
+
+    deferred_complete(entry, response_state);
+    return t;
+}
+
+static emacs_value
+Felfuse_reply_error(emacs_env *env, ptrdiff_t nargs, emacs_value args[], void *data)
+{
+    (void)nargs; (void)data;
+
+    struct deferred *entry = extract_deferred(env, args[0]);
+    if (entry == NULL)
+        return nil;
+
+    entry->call->response_err_code = env->extract_integer(env, args[1]);
+    if (env->non_local_exit_check(env) != emacs_funcall_exit_return) {
+        deferred_complete(entry, RESPONSE_UNKNOWN_ERROR);
+        return nil;
+    }
+
+    deferred_complete(entry, RESPONSE_SIGNAL_ERROR);
+    return t;
+}
+
+static int
+handle_create(emacs_env *env, emacs_value *handlers, struct elfuse_call_state *call, const char *path)
+{
+    elfuse_log_debug("CREATE handle (path=%s)", path);
+
+    emacs_value Qcreate = handlers[OP_CREATE];
+    if (Qcreate == NULL) {
+        return RESPONSE_UNDEFINED;
+    }
+
+    /* Build args and execute the function call itself */
+    emacs_value args[] = {
+        env->make_string(env, path, strlen(path)),
+    };
+    emacs_value Ires_code = env->funcall(env, Qcreate, sizeof(args)/sizeof(args[0]), args);
+
+    return handle_result(env, call, Ires_code);
+}
+
+static int
+handle_rename(emacs_env *env, emacs_value *handlers, struct elfuse_call_state *call, const char *oldpath, const char *newpath)
+{
+    elfuse_log_debug("RENAME handle (oldpath=%s, newpath=%s)", oldpath, newpath);
+
+    emacs_value Qrename = handlers[OP_RENAME];
+    if (Qrename == NULL) {
+        return RESPONSE_UNDEFINED;
+    }
+
+    /* Build args and execute the function call itself */
+    emacs_value args[] = {
+        env->make_string(env, oldpath, strlen(oldpath)),
+        env->make_string(env, newpath, strlen(newpath)),
+    };
+    emacs_value Ires_code = env->funcall(env, Qrename, sizeof(args)/sizeof(args[0]), args);
+
+    return handle_result(env, call, Ires_code);
+}
+
+static int
+handle_readdir(emacs_env *env, emacs_value *handlers, struct elfuse_call_state *call, const char *path, int64_t cursor)
+{
+    elfuse_log_debug("READDIR handle (path=%s, cursor=%ld)", path, (long) cursor);
+
+    /* Paged listings take precedence over complete ones */
+    emacs_value Qreaddir_page = handlers[OP_READDIR_PAGE];
+    emacs_value Qreaddir = handlers[OP_READDIR];
+    bool paged = Qreaddir_page != NULL;
+    if (!paged && Qreaddir == NULL) {
+        return RESPONSE_UNDEFINED;
     }
 
-    /* Handle proper response */
-    elfuse_call.results.readdir.files_size = env->vec_size(env, file_vector);
-    size_t arr_bytes_length = elfuse_call.results.readdir.files_size*sizeof(elfuse_call.results.readdir.files[0]);
-    elfuse_call.results.readdir.files = malloc(arr_bytes_length);
+    call->results.readdir.more = false;
+    call->results.readdir.entries = NULL;
+    call->results.readdir.entries_size = 0;
 
-    for (size_t i = 0; i < elfuse_call.results.readdir.files_size; i++) {
-        emacs_value Spath = env->vec_get(env, file_vector, i);
-        ptrdiff_t buffer_length;
-        env->copy_string_contents(env, Spath, NULL, &buffer_length);
-        char *dirpath = malloc(buffer_length);
-        env->copy_string_contents(env, Spath, dirpath, &buffer_length);
-        elfuse_call.results.readdir.files[i] = dirpath;
+    /* A complete listing is a single page */
+    if (!paged && cursor != 0) {
+        return RESPONSE_SUCCESS;
     }
 
-    return RESPONSE_SUCCESS;
+    /* Build args and execute the function call itself */
+    emacs_value listing;
+    if (paged) {
+        emacs_value args[] = {
+            env->make_string(env, path, strlen(path)),
+            env->make_integer(env, cursor),
+        };
+        listing = env->funcall(env, Qreaddir_page, sizeof(args)/sizeof(args[0]), args);
+    } else {
+        emacs_value args[] = {
+            env->make_string(env, path, strlen(path))
+        };
+        listing = env->funcall(env, Qreaddir, sizeof(args)/sizeof(args[0]), args);
+    }
+
+    return handle_result(env, call, listing);
 }
 
 static int
-handle_getattr(emacs_env *env, const char *path)
+handle_getattr(emacs_env *env, emacs_value *handlers, struct elfuse_call_state *call, const char *path)
 {
-    fprintf(stderr, "GETATTR handle (path=%s).\n", path);
+    elfuse_log_debug("GETATTR handle (path=%s)", path);
 
-    emacs_value Qgetattr = env->intern(env, "elfuse--getattr-op");
-    if (!fboundp(env, Qgetattr)) {
+    emacs_value Qgetattr = handlers[OP_GETATTR];
+    if (Qgetattr == NULL) {
         return RESPONSE_UNDEFINED;
     }
 
@@ -390,39 +1681,16 @@ handle_getattr(emacs_env *env, const char *path)
     };
     emacs_value getattr_result_vector = env->funcall(env, Qgetattr, sizeof(args)/sizeof(args[0]), args);
 
-    /* Handle possible non-local exits (signals or throws) */
-    emacs_value exit_symbol, exit_data;
-    enum emacs_funcall_exit exit_status = env->non_local_exit_get(
-        env, &exit_symbol, &exit_data
-    );
-    if (exit_status != emacs_funcall_exit_return) {
-        env->non_local_exit_clear(env);
-        return non_local_op_exit(env, exit_status, exit_symbol, exit_data);
-    }
-
-    /* Handle proper response */
-    emacs_value Qfiletype = env->vec_get(env, getattr_result_vector, 0);
-    emacs_value file_size = env->vec_get(env, getattr_result_vector, 1);
-
-    if (env->eq(env, Qfiletype, env->intern(env, "file"))) {
-        elfuse_call.results.getattr.code = GETATTR_FILE;
-        elfuse_call.results.getattr.file_size = env->extract_integer(env, file_size);
-    } else if (env->eq(env, Qfiletype, env->intern(env, "dir"))) {
-        elfuse_call.results.getattr.code = GETATTR_DIR;
-    } else {
-        elfuse_call.results.getattr.code = GETATTR_UNKNOWN;
-    }
-
-    return RESPONSE_SUCCESS;
+    return handle_result(env, call, getattr_result_vector);
 }
 
 static int
-handle_open(emacs_env *env, const char *path)
+handle_open(emacs_env *env, emacs_value *handlers, struct elfuse_call_state *call, const char *path)
 {
-    fprintf(stderr, "OPEN handle (path=%s).\n", path);
+    elfuse_log_debug("OPEN handle (path=%s)", path);
 
-    emacs_value Qopen = env->intern(env, "elfuse--open-op");
-    if (!fboundp(env, Qopen)) {
+    emacs_value Qopen = handlers[OP_OPEN];
+    if (Qopen == NULL) {
         return RESPONSE_UNDEFINED;
     }
 
@@ -432,33 +1700,16 @@ handle_open(emacs_env *env, const char *path)
     };
     emacs_value Qfound = env->funcall(env, Qopen, sizeof(args)/sizeof(args[0]), args);
 
-    /* Handle possible non-local exits (signals or throws) */
-    emacs_value exit_symbol, exit_data;
-    enum emacs_funcall_exit exit_status = env->non_local_exit_get(
-        env, &exit_symbol, &exit_data
-    );
-    if (exit_status != emacs_funcall_exit_return) {
-        env->non_local_exit_clear(env);
-        return non_local_op_exit(env, exit_status, exit_symbol, exit_data);
-    }
-
-    /* Handle proper response */
-    if (env->eq(env, Qfound, t)) {
-        elfuse_call.results.open.code = OPEN_FOUND;
-    } else {
-        elfuse_call.results.open.code = OPEN_UNKNOWN;
-    }
-
-    return RESPONSE_SUCCESS;
+    return handle_result(env, call, Qfound);
 }
 
 static int
-handle_release(emacs_env *env, const char *path)
+handle_release(emacs_env *env, emacs_value *handlers, struct elfuse_call_state *call, const char *path)
 {
-    fprintf(stderr, "RELEASE handle (path=%s).\n", path);
+    elfuse_log_debug("RELEASE handle (path=%s)", path);
 
-    emacs_value Qrelease = env->intern(env, "elfuse--release-op");
-    if (!fboundp(env, Qrelease)) {
+    emacs_value Qrelease = handlers[OP_RELEASE];
+    if (Qrelease == NULL) {
         return RESPONSE_UNDEFINED;
     }
 
@@ -468,33 +1719,16 @@ handle_release(emacs_env *env, const char *path)
     };
     emacs_value Qfound = env->funcall(env, Qrelease, sizeof(args)/sizeof(args[0]), args);
 
-    /* Handle possible non-local exits (signals or throws) */
-    emacs_value exit_symbol, exit_data;
-    enum emacs_funcall_exit exit_status = env->non_local_exit_get(
-        env, &exit_symbol, &exit_data
-    );
-    if (exit_status != emacs_funcall_exit_return) {
-        env->non_local_exit_clear(env);
-        return non_local_op_exit(env, exit_status, exit_symbol, exit_data);
-    }
-
-    /* Handle proper response */
-    if (env->eq(env, Qfound, t)) {
-        elfuse_call.results.release.code = RELEASE_FOUND;
-    } else {
-        elfuse_call.results.release.code = RELEASE_UNKNOWN;
-    }
-
-    return RESPONSE_SUCCESS;
+    return handle_result(env, call, Qfound);
 }
 
 static int
-handle_read(emacs_env *env, const char *path, size_t offset, size_t size)
+handle_read(emacs_env *env, emacs_value *handlers, struct elfuse_call_state *call, const char *path, size_t offset, size_t size)
 {
-    fprintf(stderr, "READ handle (path=%s).\n", path);
+    elfuse_log_debug("READ handle (path=%s)", path);
 
-    emacs_value Qread = env->intern(env, "elfuse--read-op");
-    if (!fboundp(env, Qread)) {
+    emacs_value Qread = handlers[OP_READ];
+    if (Qread == NULL) {
         return RESPONSE_UNDEFINED;
     }
 
@@ -506,40 +1740,16 @@ handle_read(emacs_env *env, const char *path, size_t offset, size_t size)
     };
     emacs_value Sdata = env->funcall(env, Qread, sizeof(args)/sizeof(args[0]), args);
 
-    /* Handle possible non-local exits (signals or throws) */
-    emacs_value exit_symbol, exit_data;
-    enum emacs_funcall_exit exit_status = env->non_local_exit_get(
-        env, &exit_symbol, &exit_data
-    );
-    if (exit_status != emacs_funcall_exit_return) {
-        env->non_local_exit_clear(env);
-        return non_local_op_exit(env, exit_status, exit_symbol, exit_data);
-    }
-
-    /* Handle proper response */
-    if (env->eq(env, Sdata, nil)) {
-        elfuse_call.results.read.bytes_read = -1;
-    } else {
-        ptrdiff_t buffer_length;
-        env->copy_string_contents(env, Sdata, NULL, &buffer_length);
-        elfuse_call.results.read.data = malloc(buffer_length);
-        if (!env->copy_string_contents(env, Sdata, elfuse_call.results.read.data, &buffer_length)) {
-            elfuse_call.results.read.bytes_read = -1;
-        } else {
-            elfuse_call.results.read.bytes_read = buffer_length;
-        }
-    }
-
-    return RESPONSE_SUCCESS;
+    return handle_result(env, call, Sdata);
 }
 
 static int
-handle_write(emacs_env *env, const char *path, const char *buf, size_t size, size_t offset)
+handle_write(emacs_env *env, emacs_value *handlers, struct elfuse_call_state *call, const char *path, const char *buf, size_t size, size_t offset)
 {
-    fprintf(stderr, "WRITE handle (path=%s).\n", path);
+    elfuse_log_debug("WRITE handle (path=%s)", path);
 
-    emacs_value Qwrite = env->intern(env, "elfuse--write-op");
-    if (!fboundp(env, Qwrite)) {
+    emacs_value Qwrite = handlers[OP_WRITE];
+    if (Qwrite == NULL) {
         return RESPONSE_UNDEFINED;
     }
 
@@ -551,34 +1761,16 @@ handle_write(emacs_env *env, const char *path, const char *buf, size_t size, siz
     };
     emacs_value Ires_code = env->funcall(env, Qwrite, sizeof(args)/sizeof(args[0]), args);
 
-    /* Handle possible non-local exits (signals or throws) */
-    emacs_value exit_symbol, exit_data;
-    enum emacs_funcall_exit exit_status = env->non_local_exit_get(
-        env, &exit_symbol, &exit_data
-    );
-    if (exit_status != emacs_funcall_exit_return) {
-        env->non_local_exit_clear(env);
-        return non_local_op_exit(env, exit_status, exit_symbol, exit_data);
-    }
-
-    /* Handle proper response */
-    int res_code = env->extract_integer(env, Ires_code);
-    if (res_code >= 0) {
-        elfuse_call.results.write.size  = size;
-    } else {
-        elfuse_call.results.write.size  = res_code;
-    }
-
-    return RESPONSE_SUCCESS;
+    return handle_result(env, call, Ires_code);
 }
 
 static int
-handle_truncate(emacs_env *env, const char *path, size_t size)
+handle_truncate(emacs_env *env, emacs_value *handlers, struct elfuse_call_state *call, const char *path, size_t size)
 {
-    fprintf(stderr, "TRUNCATE handle (path=%s).\n", path);
+    elfuse_log_debug("TRUNCATE handle (path=%s)", path);
 
-    emacs_value Qtruncate = env->intern(env, "elfuse--truncate-op");
-    if (!fboundp(env, Qtruncate)) {
+    emacs_value Qtruncate = handlers[OP_TRUNCATE];
+    if (Qtruncate == NULL) {
         return RESPONSE_UNDEFINED;
     }
 
@@ -589,34 +1781,17 @@ handle_truncate(emacs_env *env, const char *path, size_t size)
     };
     emacs_value Ires_code = env->funcall(env, Qtruncate, sizeof(args)/sizeof(args[0]), args);
 
-    /* Handle possible non-local exits (signals or throws) */
-    emacs_value exit_symbol, exit_data;
-    enum emacs_funcall_exit exit_status = env->non_local_exit_get(
-        env, &exit_symbol, &exit_data
-    );
-    if (exit_status != emacs_funcall_exit_return) {
-        env->non_local_exit_clear(env);
-        return non_local_op_exit(env, exit_status, exit_symbol, exit_data);
-    }
-
-    /* Handle proper response */
-    if (env->extract_integer(env, Ires_code) >= 0) {
-        elfuse_call.results.truncate.code  = TRUNCATE_DONE;
-    } else {
-        elfuse_call.results.truncate.code  = TRUNCATE_UNKNOWN;
-    }
-
-    return RESPONSE_SUCCESS;
+    return handle_result(env, call, Ires_code);
 }
 
 
 static int
-handle_unlink(emacs_env *env, const char *path)
+handle_unlink(emacs_env *env, emacs_value *handlers, struct elfuse_call_state *call, const char *path)
 {
-    fprintf(stderr, "UNLINK handle (path=%s).\n", path);
+    elfuse_log_debug("UNLINK handle (path=%s)", path);
 
-    emacs_value Qunlink = env->intern(env, "elfuse--unlink-op");
-    if (!fboundp(env, Qunlink)) {
+    emacs_value Qunlink = handlers[OP_UNLINK];
+    if (Qunlink == NULL) {
         return RESPONSE_UNDEFINED;
     }
 
@@ -626,6 +1801,21 @@ handle_unlink(emacs_env *env, const char *path)
     };
     emacs_value Ires_code = env->funcall(env, Qunlink, sizeof(args)/sizeof(args[0]), args);
 
+    return handle_result(env, call, Ires_code);
+}
+
+/* What the handler of the current request returned, unless it deferred
+ * the reply (elfuse--defer) */
+static int
+handle_result(emacs_env *env, struct elfuse_call_state *call, emacs_value value)
+{
+    /* Answered by elfuse--reply or failed by elfuse--stop already, the call
+     * may be gone by now */
+    if (handling->replied) {
+        env->non_local_exit_clear(env);
+        return RESPONSE_DEFERRED;
+    }
+
     /* Handle possible non-local exits (signals or throws) */
     emacs_value exit_symbol, exit_data;
     enum emacs_funcall_exit exit_status = env->non_local_exit_get(
@@ -633,39 +1823,173 @@ handle_unlink(emacs_env *env, const char *path)
     );
     if (exit_status != emacs_funcall_exit_return) {
         env->non_local_exit_clear(env);
-        return non_local_op_exit(env, exit_status, exit_symbol, exit_data);
+        return non_local_op_exit(env, call, exit_status, exit_symbol, exit_data);
     }
 
-    /* Handle proper response */
-    if (env->extract_integer(env, Ires_code) >= 0) {
-        elfuse_call.results.unlink.code  = UNLINK_DONE;
-    } else {
-        elfuse_call.results.unlink.code  = UNLINK_UNKNOWN;
+    if (handling->deferred != NULL)
+        return RESPONSE_DEFERRED;
+    return extract_result(env, call, value);
+}
+
+/* Fill the results of CALL in from what its handler returned or
+ * elfuse--reply was given */
+static int
+extract_result(emacs_env *env, struct elfuse_call_state *call, emacs_value value)
+{
+    switch (call->request_state) {
+    case WAITING_CREATE: {
+        int res_code = env->extract_integer(env, value);
+        call->results.create.code = res_code >= 0 ? CREATE_DONE : CREATE_FAIL;
+        break;
+    }
+    case WAITING_RENAME: {
+        int res_code = env->extract_integer(env, value);
+        call->results.rename.code = res_code >= 0 ? RENAME_DONE : RENAME_UNKNOWN;
+        break;
+    }
+    case WAITING_READDIR:
+        return extract_readdir(env, call, value);
+    case WAITING_GETATTR:
+        extract_attr(env, value, 0, &call->results.getattr);
+        break;
+    case WAITING_OPEN:
+        if (env->eq(env, value, t)) {
+            call->results.open.code = OPEN_FOUND;
+        } else {
+            call->results.open.code = OPEN_UNKNOWN;
+        }
+        break;
+    case WAITING_RELEASE:
+        if (env->eq(env, value, t)) {
+            call->results.release.code = RELEASE_FOUND;
+        } else {
+            call->results.release.code = RELEASE_UNKNOWN;
+        }
+        break;
+    case WAITING_READ:
+        if (env->eq(env, value, nil)) {
+            call->results.read.bytes_read = -1;
+        } else {
+            ptrdiff_t buffer_length;
+            env->copy_string_contents(env, value, NULL, &buffer_length);
+            call->results.read.data = malloc(buffer_length);
+            if (call->results.read.data == NULL
+                || !env->copy_string_contents(env, value, call->results.read.data, &buffer_length)) {
+                call->results.read.bytes_read = -1;
+            } else {
+                /* Without the terminating NUL */
+                call->results.read.bytes_read = buffer_length - 1;
+            }
+        }
+        break;
+    case WAITING_WRITE: {
+        int res_code = env->extract_integer(env, value);
+        if (res_code >= 0) {
+            call->results.write.size  = call->args.write.size;
+        } else {
+            call->results.write.size  = res_code;
+        }
+        break;
+    }
+    case WAITING_TRUNCATE:
+        if (env->extract_integer(env, value) >= 0) {
+            call->results.truncate.code  = TRUNCATE_DONE;
+        } else {
+            call->results.truncate.code  = TRUNCATE_UNKNOWN;
+        }
+        break;
+    case WAITING_UNLINK:
+        if (env->extract_integer(env, value) >= 0) {
+            call->results.unlink.code  = UNLINK_DONE;
+        } else {
+            call->results.unlink.code  = UNLINK_UNKNOWN;
+        }
+        break;
+    case WAITING_NONE:
+        return RESPONSE_UNKNOWN_ERROR;
     }
 
     return RESPONSE_SUCCESS;
 }
 
+static int
+extract_readdir(emacs_env *env, struct elfuse_call_state *call, emacs_value listing)
+{
+    emacs_value exit_symbol, exit_data;
+    enum emacs_funcall_exit exit_status;
+
+    /* Either a vector of entries or (ENTRIES . NEXT-CURSOR) from a paged
+     * listing, the cursor is nil after the last page */
+    emacs_value file_vector = listing;
+    if (env->eq(env, env->type_of(env, listing), Qcons)) {
+        file_vector = env->funcall(env, Qcar, 1, &listing);
+        emacs_value Inext_cursor = env->funcall(env, Qcdr, 1, &listing);
+        if (env->is_not_nil(env, Inext_cursor)) {
+            call->results.readdir.more = true;
+            call->results.readdir.next_cursor = env->extract_integer(env, Inext_cursor);
+        }
+
+        exit_status = env->non_local_exit_get(env, &exit_symbol, &exit_data);
+        if (exit_status != emacs_funcall_exit_return) {
+            env->non_local_exit_clear(env);
+            return non_local_op_exit(env, call, exit_status, exit_symbol, exit_data);
+        }
+    }
+
+    /* Handle proper response, either file names or (name type size [ttl])
+     * lists with the attributes of every file */
+
+    size_t entries_size = env->vec_size(env, file_vector);
+    call->results.readdir.entries = calloc(entries_size, sizeof(call->results.readdir.entries[0]));
+    call->results.readdir.entries_size = 0;
+    if (call->results.readdir.entries == NULL)
+        return RESPONSE_UNKNOWN_ERROR;
+
+    for (size_t i = 0; i < entries_size; i++) {
+        struct elfuse_readdir_entry *entry = &call->results.readdir.entries[i];
+        emacs_value Sentry = env->vec_get(env, file_vector, i);
+
+        if (env->eq(env, env->type_of(env, Sentry), Qstring)) {
+            entry->name = copy_string(env, Sentry);
+        } else {
+            emacs_value Ventry = env->funcall(env, Qvconcat, 1, &Sentry);
+            entry->name = copy_string(env, env->vec_get(env, Ventry, 0));
+            entry->has_attr = extract_attr(env, Ventry, 1, &entry->attr);
+        }
+
+        /* A malformed entry */
+        exit_status = env->non_local_exit_get(env, &exit_symbol, &exit_data);
+        if (exit_status != emacs_funcall_exit_return) {
+            env->non_local_exit_clear(env);
+            free(entry->name);
+            call->results.readdir.entries_size = i;
+            return non_local_op_exit(env, call, exit_status, exit_symbol, exit_data);
+        }
+        call->results.readdir.entries_size = i + 1;
+    }
+
+    return RESPONSE_SUCCESS;
+}
 
 static int
-non_local_op_exit(emacs_env *env, enum emacs_funcall_exit exit_code, emacs_value exit_symbol, emacs_value exit_data)
+non_local_op_exit(emacs_env *env, struct elfuse_call_state *call, enum emacs_funcall_exit exit_code, emacs_value exit_symbol, emacs_value exit_data)
 {
     int res = RESPONSE_UNKNOWN_ERROR;
     if (exit_code == emacs_funcall_exit_signal) {
         if (env->eq(env, exit_symbol, elfuse_op_error)) {
-            elfuse_call.response_err_code = env->extract_integer(env, exit_data);
+            call->response_err_code = env->extract_integer(env, exit_data);
             res = RESPONSE_SIGNAL_ERROR;
-            fprintf(stderr, "An Elfuse signal caught (code=%d)\n", elfuse_call.response_err_code);
+            elfuse_log_debug("An Elfuse signal caught (code=%d)", call->response_err_code);
         } else {
             ptrdiff_t size;
             extract_symbol_name(env, exit_symbol, NULL, &size);
             char name[size];
             extract_symbol_name(env, exit_symbol, name, &size);
-            fprintf(stderr, "Unknown error caught (name=%s)\n", name);
+            elfuse_log_warn("Unknown error caught (name=%s)", name);
         }
 
     } else {
-        fprintf(stderr, "An unknown non-local op exit\n");
+        elfuse_log_warn("An unknown non-local op exit");
     }
     return res;
 }
@@ -675,34 +1999,236 @@ emacs_module_init (struct emacs_runtime *ert)
 {
     emacs_env *env = ert->get_environment (ert);
 
-    nil = env->intern(env, "nil");
-    t = env->intern(env, "t");
-    elfuse_op_error = env->intern(env, "elfuse-op-error");
+    nil = env->make_global_ref(env, env->intern(env, "nil"));
+    t = env->make_global_ref(env, env->intern(env, "t"));
+    elfuse_op_error = env->make_global_ref(env, env->intern(env, "elfuse-op-error"));
+    Qfile = env->make_global_ref(env, env->intern(env, "file"));
+    Qdir = env->make_global_ref(env, env->intern(env, "dir"));
+    Qinteger = env->make_global_ref(env, env->intern(env, "integer"));
+    Qstring = env->make_global_ref(env, env->intern(env, "string"));
+    Qvconcat = env->make_global_ref(env, env->intern(env, "vconcat"));
+    Qinput_pending_p = env->make_global_ref(env, env->intern(env, "input-pending-p"));
+    Qcar = env->make_global_ref(env, env->intern(env, "car"));
+    Qcdr = env->make_global_ref(env, env->intern(env, "cdr"));
+    Qcons = env->make_global_ref(env, env->intern(env, "cons"));
+    Qlist = env->make_global_ref(env, env->intern(env, "list"));
+    Qvector = env->make_global_ref(env, env->intern(env, "vector"));
 
     emacs_value fun = env->make_function (
-        env, 1, 1,
+        env, 1, 4,
         Felfuse_mount,
-        "Start the elfuse thread. ",
+        "Mount PATH, optionally with THREADS FUSE receiver threads.\n"
+        "OPTIONS is a plist of FUSE mount options, e.g. (:attr-timeout 10 :kernel-cache t).\n"
+        "HANDLERS is an alist of ops and their functions, e.g. ((getattr . my-getattr)),\n"
+        "and of subtrees and their handlers, e.g. (\"/org\" (getattr . org-getattr)).\n"
+        "Return the mount, nil if mounting failed. ",
         NULL
     );
     bind_function (env, "elfuse--mount", fun);
 
     fun = env->make_function (
-        env, 0, 0,
+        env, 1, 1,
         Felfuse_stop,
-        "Kill the elfuse thread. ",
+        "Unmount MOUNT and kill its threads. ",
         NULL
     );
     bind_function (env, "elfuse--stop", fun);
 
     fun = env->make_function (
-        env, 0, 0,
+        env, 0, 1,
         Felfuse_check_ops,
-        "Check if Fuse callbacks are waiting for reply and reply. ",
+        "Reply to Fuse callbacks waiting for Emacs for at most BUDGET seconds.\n"
+        "Every mount gets its turn. Return the number of requests still waiting,\n"
+        "nil if nothing is mounted. ",
         NULL
     );
     bind_function (env, "elfuse--check-ops", fun);
 
+    fun = env->make_function (
+        env, 0, 0,
+        Felfuse_defer,
+        "Leave the request of the running handler unanswered until `elfuse--reply'.\n"
+        "Return its token, nil outside of handlers or if too many are deferred. ",
+        NULL
+    );
+    bind_function (env, "elfuse--defer", fun);
+
+    fun = env->make_function (
+        env, 2, 2,
+        Felfuse_reply,
+        "Answer the request deferred with TOKEN by RESULT, as its handler would.\n"
+        "Return nil if the request is no longer waiting. ",
+        NULL
+    );
+    bind_function (env, "elfuse--reply", fun);
+
+    fun = env->make_function (
+        env, 2, 2,
+        Felfuse_reply_error,
+        "Fail the request deferred with TOKEN with ERRNO.\n"
+        "Return nil if the request is no longer waiting. ",
+        NULL
+    );
+    bind_function (env, "elfuse--reply-error", fun);
+
+    fun = env->make_function (
+        env, 1, 1,
+        Felfuse_set_wakeup_channel,
+        "Notify pipe PROCESS of every incoming request, nil if unsupported. ",
+        NULL
+    );
+    bind_function (env, "elfuse--set-wakeup-channel", fun);
+
+    fun = env->make_function (
+        env, 1, 1,
+        Felfuse_stats,
+        "Return a plist of counters and latency histograms of MOUNT by request type. ",
+        NULL
+    );
+    bind_function (env, "elfuse--stats", fun);
+
+    fun = env->make_function (
+        env, 1, 1,
+        Felfuse_reset_stats,
+        "Reset the counters and latency histograms of MOUNT. ",
+        NULL
+    );
+    bind_function (env, "elfuse--reset-stats", fun);
+
+    fun = env->make_function (
+        env, 2, 2,
+        Felfuse_trace,
+        "Record the requests MOUNT receives to FILE, stop if FILE is nil. ",
+        NULL
+    );
+    bind_function (env, "elfuse--trace", fun);
+
+    fun = env->make_function (
+        env, 6, 6,
+        Felfuse_loopback_start,
+        "Make COUNT requests of WORKLOAD to PATH of a loopback MOUNT from THREADS threads.\n"
+        "WORKLOAD is one of `getattr', `readdir', `read' and `write', reads and\n"
+        "writes are SIZE bytes long. Emacs has to keep answering requests. ",
+        NULL
+    );
+    bind_function (env, "elfuse--loopback-start", fun);
+
+    fun = env->make_function (
+        env, 1, 1,
+        Felfuse_loopback_result,
+        "Return the result of the loopback run of MOUNT once it's over, nil until then. ",
+        NULL
+    );
+    bind_function (env, "elfuse--loopback-result", fun);
+
+    fun = env->make_function (
+        env, 3, 3,
+        Felfuse_memory_put,
+        "Set the contents of the file PATH of a memory MOUNT to the string CONTENTS.\n"
+        "Missing parent directories are created, CONTENTS nil makes PATH a directory. ",
+        NULL
+    );
+    bind_function (env, "elfuse--memory-put", fun);
+
+    fun = env->make_function (
+        env, 2, 2,
+        Felfuse_memory_get,
+        "Return the contents of the file PATH of a memory MOUNT, a unibyte string. ",
+        NULL
+    );
+    bind_function (env, "elfuse--memory-get", fun);
+
+    fun = env->make_function (
+        env, 2, 2,
+        Felfuse_memory_list,
+        "Return the entries of the directory PATH of a memory MOUNT, (NAME TYPE SIZE) lists. ",
+        NULL
+    );
+    bind_function (env, "elfuse--memory-list", fun);
+
+    fun = env->make_function (
+        env, 2, 2,
+        Felfuse_memory_delete,
+        "Remove PATH, and everything below it, from a memory MOUNT. ",
+        NULL
+    );
+    bind_function (env, "elfuse--memory-delete", fun);
+
+    fun = env->make_function (
+        env, 2, 2,
+        Felfuse_set_option,
+        "Set an Elfuse OPTION to VALUE, effective from the next mount.\n"
+        "The `log-level' option applies at once. ",
+        NULL
+    );
+    bind_function (env, "elfuse--set-option", fun);
+
+    fun = env->make_function (
+        env, 3, 3,
+        Felfuse_register_op,
+        "Make FUNCTION the handler of OP of MOUNT, OP is a symbol like `getattr'.\n"
+        "A nil FUNCTION unregisters the handler. ",
+        NULL
+    );
+    bind_function (env, "elfuse--register-op", fun);
+
+    fun = env->make_function (
+        env, 3, 3,
+        Felfuse_route,
+        "Send requests below PREFIX of MOUNT to HANDLERS, an alist of ops and functions.\n"
+        "The handlers see paths relative to PREFIX. ",
+        NULL
+    );
+    bind_function (env, "elfuse--route", fun);
+
+    fun = env->make_function (
+        env, 2, 2,
+        Felfuse_unroute,
+        "Forget the handlers of PREFIX of MOUNT. ",
+        NULL
+    );
+    bind_function (env, "elfuse--unroute", fun);
+
+    fun = env->make_function (
+        env, 2, 2,
+        Felfuse_invalidate_attr,
+        "Forget the cached attributes of PATH in MOUNT. ",
+        NULL
+    );
+    bind_function (env, "elfuse--invalidate-attr", fun);
+
+    fun = env->make_function (
+        env, 2, 2,
+        Felfuse_invalidate_content,
+        "Forget the cached contents of PATH in MOUNT, or of every file below it. ",
+        NULL
+    );
+    bind_function (env, "elfuse--invalidate-content", fun);
+
+    fun = env->make_function (
+        env, 1, 1,
+        Felfuse_invalidate_all,
+        "Forget everything cached about the file system of MOUNT. ",
+        NULL
+    );
+    bind_function (env, "elfuse--invalidate-all", fun);
+
+    fun = env->make_function (
+        env, 2, 2,
+        Felfuse_notify_changed,
+        "Make the kernel forget the attributes and contents of PATH in MOUNT. ",
+        NULL
+    );
+    bind_function (env, "elfuse--notify-changed", fun);
+
+    fun = env->make_function (
+        env, 2, 2,
+        Felfuse_notify_deleted,
+        "Make the kernel forget PATH ever existed in MOUNT. ",
+        NULL
+    );
+    bind_function (env, "elfuse--notify-deleted", fun);
+
     provide (env, "elfuse-module");
 
     return 0;
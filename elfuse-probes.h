@@ -0,0 +1,49 @@
+/* This file is part of Elfuse. */
+
+/* Elfuse is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or */
+/* (at your option) any later version. */
+
+/* Elfuse is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the */
+/* GNU General Public License for more details. */
+
+/* You should have received a copy of the GNU General Public License */
+/* along with Elfuse.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef ELFUSE_PROBES_H
+#define ELFUSE_PROBES_H
+
+/* USDT probes of provider "elfuse", built in when the Makefile finds
+ * sys/sdt.h. Untraced probes are a nop, list them with
+ * bpftrace -l 'usdt:./elfuse-module.so:*'.
+ *
+ *   enqueue(op, path, queue_length)       a FUSE thread queued a request
+ *   dequeue(op, path, queue_wait_ns)      Emacs took it off the queue
+ *   handler_start(op, path)               the Lisp handler is called
+ *   handler_end(op, path, response)       and returned (enum elfuse_response_state)
+ *   cache_hit(cache, path)                cache is "attr", "negative" or "block"
+ *   cache_miss(cache, path)
+ *   reply(op, path, result, bytes)        result is -errno on failure
+ *
+ * OP is an enum elfuse_request_state and PATH the one handlers see. */
+
+#ifdef ELFUSE_PROBES
+
+#include <sys/sdt.h>
+
+#define ELFUSE_PROBE2(name, a1, a2) DTRACE_PROBE2(elfuse, name, a1, a2)
+#define ELFUSE_PROBE3(name, a1, a2, a3) DTRACE_PROBE3(elfuse, name, a1, a2, a3)
+#define ELFUSE_PROBE4(name, a1, a2, a3, a4) DTRACE_PROBE4(elfuse, name, a1, a2, a3, a4)
+
+#else
+
+#define ELFUSE_PROBE2(name, a1, a2) do {} while (0)
+#define ELFUSE_PROBE3(name, a1, a2, a3) do {} while (0)
+#define ELFUSE_PROBE4(name, a1, a2, a3, a4) do {} while (0)
+
+#endif
+
+#endif //ELFUSE_PROBES_H
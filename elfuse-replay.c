@@ -0,0 +1,482 @@
+/* This file is part of Elfuse. */
+
+/* Elfuse is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or */
+/* (at your option) any later version. */
+
+/* Elfuse is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the */
+/* GNU General Public License for more details. */
+
+/* You should have received a copy of the GNU General Public License */
+/* along with Elfuse.  If not, see <http://www.gnu.org/licenses/>. */
+
+/* Re-issue the requests of an Elfuse trace (elfuse-trace-start) as
+ * syscalls against a mount:
+ *
+ *   elfuse-replay [-s SPEED] TRACE MOUNTPATH
+ *
+ * SPEED 1 (the default) keeps the original pace, 10 goes ten times faster
+ * and 0 doesn't wait at all. Every process of the trace gets a thread of
+ * its own replaying its requests at their recorded times, so requests of
+ * different processes overlap as they did. Files are opened per process. */
+
+#define _XOPEN_SOURCE 700
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "elfuse-trace.h"
+
+static const char *op_names[] = {
+    [TRACE_GETATTR] = "getattr",
+    [TRACE_READDIR] = "readdir",
+    [TRACE_OPEN] = "open",
+    [TRACE_CREATE] = "create",
+    [TRACE_READ] = "read",
+    [TRACE_WRITE] = "write",
+    [TRACE_TRUNCATE] = "truncate",
+    [TRACE_RELEASE] = "release",
+    [TRACE_RENAME] = "rename",
+    [TRACE_UNLINK] = "unlink",
+    [TRACE_FSYNC] = "fsync",
+};
+
+#define OP_MAX TRACE_FSYNC
+
+struct op_stats {
+    uint64_t count;
+    uint64_t errors;
+    uint64_t ns;
+};
+
+/* A file the trace opened and didn't release yet */
+struct open_file {
+    struct open_file *next;
+    uint32_t pid;
+    int fd;
+    /* One for open_files, one for each request using the descriptor */
+    int users;
+    char path[];
+};
+
+static struct open_file *open_files = NULL;
+static pthread_mutex_t open_files_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* A request read from the trace, with its paths under the mount */
+struct request {
+    struct elfuse_trace_record record;
+    char *path;
+    char *path2;
+};
+
+/* The requests of one process, replayed by a thread of their own */
+struct process {
+    uint32_t pid;
+    struct request *requests;
+    size_t length;
+    size_t capacity;
+
+    pthread_t thread;
+    double speed;
+    uint64_t start;
+    char *buffer;
+    size_t buffer_size;
+    struct op_stats stats[OP_MAX + 1];
+};
+
+static uint64_t
+now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + (uint64_t) now.tv_nsec;
+}
+
+/* The file PID opened at PATH, any process's if PID has none (the kernel
+ * doesn't tell who releases files). Needs open_files_lock. */
+static struct open_file **
+find_file(uint32_t pid, const char *path)
+{
+    struct open_file **any = NULL;
+    for (struct open_file **link = &open_files; *link != NULL; link = &(*link)->next) {
+        if (strcmp((*link)->path, path) != 0)
+            continue;
+        if ((*link)->pid == pid)
+            return link;
+        if (any == NULL)
+            any = link;
+    }
+    return any;
+}
+
+static int
+add_file(uint32_t pid, const char *path, int fd)
+{
+    struct open_file *file = malloc(sizeof(*file) + strlen(path) + 1);
+    if (file == NULL) {
+        close(fd);
+        return -1;
+    }
+    file->pid = pid;
+    file->fd = fd;
+    file->users = 1;
+    strcpy(file->path, path);
+
+    pthread_mutex_lock(&open_files_lock);
+    file->next = open_files;
+    open_files = file;
+    pthread_mutex_unlock(&open_files_lock);
+    return 0;
+}
+
+/* Take the file PID opened at PATH, it stays open until put_file even if
+ * another process releases it meanwhile */
+static struct open_file *
+get_file(uint32_t pid, const char *path)
+{
+    pthread_mutex_lock(&open_files_lock);
+    struct open_file **link = find_file(pid, path);
+    struct open_file *file = link != NULL ? *link : NULL;
+    if (file != NULL)
+        file->users++;
+    pthread_mutex_unlock(&open_files_lock);
+    return file;
+}
+
+static int
+put_file(struct open_file *file)
+{
+    pthread_mutex_lock(&open_files_lock);
+    bool last = --file->users == 0;
+    pthread_mutex_unlock(&open_files_lock);
+    if (!last)
+        return 0;
+
+    int res = close(file->fd);
+    free(file);
+    return res;
+}
+
+/* A file for reading or writing PATH, opened on the fly if the trace
+ * started before the file was opened */
+static struct open_file *
+file_for_io(uint32_t pid, const char *path, int flags)
+{
+    struct open_file *file = get_file(pid, path);
+    if (file != NULL)
+        return file;
+
+    int fd = open(path, flags);
+    if (fd < 0 || add_file(pid, path, fd) != 0)
+        return NULL;
+    return get_file(pid, path);
+}
+
+static int
+replay(struct process *process, const struct request *request)
+{
+    const struct elfuse_trace_record *record = &request->record;
+    const char *path = request->path;
+
+    if ((record->op == TRACE_READ || record->op == TRACE_WRITE) && record->size > process->buffer_size) {
+        char *grown = realloc(process->buffer, record->size);
+        if (grown == NULL)
+            return -1;
+        memset(grown, 0, record->size);
+        process->buffer = grown;
+        process->buffer_size = record->size;
+    }
+
+    int fd;
+    int res;
+    struct stat st;
+    struct open_file *file;
+    switch (record->op) {
+    case TRACE_GETATTR:
+        return lstat(path, &st);
+    case TRACE_READDIR: {
+        DIR *dir = opendir(path);
+        if (dir == NULL)
+            return -1;
+        while (readdir(dir) != NULL)
+            ;
+        return closedir(dir);
+    }
+    case TRACE_OPEN:
+    case TRACE_CREATE: {
+        int flags = record->offset & ~(O_CREAT | O_EXCL);
+        if (record->op == TRACE_CREATE)
+            flags |= O_CREAT;
+        fd = open(path, flags, 0644);
+        if (fd < 0)
+            return -1;
+        return add_file(record->pid, path, fd);
+    }
+    case TRACE_READ:
+    case TRACE_WRITE:
+        file = file_for_io(record->pid, path, record->op == TRACE_READ ? O_RDONLY : O_WRONLY);
+        if (file == NULL)
+            return -1;
+        if (record->op == TRACE_READ)
+            res = pread(file->fd, process->buffer, record->size, record->offset) < 0 ? -1 : 0;
+        else
+            res = pwrite(file->fd, process->buffer, record->size, record->offset) < 0 ? -1 : 0;
+        put_file(file);
+        return res;
+    case TRACE_FSYNC:
+        file = get_file(record->pid, path);
+        if (file == NULL)
+            return 0;
+        res = fsync(file->fd);
+        put_file(file);
+        return res;
+    case TRACE_RELEASE: {
+        pthread_mutex_lock(&open_files_lock);
+        struct open_file **link = find_file(record->pid, path);
+        file = link != NULL ? *link : NULL;
+        if (file != NULL)
+            *link = file->next;
+        pthread_mutex_unlock(&open_files_lock);
+        return file != NULL ? put_file(file) : 0;
+    }
+    case TRACE_TRUNCATE:
+        return truncate(path, record->size);
+    case TRACE_RENAME:
+        return rename(path, request->path2);
+    case TRACE_UNLINK:
+        return unlink(path);
+    default:
+        errno = EINVAL;
+        return -1;
+    }
+}
+
+static void *
+replay_process(void *data)
+{
+    struct process *process = data;
+
+    for (size_t i = 0; i < process->length; i++) {
+        const struct request *request = &process->requests[i];
+        const struct elfuse_trace_record *record = &request->record;
+
+        if (process->speed > 0) {
+            uint64_t due = process->start + (uint64_t) (record->time_ns / process->speed);
+            uint64_t now = now_ns();
+            if (due > now) {
+                struct timespec delay = {
+                    .tv_sec = (due - now) / 1000000000,
+                    .tv_nsec = (due - now) % 1000000000,
+                };
+                nanosleep(&delay, NULL);
+            }
+        }
+
+        uint64_t before = now_ns();
+        int res = replay(process, request);
+        if (record->op >= 1 && record->op <= OP_MAX) {
+            process->stats[record->op].count++;
+            process->stats[record->op].ns += now_ns() - before;
+            if (res != 0)
+                process->stats[record->op].errors++;
+        }
+    }
+
+    return NULL;
+}
+
+/* The process PID in PROCESSES, added if it is not there yet */
+static struct process *
+find_process(struct process **processes, size_t *length, size_t *capacity, uint32_t pid)
+{
+    for (size_t i = 0; i < *length; i++) {
+        if ((*processes)[i].pid == pid)
+            return &(*processes)[i];
+    }
+
+    if (*length == *capacity) {
+        size_t grown_capacity = *capacity > 0 ? *capacity * 2 : 16;
+        struct process *grown = realloc(*processes, grown_capacity * sizeof(*grown));
+        if (grown == NULL)
+            return NULL;
+        *processes = grown;
+        *capacity = grown_capacity;
+    }
+    struct process *process = &(*processes)[(*length)++];
+    memset(process, 0, sizeof(*process));
+    process->pid = pid;
+    return process;
+}
+
+static bool
+add_request(struct process *process, const struct request *request)
+{
+    if (process->length == process->capacity) {
+        size_t capacity = process->capacity > 0 ? process->capacity * 2 : 64;
+        struct request *grown = realloc(process->requests, capacity * sizeof(*grown));
+        if (grown == NULL)
+            return false;
+        process->requests = grown;
+        process->capacity = capacity;
+    }
+    process->requests[process->length++] = *request;
+    return true;
+}
+
+/* Read a path of LENGTH bytes following a record and prefix it with the
+ * mount path */
+static char *
+read_path(FILE *trace, const char *mountpath, size_t length)
+{
+    size_t prefix = strlen(mountpath);
+    char *path = malloc(prefix + length + 1);
+    if (path == NULL)
+        return NULL;
+    memcpy(path, mountpath, prefix);
+    if (length > 0 && fread(path + prefix, length, 1, trace) != 1) {
+        free(path);
+        return NULL;
+    }
+    path[prefix + length] = '\0';
+    return path;
+}
+
+static void
+usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [-s SPEED] TRACE MOUNTPATH\n", program);
+}
+
+int
+main(int argc, char *argv[])
+{
+    double speed = 1;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:h")) != -1) {
+        switch (opt) {
+        case 's':
+            speed = atof(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 2;
+        }
+    }
+    if (argc - optind != 2 || speed < 0) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    FILE *trace = fopen(argv[optind], "rb");
+    if (trace == NULL) {
+        perror(argv[optind]);
+        return 1;
+    }
+    char magic[ELFUSE_TRACE_MAGIC_SIZE];
+    if (fread(magic, sizeof(magic), 1, trace) != 1
+        || memcmp(magic, ELFUSE_TRACE_MAGIC, ELFUSE_TRACE_MAGIC_SIZE) != 0) {
+        fprintf(stderr, "%s: not an Elfuse trace\n", argv[optind]);
+        return 1;
+    }
+
+    /* Trace paths start with a slash */
+    char *mountpath = strdup(argv[optind + 1]);
+    size_t mountpath_length = strlen(mountpath);
+    while (mountpath_length > 0 && mountpath[mountpath_length - 1] == '/')
+        mountpath[--mountpath_length] = '\0';
+
+    /* The whole trace up front, reading it must not hold up the replay */
+    struct process *processes = NULL;
+    size_t processes_length = 0;
+    size_t processes_capacity = 0;
+    struct request request;
+    while (fread(&request.record, sizeof(request.record), 1, trace) == 1) {
+        request.path = read_path(trace, mountpath, request.record.path_length);
+        request.path2 = NULL;
+        if (request.path != NULL && request.record.path2_length > 0)
+            request.path2 = read_path(trace, mountpath, request.record.path2_length);
+        if (request.path == NULL || (request.record.path2_length > 0 && request.path2 == NULL)) {
+            fprintf(stderr, "%s: truncated trace\n", argv[optind]);
+            free(request.path);
+            break;
+        }
+
+        struct process *process = find_process(&processes, &processes_length, &processes_capacity,
+                                               request.record.pid);
+        if (process == NULL || !add_request(process, &request)) {
+            fprintf(stderr, "%s: out of memory\n", argv[optind]);
+            free(request.path);
+            free(request.path2);
+            break;
+        }
+    }
+
+    uint64_t start = now_ns();
+    size_t started = 0;
+    for (; started < processes_length; started++) {
+        struct process *process = &processes[started];
+        process->speed = speed;
+        process->start = start;
+        int res = pthread_create(&process->thread, NULL, replay_process, process);
+        if (res != 0) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(res));
+            break;
+        }
+    }
+
+    struct op_stats stats[OP_MAX + 1] = {0};
+    for (size_t i = 0; i < started; i++) {
+        struct process *process = &processes[i];
+        pthread_join(process->thread, NULL);
+        for (int op = 1; op <= OP_MAX; op++) {
+            stats[op].count += process->stats[op].count;
+            stats[op].errors += process->stats[op].errors;
+            stats[op].ns += process->stats[op].ns;
+        }
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+
+    printf("%-10s %10s %10s %12s\n", "op", "count", "errors", "mean (us)");
+    for (int op = 1; op <= OP_MAX; op++) {
+        if (stats[op].count == 0)
+            continue;
+        printf("%-10s %10" PRIu64 " %10" PRIu64 " %12.1f\n", op_names[op], stats[op].count,
+               stats[op].errors, stats[op].ns / 1e3 / stats[op].count);
+    }
+    printf("replayed %zu processes in %.3fs\n", processes_length, elapsed);
+
+    for (size_t i = 0; i < processes_length; i++) {
+        struct process *process = &processes[i];
+        for (size_t j = 0; j < process->length; j++) {
+            free(process->requests[j].path);
+            free(process->requests[j].path2);
+        }
+        free(process->requests);
+        free(process->buffer);
+    }
+    free(processes);
+
+    while (open_files != NULL) {
+        struct open_file *file = open_files;
+        open_files = file->next;
+        put_file(file);
+    }
+    free(mountpath);
+    fclose(trace);
+    return 0;
+}
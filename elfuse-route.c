@@ -0,0 +1,261 @@
+/* This file is part of Elfuse. */
+
+/* Elfuse is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or */
+/* (at your option) any later version. */
+
+/* Elfuse is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the */
+/* GNU General Public License for more details. */
+
+/* You should have received a copy of the GNU General Public License */
+/* along with Elfuse.  If not, see <http://www.gnu.org/licenses/>. */
+
+#define _XOPEN_SOURCE 700
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "elfuse-route.h"
+
+struct elfuse_route_node {
+    struct elfuse_route_node *children;
+    struct elfuse_route_node *sibling;
+
+    /* -1 unless a route starts here */
+    int id;
+    uint32_t ops;
+
+    /* Number of routes in the subtree, this node excluded */
+    size_t routes_below;
+
+    size_t name_length;
+    char name[];
+};
+
+static struct elfuse_route_node *
+node_new(const char *name, size_t name_length)
+{
+    struct elfuse_route_node *node = calloc(1, sizeof(*node) + name_length + 1);
+    if (node == NULL)
+        return NULL;
+    node->id = -1;
+    node->name_length = name_length;
+    memcpy(node->name, name, name_length);
+    return node;
+}
+
+static void
+node_free(struct elfuse_route_node *node)
+{
+    while (node != NULL) {
+        struct elfuse_route_node *sibling = node->sibling;
+        node_free(node->children);
+        free(node);
+        node = sibling;
+    }
+}
+
+static bool
+node_routed(const struct elfuse_route_node *node)
+{
+    return node->id >= 0 && node->ops != 0;
+}
+
+static struct elfuse_route_node *
+node_child(struct elfuse_route_node *node, const char *name, size_t name_length)
+{
+    for (struct elfuse_route_node *child = node->children; child; child = child->sibling) {
+        if (child->name_length == name_length && memcmp(child->name, name, name_length) == 0)
+            return child;
+    }
+    return NULL;
+}
+
+/* Next component of *PATH, skipping extra slashes. Return its length, 0 at
+ * the end of the path. */
+static size_t
+next_component(const char **path)
+{
+    while (**path == '/')
+        (*path)++;
+    return strcspn(*path, "/");
+}
+
+bool
+elfuse_routes_init(struct elfuse_routes *routes)
+{
+    routes->root = node_new("", 0);
+    if (routes->root == NULL)
+        return false;
+    pthread_rwlock_init(&routes->lock, NULL);
+    return true;
+}
+
+void
+elfuse_routes_destroy(struct elfuse_routes *routes)
+{
+    node_free(routes->root);
+    routes->root = NULL;
+    pthread_rwlock_destroy(&routes->lock);
+}
+
+/* Nodes are never freed before the trie itself, an unset route leaves its
+ * (small) path behind */
+static void
+count_routes(struct elfuse_routes *routes, const char *prefix, long delta)
+{
+    struct elfuse_route_node *node = routes->root;
+    size_t length;
+    while (node != NULL && (length = next_component(&prefix)) > 0) {
+        node->routes_below += delta;
+        node = node_child(node, prefix, length);
+        prefix += length;
+    }
+}
+
+bool
+elfuse_routes_set(struct elfuse_routes *routes, const char *prefix, int id, uint32_t ops)
+{
+    pthread_rwlock_wrlock(&routes->lock);
+
+    struct elfuse_route_node *node = routes->root;
+    const char *rest = prefix;
+    size_t length;
+    while ((length = next_component(&rest)) > 0) {
+        struct elfuse_route_node *child = node_child(node, rest, length);
+        if (child == NULL) {
+            child = node_new(rest, length);
+            if (child == NULL) {
+                pthread_rwlock_unlock(&routes->lock);
+                return false;
+            }
+            child->sibling = node->children;
+            node->children = child;
+        }
+        node = child;
+        rest += length;
+    }
+
+    bool was_routed = node_routed(node);
+    node->id = id;
+    node->ops = ops;
+    if (node_routed(node) != was_routed)
+        count_routes(routes, prefix, was_routed ? -1 : 1);
+
+    pthread_rwlock_unlock(&routes->lock);
+    return true;
+}
+
+void
+elfuse_routes_unset(struct elfuse_routes *routes, const char *prefix)
+{
+    pthread_rwlock_wrlock(&routes->lock);
+
+    struct elfuse_route_node *node = routes->root;
+    const char *rest = prefix;
+    size_t length;
+    while (node != NULL && (length = next_component(&rest)) > 0) {
+        node = node_child(node, rest, length);
+        rest += length;
+    }
+
+    if (node != NULL) {
+        if (node_routed(node))
+            count_routes(routes, prefix, -1);
+        node->id = -1;
+        node->ops = 0;
+    }
+
+    pthread_rwlock_unlock(&routes->lock);
+}
+
+enum elfuse_route_match
+elfuse_routes_match(struct elfuse_routes *routes, const char *path,
+                    int *id, uint32_t *ops, const char **relative)
+{
+    pthread_rwlock_rdlock(&routes->lock);
+
+    struct elfuse_route_node *node = routes->root;
+    struct elfuse_route_node *found = node_routed(node) ? node : NULL;
+    const char *found_rest = path;
+    const char *rest = path;
+    size_t length;
+    while (node != NULL && (length = next_component(&rest)) > 0) {
+        node = node_child(node, rest, length);
+        rest += length;
+        if (node != NULL && node_routed(node)) {
+            found = node;
+            found_rest = rest;
+        }
+    }
+
+    enum elfuse_route_match match = ROUTE_NONE;
+    if (found != NULL) {
+        *id = found->id;
+        *ops = found->ops;
+        *relative = *found_rest != '\0' ? found_rest : "/";
+        match = ROUTE_FOUND;
+    } else if (node != NULL && (node->routes_below > 0 || node == routes->root)) {
+        match = ROUTE_INNER;
+    }
+
+    pthread_rwlock_unlock(&routes->lock);
+    return match;
+}
+
+char **
+elfuse_routes_children(struct elfuse_routes *routes, const char *path)
+{
+    pthread_rwlock_rdlock(&routes->lock);
+
+    struct elfuse_route_node *node = routes->root;
+    size_t length;
+    while (node != NULL && (length = next_component(&path)) > 0) {
+        node = node_child(node, path, length);
+        path += length;
+    }
+
+    char **children = NULL;
+    size_t count = 0;
+    if (node != NULL) {
+        for (struct elfuse_route_node *child = node->children; child; child = child->sibling) {
+            if (node_routed(child) || child->routes_below > 0)
+                count++;
+        }
+    }
+    if (count > 0)
+        children = calloc(count + 1, sizeof(children[0]));
+    if (children != NULL) {
+        size_t i = 0;
+        for (struct elfuse_route_node *child = node->children; child; child = child->sibling) {
+            if (!node_routed(child) && child->routes_below == 0)
+                continue;
+            children[i] = strdup(child->name);
+            if (children[i] == NULL) {
+                elfuse_routes_free_children(children);
+                children = NULL;
+                break;
+            }
+            i++;
+        }
+    }
+
+    pthread_rwlock_unlock(&routes->lock);
+    return children;
+}
+
+void
+elfuse_routes_free_children(char **children)
+{
+    if (children == NULL)
+        return;
+    for (char **child = children; *child != NULL; child++)
+        free(*child);
+    free(children);
+}
@@ -0,0 +1,71 @@
+/* This file is part of Elfuse. */
+
+/* Elfuse is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or */
+/* (at your option) any later version. */
+
+/* Elfuse is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the */
+/* GNU General Public License for more details. */
+
+/* You should have received a copy of the GNU General Public License */
+/* along with Elfuse.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef ELFUSE_ROUTE_H
+#define ELFUSE_ROUTE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* A thread-safe trie of path components mapping subtrees to route ids.
+ * Every route carries a bitmask of the ops it handles. Paths below no
+ * route, but above some, are synthetic directories. */
+struct elfuse_route_node;
+
+struct elfuse_routes {
+    pthread_rwlock_t lock;
+    struct elfuse_route_node *root;
+};
+
+enum elfuse_route_match {
+    /* Nothing is routed at or above the path */
+    ROUTE_NONE,
+    /* The path is below a route */
+    ROUTE_FOUND,
+    /* Nothing is routed above the path, but something is below it */
+    ROUTE_INNER,
+};
+
+bool
+elfuse_routes_init(struct elfuse_routes *routes);
+
+void
+elfuse_routes_destroy(struct elfuse_routes *routes);
+
+/* Route the PREFIX subtree, e.g. "/org", to ID. Routes with no OPS don't
+ * count, see elfuse_routes_match. */
+bool
+elfuse_routes_set(struct elfuse_routes *routes, const char *prefix, int id, uint32_t ops);
+
+void
+elfuse_routes_unset(struct elfuse_routes *routes, const char *prefix);
+
+/* Find the longest routed prefix of PATH, store its id and ops and point
+ * RELATIVE to the rest of PATH ("/" for the prefix itself) */
+enum elfuse_route_match
+elfuse_routes_match(struct elfuse_routes *routes, const char *path,
+                    int *id, uint32_t *ops, const char **relative);
+
+/* Names of the components below PATH leading to routes, NULL-terminated.
+ * NULL if there are none or out of memory, free with elfuse_routes_free_children. */
+char **
+elfuse_routes_children(struct elfuse_routes *routes, const char *path);
+
+void
+elfuse_routes_free_children(char **children);
+
+#endif //ELFUSE_ROUTE_H
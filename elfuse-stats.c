@@ -0,0 +1,80 @@
+/* This file is part of Elfuse. */
+
+/* Elfuse is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or */
+/* (at your option) any later version. */
+
+/* Elfuse is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the */
+/* GNU General Public License for more details. */
+
+/* You should have received a copy of the GNU General Public License */
+/* along with Elfuse.  If not, see <http://www.gnu.org/licenses/>. */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "elfuse-stats.h"
+
+uint64_t
+elfuse_stats_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + (uint64_t) now.tv_nsec;
+}
+
+static void
+elfuse_stats_add(struct elfuse_stats_histogram *histogram, uint64_t from, uint64_t to)
+{
+    uint64_t ns = to > from ? to - from : 0;
+    uint64_t us = ns / 1000;
+    int bucket = us > 1 ? 63 - __builtin_clzll(us) : 0;
+    if (bucket >= ELFUSE_STATS_BUCKETS)
+        bucket = ELFUSE_STATS_BUCKETS - 1;
+
+    atomic_fetch_add_explicit(&histogram->sum_ns, ns, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->buckets[bucket], 1, memory_order_relaxed);
+}
+
+void
+elfuse_stats_record(struct elfuse_stats *stats, const struct elfuse_call_state *call,
+                    int res, uint64_t bytes)
+{
+    struct elfuse_stats_op *op = &stats->ops[call->request_state];
+    uint64_t replied = elfuse_stats_now();
+
+    /* Requests failed before Emacs saw them spent no time in Lisp */
+    uint64_t dequeued = call->dequeued_ns != 0 ? call->dequeued_ns : replied;
+    uint64_t handled = call->handled_ns != 0 ? call->handled_ns : dequeued;
+
+    atomic_fetch_add_explicit(&op->count, 1, memory_order_relaxed);
+    if (res < 0)
+        atomic_fetch_add_explicit(&op->errors, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&op->bytes, bytes, memory_order_relaxed);
+
+    elfuse_stats_add(&op->latency[LATENCY_QUEUE], call->received_ns, dequeued);
+    elfuse_stats_add(&op->latency[LATENCY_LISP], dequeued, handled);
+    elfuse_stats_add(&op->latency[LATENCY_TOTAL], call->received_ns, replied);
+}
+
+void
+elfuse_stats_reset(struct elfuse_stats *stats)
+{
+    for (size_t i = 0; i < sizeof(stats->ops) / sizeof(stats->ops[0]); i++) {
+        struct elfuse_stats_op *op = &stats->ops[i];
+        atomic_store_explicit(&op->count, 0, memory_order_relaxed);
+        atomic_store_explicit(&op->errors, 0, memory_order_relaxed);
+        atomic_store_explicit(&op->bytes, 0, memory_order_relaxed);
+        for (int latency = 0; latency < LATENCY_COUNT; latency++) {
+            atomic_store_explicit(&op->latency[latency].sum_ns, 0, memory_order_relaxed);
+            for (int bucket = 0; bucket < ELFUSE_STATS_BUCKETS; bucket++)
+                atomic_store_explicit(&op->latency[latency].buckets[bucket], 0, memory_order_relaxed);
+        }
+    }
+}
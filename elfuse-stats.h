@@ -0,0 +1,72 @@
+/* This file is part of Elfuse. */
+
+/* Elfuse is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or */
+/* (at your option) any later version. */
+
+/* Elfuse is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the */
+/* GNU General Public License for more details. */
+
+/* You should have received a copy of the GNU General Public License */
+/* along with Elfuse.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef ELFUSE_STATS_H
+#define ELFUSE_STATS_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "elfuse-fuse.h"
+
+/* Latency histograms have a bucket per power of two microseconds, bucket I
+ * counting latencies in [2^I, 2^(I+1)) (the first one below 2us too, the
+ * last one everything longer) */
+#define ELFUSE_STATS_BUCKETS 32
+
+enum elfuse_stats_latency {
+    /* From FUSE receipt until Emacs dequeues the request */
+    LATENCY_QUEUE,
+    /* Running the Lisp handler */
+    LATENCY_LISP,
+    /* From FUSE receipt until the reply */
+    LATENCY_TOTAL,
+    LATENCY_COUNT,
+};
+
+struct elfuse_stats_histogram {
+    atomic_uint_fast64_t sum_ns;
+    atomic_uint_fast64_t buckets[ELFUSE_STATS_BUCKETS];
+};
+
+/* Requests of one type that went to Emacs */
+struct elfuse_stats_op {
+    atomic_uint_fast64_t count;
+    atomic_uint_fast64_t errors;
+    atomic_uint_fast64_t bytes;
+    struct elfuse_stats_histogram latency[LATENCY_COUNT];
+};
+
+/* Counters of a mount by request type, updated by FUSE threads without
+ * locking. A zero-filled struct is ready to use. */
+struct elfuse_stats {
+    struct elfuse_stats_op ops[WAITING_UNLINK + 1];
+};
+
+/* Monotonic clock in nanoseconds */
+uint64_t
+elfuse_stats_now(void);
+
+/* Account for a replied request, RES is the reply (-errno on failure) and
+ * BYTES the amount of data read or written */
+void
+elfuse_stats_record(struct elfuse_stats *stats, const struct elfuse_call_state *call,
+                    int res, uint64_t bytes);
+
+void
+elfuse_stats_reset(struct elfuse_stats *stats);
+
+#endif //ELFUSE_STATS_H
@@ -0,0 +1,96 @@
+/* This file is part of Elfuse. */
+
+/* Elfuse is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or */
+/* (at your option) any later version. */
+
+/* Elfuse is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the */
+/* GNU General Public License for more details. */
+
+/* You should have received a copy of the GNU General Public License */
+/* along with Elfuse.  If not, see <http://www.gnu.org/licenses/>. */
+
+#define _XOPEN_SOURCE 700
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "elfuse-stats.h"
+#include "elfuse-trace.h"
+
+void
+elfuse_trace_init(struct elfuse_trace *trace)
+{
+    pthread_mutex_init(&trace->lock, NULL);
+    trace->file = NULL;
+    atomic_init(&trace->active, false);
+}
+
+void
+elfuse_trace_destroy(struct elfuse_trace *trace)
+{
+    elfuse_trace_open(trace, NULL);
+    pthread_mutex_destroy(&trace->lock);
+}
+
+bool
+elfuse_trace_open(struct elfuse_trace *trace, const char *filename)
+{
+    FILE *file = NULL;
+    if (filename != NULL) {
+        file = fopen(filename, "wb");
+        if (file == NULL)
+            return false;
+        if (fwrite(ELFUSE_TRACE_MAGIC, ELFUSE_TRACE_MAGIC_SIZE, 1, file) != 1) {
+            fclose(file);
+            return false;
+        }
+    }
+
+    pthread_mutex_lock(&trace->lock);
+    FILE *previous = trace->file;
+    trace->file = file;
+    trace->start_ns = elfuse_stats_now();
+    atomic_store(&trace->active, file != NULL);
+    pthread_mutex_unlock(&trace->lock);
+
+    if (previous != NULL)
+        fclose(previous);
+    return true;
+}
+
+void
+elfuse_trace_write(struct elfuse_trace *trace, enum elfuse_trace_op op, uint32_t pid,
+                   const char *path, const char *path2, uint64_t offset, uint64_t size)
+{
+    size_t path_length = strlen(path);
+    size_t path2_length = path2 != NULL ? strlen(path2) : 0;
+    if (path_length > UINT16_MAX || path2_length > UINT16_MAX)
+        return;
+
+    struct elfuse_trace_record record = {
+        .offset = offset,
+        .size = size,
+        .pid = pid,
+        .op = op,
+        .path_length = path_length,
+        .path2_length = path2_length,
+    };
+
+    pthread_mutex_lock(&trace->lock);
+    if (trace->file != NULL) {
+        record.time_ns = elfuse_stats_now() - trace->start_ns;
+        fwrite(&record, sizeof(record), 1, trace->file);
+        fwrite(path, 1, path_length, trace->file);
+        if (path2_length > 0)
+            fwrite(path2, 1, path2_length, trace->file);
+    }
+    pthread_mutex_unlock(&trace->lock);
+}
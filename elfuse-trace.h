@@ -0,0 +1,87 @@
+/* This file is part of Elfuse. */
+
+/* Elfuse is free software: you can redistribute it and/or modify */
+/* it under the terms of the GNU General Public License as published by */
+/* the Free Software Foundation, either version 3 of the License, or */
+/* (at your option) any later version. */
+
+/* Elfuse is distributed in the hope that it will be useful, */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the */
+/* GNU General Public License for more details. */
+
+/* You should have received a copy of the GNU General Public License */
+/* along with Elfuse.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef ELFUSE_TRACE_H
+#define ELFUSE_TRACE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* A trace is a file starting with ELFUSE_TRACE_MAGIC, followed by records,
+ * each followed by its paths. Integers are in host byte order. No file
+ * contents are recorded, elfuse-replay writes zeros. */
+#define ELFUSE_TRACE_MAGIC "ELFTRC01"
+#define ELFUSE_TRACE_MAGIC_SIZE 8
+
+/* Stable numbering, part of the file format */
+enum elfuse_trace_op {
+    TRACE_GETATTR = 1,
+    TRACE_READDIR,
+    TRACE_OPEN,
+    TRACE_CREATE,
+    TRACE_READ,
+    TRACE_WRITE,
+    TRACE_TRUNCATE,
+    TRACE_RELEASE,
+    TRACE_RENAME,
+    TRACE_UNLINK,
+    TRACE_FSYNC,
+};
+
+struct elfuse_trace_record {
+    /* Nanoseconds since the trace started */
+    uint64_t time_ns;
+    /* Read and write offset, open(2) flags of opens and creates */
+    uint64_t offset;
+    /* Read, write and truncate size */
+    uint64_t size;
+    /* Process that made the syscall, 0 if the kernel doesn't say (release) */
+    uint32_t pid;
+    uint16_t op;
+    /* Bytes of the path following the record, and of the new path of a
+     * rename following that */
+    uint16_t path_length;
+    uint16_t path2_length;
+    uint16_t reserved[3];
+};
+
+/* Records FUSE requests of a mount, FUSE threads write under the lock */
+struct elfuse_trace {
+    pthread_mutex_t lock;
+    FILE *file;
+    uint64_t start_ns;
+    atomic_bool active;
+};
+
+void
+elfuse_trace_init(struct elfuse_trace *trace);
+
+void
+elfuse_trace_destroy(struct elfuse_trace *trace);
+
+/* Start recording to FILENAME (truncated) or, if NULL, stop. Return false
+ * if the file can't be written. */
+bool
+elfuse_trace_open(struct elfuse_trace *trace, const char *filename);
+
+/* Append a request, PATH2 is NULL unless it's a rename */
+void
+elfuse_trace_write(struct elfuse_trace *trace, enum elfuse_trace_op op, uint32_t pid,
+                   const char *path, const char *path2, uint64_t offset, uint64_t size);
+
+#endif //ELFUSE_TRACE_H
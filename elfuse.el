@@ -21,6 +21,7 @@
 
 (defconst elfuse-EPERM 1 "errno: operation not permitted")
 (defconst elfuse-ENOENT 2 "errno: no such file or directory")
+(defconst elfuse-EIO 5 "errno: input/output error")
 (defconst elfuse-EACCESS 13 "errno: permission denied")
 (defconst elfuse-EBUSY 16 "errno: block device required")
 (defconst elfuse-EEXIST 17 "errno: file exists")
@@ -32,14 +33,135 @@
 (defconst elfuse-ENOTEMPTY 39 "errno: directory not empty")
 
 (defvar elfuse-time-between-checks 0.01
-  "Time interval in seconds between Elfuse request checks.")
+  "Time interval in seconds between Elfuse request checks.
+Only used when the FUSE threads cannot wake Emacs up through a
+pipe process, i.e. before Emacs 28.")
+
+(defvar elfuse-check-ops-budget 0.005
+  "Time in seconds Emacs may spend answering queued requests in one go.
+Once it runs out, or there is user input pending, the rest of the
+queue is answered on the next iteration of the command loop.")
+
+(defvar elfuse-fuse-threads 4
+  "Number of threads receiving FUSE requests, from 1 to 64.
+Requests that do not need Emacs are answered in parallel, the
+rest wait for the main thread in a queue.")
+
+(defvar elfuse-max-deferred 64
+  "Largest number of requests of a mount awaiting `elfuse-reply'.
+Each one keeps a thread waiting, another one receives requests in
+its place meanwhile.  Past the limit `elfuse-defer' returns nil.")
+
+(defvar elfuse-attr-cache-ttl 0
+  "Seconds the results of the getattr op are cached for.
+A getattr handler may override it for a single path by returning a
+TTL as the third element of its result vector, e.g. [file 42 10].
+Zero, the default, disables the cache.  Use `elfuse-invalidate-attr' and
+`elfuse-invalidate-all' when paths change behind Elfuse's back.")
+
+(defvar elfuse-attr-cache-size 65536
+  "Maximum number of paths the getattr cache holds.")
+
+(defvar elfuse-negative-cache-ttl 0
+  "Seconds a path the getattr op failed with ENOENT for is cached as missing.
+Creating or renaming a file through the mount forgets it right away.
+Zero, the default, disables the cache.")
+
+(defvar elfuse-negative-cache-size 4096
+  "Maximum number of missing paths Elfuse remembers.")
+
+(defvar elfuse-read-cache-ttl 0
+  "Seconds the data returned by the read op is cached for.
+Zero, the default, disables the cache.  Use `elfuse-invalidate-content' when
+files change behind Elfuse's back.")
+
+(defvar elfuse-read-cache-size (* 32 1024 1024)
+  "Maximum number of bytes of file contents Elfuse caches.")
+
+(defvar elfuse-readahead-max (* 1024 1024)
+  "Maximum number of bytes the read op is asked for ahead of time.
+Once a file is read sequentially, Elfuse asks the read op for
+windows doubling in size up to this limit and answers the
+following reads from them.  Zero disables readahead.")
+
+(defvar elfuse-write-back nil
+  "Non-nil to gather writes to a file before calling the write op.
+Contiguous writes are then handed to the write op at once when
+the file is closed or synced, or once `elfuse-write-back-size'
+bytes or `elfuse-write-back-age' seconds worth of them wait.
+Failed writes are reported by close(2), other processes may see
+the old contents until they are handed over.")
+
+(defvar elfuse-write-back-size (* 4 1024 1024)
+  "Bytes of buffered writes that make Elfuse call the write op.")
+
+(defvar elfuse-write-back-age 1.0
+  "Seconds buffered writes may wait for before they are handed to the write op.
+They are, whether or not the file is written to again.")
+
+(defvar elfuse-memory-max-size (* 256 1024 1024)
+  "Bytes of file contents a :memory mount may hold, Emacs's own memory.
+Writes and truncations past it fail with ENOSPC, or EFBIG for a
+single file larger than that.")
+
+(defvar elfuse-log-level 'warn
+  "Most verbose messages Elfuse prints to stderr.
+One of `error', `warn', `info' or `debug' (every request), nil
+disables logging.  Set it with `elfuse-set-log-level' to affect
+running mounts, it is applied by `elfuse-start' otherwise.
+Messages above the level the module was compiled with
+\(LOG_MAX_LEVEL) are never printed.")
+
+(defvar elfuse-mount-profiles
+  '((static :entry-timeout 60 :attr-timeout 60 :negative-timeout 60
+            :kernel-cache t :max-readahead 1048576 :async-read t)
+    (live-buffer :entry-timeout 1 :attr-timeout 1 :auto-cache t)
+    (write-heavy :entry-timeout 1 :attr-timeout 1 :auto-cache t
+                 :big-writes t :max-write 131072))
+  "Named sets of FUSE mount options for `elfuse-start'.
+`static' suits files that only change through the mount, the
+kernel then keeps lookups, attributes and file contents for a
+minute.  `live-buffer' suits files backed by buffers that change
+at any time, contents are re-read whenever their size or mtime
+changes.  `write-heavy' also lets the kernel send large writes.")
+
+(defvar elfuse-mount-options nil
+  "Default FUSE mount options for `elfuse-start', a plist.
+Supported options are :entry-timeout, :attr-timeout and
+:negative-timeout (seconds the kernel caches lookups, attributes
+and failed lookups for), :kernel-cache and :auto-cache (keep file
+contents between opens, unconditionally or as long as size and
+mtime do not change), :max-read, :max-readahead and :max-write
+(bytes), :big-writes and :async-read.  A :profile option picks
+one of `elfuse-mount-profiles', other options override it.
+:loopback mounts nothing, see `elfuse-loopback-bench'.  :memory
+serves files kept in memory by Elfuse itself instead of calling
+handlers, see `elfuse-memory-put'.
+
+Changes made behind the mount's back should be announced with
+`elfuse-notify-changed' and `elfuse-notify-deleted'.")
+
+(defvar elfuse--mounts nil
+  "Running mounts, a list of (PATH MOUNT HANDLERS).
+HANDLERS is the alist the mount was started with, nil if it uses
+the ops defined by `elfuse-define-op'.")
+
+(defvar elfuse--handlers nil
+  "An alist of ops and the handlers `elfuse-define-op' defined for them.")
 
 (defvar elfuse--check-timer nil
   "Timer calling the callback-responding function.")
 
+(defvar elfuse--wakeup-process nil
+  "Pipe process receiving a byte whenever Fuse queues requests.")
+
+(defvar elfuse--drain-timer nil
+  "Timer answering requests left over by the last `elfuse--drain'.")
+
 (defconst elfuse--supported-ops-alist '((create . 1)
                                         (rename . 2)
                                         (readdir . 1)
+                                        (readdir-page . 2)
                                         (getattr . 1)
                                         (open . 1)
                                         (release . 1)
@@ -49,31 +171,242 @@
                                         (unlink . 1))
   "An alist of Fuse operation name/arity pairs supported by Elfuse.")
 
-(defun elfuse-start (mountpath)
-  "Start Elfuse using a given MOUNTPATH."
+(defun elfuse-start (mountpath &optional options handlers)
+  "Start Elfuse using a given MOUNTPATH.
+OPTIONS is a plist of FUSE mount options, `elfuse-mount-options'
+by default.  HANDLERS is an alist of ops and the functions
+handling them, e.g. ((getattr . my-getattr) (read . my-read)),
+by default the ops defined with `elfuse-define-op'.  It may also
+route subtrees to handlers of their own, see `elfuse-route'.
+Several paths may be mounted at once, each with its own handlers
+and caches.  Return the mount, nil if mounting failed."
   (interactive "DElfuse mount path: ")
-  (if (elfuse--dir-mountable-p mountpath)
-      (let ((abspath (file-truename mountpath)))
-	(elfuse--start-loop)
-	(elfuse--mount abspath)
-        (add-hook 'kill-emacs-hook 'elfuse--stop))
-    (message "Elfuse: %s does not exist or is not empty." mountpath)))
-
-(defun elfuse-stop ()
-  "Stop Elfuse."
+  (let ((abspath (and (file-exists-p mountpath) (file-truename mountpath))))
+    (cond ((not (elfuse--dir-mountable-p mountpath))
+           (message "Elfuse: %s does not exist or is not empty." mountpath)
+           nil)
+          ((assoc abspath elfuse--mounts)
+           (message "Elfuse: %s is already mounted." mountpath)
+           nil)
+          (t
+           (let ((options (elfuse--mount-options (or options elfuse-mount-options)))
+                 (mount nil))
+             (unless elfuse--mounts
+               (elfuse--start-loop))
+             (elfuse--set-option 'attr-cache-ttl elfuse-attr-cache-ttl)
+             (elfuse--set-option 'attr-cache-size elfuse-attr-cache-size)
+             (elfuse--set-option 'negative-cache-ttl elfuse-negative-cache-ttl)
+             (elfuse--set-option 'negative-cache-size elfuse-negative-cache-size)
+             (elfuse--set-option 'read-cache-ttl elfuse-read-cache-ttl)
+             (elfuse--set-option 'read-cache-size elfuse-read-cache-size)
+             (elfuse--set-option 'readahead-max elfuse-readahead-max)
+             (elfuse--set-option 'write-back elfuse-write-back)
+             (elfuse--set-option 'write-back-size elfuse-write-back-size)
+             (elfuse--set-option 'write-back-age elfuse-write-back-age)
+             (elfuse--set-option 'memory-max-size elfuse-memory-max-size)
+             (elfuse--set-option 'max-deferred elfuse-max-deferred)
+             (elfuse--set-option 'log-level elfuse-log-level)
+             (setq mount (elfuse--mount abspath elfuse-fuse-threads options
+                                        (or handlers elfuse--handlers)))
+             (if mount
+                 (progn
+                   (push (list abspath mount handlers) elfuse--mounts)
+                   (add-hook 'kill-emacs-hook 'elfuse-stop))
+               (unless elfuse--mounts
+                 (elfuse--stop-loop)))
+             mount)))))
+
+(defun elfuse-set-log-level (level)
+  "Set `elfuse-log-level' to LEVEL, running mounts included."
+  (interactive
+   (list (intern (completing-read "Elfuse log level: "
+                                  '("error" "warn" "info" "debug" "nil") nil t))))
+  (setq elfuse-log-level level)
+  (elfuse--set-option 'log-level level))
+
+(defun elfuse-stop (&optional mountpath)
+  "Stop Elfuse at MOUNTPATH, or everywhere if MOUNTPATH is nil."
+  (interactive
+   (list (if (cdr elfuse--mounts)
+             (completing-read "Elfuse mount path: " elfuse--mounts nil t)
+           (caar elfuse--mounts))))
+  (dolist (entry (elfuse--mounts mountpath))
+    (elfuse--stop (nth 1 entry))
+    (setq elfuse--mounts (delq entry elfuse--mounts)))
+  (unless elfuse--mounts
+    (elfuse--stop-loop)
+    (remove-hook 'kill-emacs-hook 'elfuse-stop)))
+
+(defun elfuse-route (prefix handlers &optional mountpath)
+  "Send requests for PREFIX, e.g. \"/org\", and paths below it to HANDLERS.
+HANDLERS is an alist of ops and functions like the one
+`elfuse-start' takes, the functions see paths relative to PREFIX
+\(i.e. \"/\" for PREFIX itself).  The longest routed prefix of a
+path wins.  Directories above routes list them without calling
+into Emacs, paths nothing is routed to do not exist.  MOUNTPATH
+picks the mount, nil means all of them."
+  (elfuse--each-mount mountpath #'elfuse--route prefix handlers))
+
+(defun elfuse-unroute (prefix &optional mountpath)
+  "Forget the handlers `elfuse-route' set for PREFIX.
+MOUNTPATH picks the mount, nil means all of them."
+  (elfuse--each-mount mountpath #'elfuse--unroute prefix))
+
+(defun elfuse-invalidate-attr (path &optional mountpath)
+  "Forget the cached attributes of PATH, e.g. \"/hello\".
+This includes PATH being cached as missing.  MOUNTPATH picks the
+mount, nil means all of them."
+  (elfuse--each-mount mountpath #'elfuse--invalidate-attr path))
+
+(defun elfuse-invalidate-content (path &optional mountpath)
+  "Forget the cached contents of PATH, or of all files below it.
+MOUNTPATH picks the mount, nil means all of them."
+  (elfuse--each-mount mountpath #'elfuse--invalidate-content path))
+
+(defun elfuse-invalidate-all (&optional mountpath)
+  "Forget everything Elfuse has cached about MOUNTPATH, or all mounts."
+  (elfuse--each-mount mountpath #'elfuse--invalidate-all))
+
+(defun elfuse-stats (&optional mountpath)
+  "Return request statistics of the mount at MOUNTPATH as a plist.
+MOUNTPATH defaults to the mount started last.  Each request type
+that reached Emacs, e.g. :getattr or :read, maps to a plist of
+:count, :errors (replies with an errno), :bytes (read or written)
+and :queue-wait, :lisp and :total latencies.  Latencies are plists
+of :sum-ns, their sum in nanoseconds, and :buckets, a vector whose
+Ith element counts latencies of 2^I to 2^(I+1) microseconds.
+Requests answered from Elfuse caches are not counted."
+  (let ((entry (car (elfuse--mounts mountpath))))
+    (and entry (elfuse--stats (nth 1 entry)))))
+
+(defun elfuse-reset-stats (&optional mountpath)
+  "Reset `elfuse-stats' of MOUNTPATH, or of all mounts."
+  (interactive)
+  (elfuse--each-mount mountpath #'elfuse--reset-stats))
+
+(defun elfuse-trace-start (file &optional mountpath)
+  "Record requests arriving at MOUNTPATH to FILE, a binary trace.
+MOUNTPATH defaults to the mount started last.  Operations, paths,
+offsets, sizes, pids and times are recorded, not file contents.
+Replay the trace with the elfuse-replay program."
+  (interactive "FElfuse trace file: ")
+  (let ((entry (car (elfuse--mounts mountpath))))
+    (and entry (elfuse--trace (nth 1 entry) (expand-file-name file)))))
+
+(defun elfuse-trace-stop (&optional mountpath)
+  "Stop recording requests arriving at MOUNTPATH, or at all mounts."
   (interactive)
-  (elfuse--stop)
-  (remove-hook 'kill-emacs-hook 'elfuse--stop))
+  (elfuse--each-mount mountpath #'elfuse--trace nil))
+
+(defun elfuse-loopback-bench (workload path &optional count threads size handlers)
+  "Time COUNT requests of WORKLOAD to PATH without the kernel.
+A loopback mount of HANDLERS (see `elfuse-start') is started, and
+THREADS threads (4 by default) make the requests through the same
+FUSE callbacks as the kernel would, while this Emacs answers them.
+WORKLOAD is one of `getattr', `readdir' (listing PATH to the end),
+`read' and `write' (going through PATH SIZE bytes at a time, 4096
+by default).  COUNT defaults to 10000.  Return a plist of
+:requests, :errors, :bytes (entries for `readdir'), :seconds and
+:p50-ns, :p99-ns and :max-ns latencies."
+  (let* ((mountpath (make-temp-file "elfuse-loopback" t))
+         (mount (elfuse-start mountpath '(:loopback t) handlers))
+         (result nil))
+    (unwind-protect
+        (when (and mount
+                   (elfuse--loopback-start mount workload path (or count 10000)
+                                           (or threads 4) (or size 4096)))
+          (while (not (setq result (elfuse--loopback-result mount)))
+            (accept-process-output nil elfuse-time-between-checks)))
+      (when mount
+        (elfuse-stop mountpath))
+      (delete-directory mountpath))
+    result))
+
+(defun elfuse--memory-mount (mountpath)
+  "The mount at MOUNTPATH, or the one started last, nil if none."
+  (nth 1 (car (elfuse--mounts mountpath))))
+
+(defun elfuse-memory-put (path contents &optional mountpath)
+  "Set the contents of the file PATH of a memory mount to CONTENTS.
+Mounts started with the :memory option, e.g. (elfuse-start \"mnt\"
+'(:memory t)), serve files from memory without calling any
+handler.  Missing parent directories of PATH are created, CONTENTS
+nil makes PATH a directory.  MOUNTPATH defaults to the mount
+started last."
+  (let ((mount (elfuse--memory-mount mountpath)))
+    (and mount (elfuse--memory-put mount path contents))))
+
+(defun elfuse-memory-get (path &optional mountpath)
+  "Return the contents of the file PATH of a memory mount, nil if none.
+The contents are a unibyte string, see `elfuse-memory-put'."
+  (let ((mount (elfuse--memory-mount mountpath)))
+    (and mount (elfuse--memory-get mount path))))
+
+(defun elfuse-memory-list (path &optional mountpath)
+  "Return the entries of the directory PATH of a memory mount.
+A vector of (NAME TYPE SIZE) lists, TYPE being `file' or `dir'."
+  (let ((mount (elfuse--memory-mount mountpath)))
+    (and mount (elfuse--memory-list mount path))))
+
+(defun elfuse-memory-delete (path &optional mountpath)
+  "Remove PATH, and everything below it, from a memory mount."
+  (let ((mount (elfuse--memory-mount mountpath)))
+    (and mount (elfuse--memory-delete mount path))))
+
+(defun elfuse-notify-changed (path &optional mountpath)
+  "Tell the kernel the attributes or contents of PATH changed.
+Also announces PATH coming into existence.  Elfuse's own cached
+attributes are forgotten right away, the kernel ones shortly
+after, so that long `elfuse-mount-options' timeouts stay
+coherent.  MOUNTPATH picks the mount, nil means all of them.
+Return nil if Elfuse is not running."
+  (elfuse--each-mount mountpath #'elfuse--notify-changed path))
+
+(defun elfuse-notify-deleted (path &optional mountpath)
+  "Tell the kernel PATH, and anything below it, no longer exists.
+MOUNTPATH picks the mount, nil means all of them.  Return nil if
+Elfuse is not running."
+  (elfuse--each-mount mountpath #'elfuse--notify-deleted path))
+
+(defun elfuse-defer ()
+  "Leave the request the running handler was called for unanswered.
+Return a token to answer it with later, by `elfuse-reply' or
+`elfuse-reply-error', e.g. from a process sentinel or a timer.
+The handler should return the token, whatever it returns is
+ignored.  Emacs and the mount go on answering other requests
+meanwhile, until the deferred one is answered or its mount stops.
+Return nil outside of handlers, or if `elfuse-max-deferred'
+requests of the mount are deferred already: the handler has to
+answer right away then."
+  (elfuse--defer))
+
+(defun elfuse-reply (token result)
+  "Answer the request deferred with TOKEN by RESULT.
+RESULT is what the handler would have returned, e.g. a string for
+the read op.  Return nil if the request is no longer waiting,
+i.e. it was answered already or its mount stopped."
+  (elfuse--reply token result))
+
+(defun elfuse-reply-error (token errno)
+  "Fail the request deferred with TOKEN with ERRNO, e.g. `elfuse-ENOENT'.
+This is what signalling `elfuse-op-error' does for handlers that
+answer right away.  Return nil if the request is no longer
+waiting."
+  (elfuse--reply-error token errno))
 
 (define-error 'elfuse-op-error "Elfuse operation error")
 
 (defmacro elfuse-define-op (opname arglist &rest body)
   "Define a Fuse operation OPNAME handler.
-Apart from defining the function required by Elfuse the macro
-also checks that the OPNAME is a supported Fuse operation and
-there's a correct number of arguments in the ARGLIST. A list of
-correct ops is defined in the `elfuse--supported-ops-alist'
-variable.
+Apart from defining and registering the function required by
+Elfuse the macro also checks that the OPNAME is a supported Fuse
+operation and there's a correct number of arguments in the
+ARGLIST. A list of correct ops is defined in the
+`elfuse--supported-ops-alist' variable.
+
+Ops without a registered handler fail with ENOSYS without
+calling into Emacs at all.  Handlers apply to every mount started
+without a handler alist of its own, see `elfuse-start'.
 
 Argument ARGLIST is a list of operation arguments.
 
@@ -86,18 +419,89 @@ the operation."
          `(error "Operation '%s' requires %d arguments"
                  ,(symbol-name opname)
                  ,(alist-get opname elfuse--supported-ops-alist)))
-        (t `(defun ,(intern (concat "elfuse--" (symbol-name opname) "-op"))
-                ,arglist
-              ,@body))))
+        (t (let ((fname (intern (concat "elfuse--" (symbol-name opname) "-op"))))
+             `(progn
+                (defun ,fname ,arglist
+                  ,@body)
+                ;; Ops without a handler never reach Emacs
+                (elfuse--set-handler ',opname ',fname))))))
+
+(defun elfuse--set-handler (opname function)
+  "Make FUNCTION the default OPNAME handler, running mounts included."
+  (setf (alist-get opname elfuse--handlers) function)
+  (dolist (entry elfuse--mounts)
+    (unless (nth 2 entry)
+      (elfuse--register-op (nth 1 entry) opname function))))
+
+(defun elfuse--mounts (mountpath)
+  "Entries of `elfuse--mounts' for MOUNTPATH, all of them if nil."
+  (if mountpath
+      (let ((entry (assoc (file-truename mountpath) elfuse--mounts)))
+        (and entry (list entry)))
+    elfuse--mounts))
+
+(defun elfuse--each-mount (mountpath function &rest args)
+  "Call FUNCTION with the mount at MOUNTPATH (all if nil) and ARGS.
+Return non-nil if any call did."
+  (let ((result nil))
+    (dolist (entry (elfuse--mounts mountpath) result)
+      (when (apply function (nth 1 entry) args)
+        (setq result t)))))
 
 (defun elfuse--start-loop ()
-  (setq elfuse--check-timer
-        (run-at-time nil elfuse-time-between-checks 'elfuse--on-timer)))
+  (elfuse--stop-loop)
+  (setq elfuse--wakeup-process
+        (make-pipe-process :name "elfuse-wakeup"
+                           :buffer nil
+                           :coding 'binary
+                           :noquery t
+                           :filter #'elfuse--on-wakeup))
+  (unless (elfuse--set-wakeup-channel elfuse--wakeup-process)
+    (delete-process elfuse--wakeup-process)
+    (setq elfuse--wakeup-process nil)
+    (setq elfuse--check-timer
+          (run-at-time nil elfuse-time-between-checks 'elfuse--on-timer))))
+
+(defun elfuse--stop-loop ()
+  (when elfuse--wakeup-process
+    (delete-process elfuse--wakeup-process)
+    (setq elfuse--wakeup-process nil))
+  (when elfuse--check-timer
+    (cancel-timer elfuse--check-timer)
+    (setq elfuse--check-timer nil))
+  (when elfuse--drain-timer
+    (cancel-timer elfuse--drain-timer)
+    (setq elfuse--drain-timer nil)))
+
+(defun elfuse--drain ()
+  "Answer queued requests, come back right away if some are left.
+Return the number of requests still queued, nil if Elfuse is not
+running."
+  (setq elfuse--drain-timer nil)
+  (let ((queued (elfuse--check-ops elfuse-check-ops-budget)))
+    (when (and queued (> queued 0) (not elfuse--drain-timer))
+      (setq elfuse--drain-timer (run-at-time 0 nil #'elfuse--drain)))
+    queued))
+
+(defun elfuse--on-wakeup (_process _string)
+  (elfuse--drain))
 
 (defun elfuse--on-timer ()
-  (unless (elfuse--check-ops)
-    (cancel-timer timer)
-    (setq elfuse--check-timer nil)))
+  (unless (elfuse--drain)
+    (elfuse--stop-loop)))
+
+(defun elfuse--mount-options (options)
+  "Expand the :profile of an OPTIONS plist, explicit options win."
+  (let ((profile (plist-get options :profile))
+        (expanded nil))
+    (when (and profile (not (assq profile elfuse-mount-profiles)))
+      (error "Unknown Elfuse mount profile '%s'" profile))
+    (seq-doseq (source (list (cdr (assq profile elfuse-mount-profiles)) options))
+      (while source
+        (unless (eq (car source) :profile)
+          (setq expanded (plist-put expanded (car source) (cadr source))))
+        (setq source (cddr source))))
+    expanded))
 
 (defun elfuse--dir-mountable-p (path)
   (and (file-exists-p path)
@@ -0,0 +1,82 @@
+;; This file is part of Elfuse.
+
+;; Elfuse is free software: you can redistribute it and/or modify
+;; it under the terms of the GNU General Public License as published by
+;; the Free Software Foundation, either version 3 of the License, or
+;; (at your option) any later version.
+
+;; Elfuse is distributed in the hope that it will be useful,
+;; but WITHOUT ANY WARRANTY; without even the implied warranty of
+;; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+;; GNU General Public License for more details.
+
+;; You should have received a copy of the GNU General Public License
+;; along with Elfuse.  If not, see <http://www.gnu.org/licenses/>.
+
+(require 'elfuse)
+
+
+;; Files filled in by running a program each time, answered from process
+;; sentinels with `elfuse-reply' so that Emacs stays responsive meanwhile
+
+(defvar commands--programs
+  '(("/date" "date")
+    ("/uptime" "uptime")
+    ("/uname" "uname" "-a")))
+
+(defun commands--run (path callback)
+  "Run the program behind PATH, then call CALLBACK with its output.
+The output is nil if the program failed."
+  (let ((buffer (generate-new-buffer " *elfuse-commands*")))
+    (make-process :name "elfuse-commands"
+                  :buffer buffer
+                  :command (cdr (assoc path commands--programs))
+                  :coding 'binary
+                  :noquery t
+                  :sentinel
+                  (lambda (process _event)
+                    (unless (process-live-p process)
+                      (let ((output (with-current-buffer buffer (buffer-string))))
+                        (kill-buffer buffer)
+                        (funcall callback (and (zerop (process-exit-status process))
+                                               output))))))))
+
+(defun commands--defer (path function)
+  "Defer the request for PATH, answer it with FUNCTION of the output."
+  (let ((token (elfuse-defer)))
+    ;; Too many requests wait for programs already
+    (unless token
+      (signal 'elfuse-op-error elfuse-EBUSY))
+    (commands--run path
+                   (lambda (output)
+                     (if output
+                         (elfuse-reply token (funcall function output))
+                       (elfuse-reply-error token elfuse-EIO))))
+    token))
+
+(elfuse-define-op readdir (path)
+  (unless (equal path "/")
+    (signal 'elfuse-op-error elfuse-ENOENT))
+  (vconcat ["." ".."] (mapcar (lambda (program) (substring (car program) 1))
+                              commands--programs)))
+
+(elfuse-define-op getattr (path)
+  (cond
+   ((equal path "/") (vector 'dir 0))
+   ((assoc path commands--programs)
+    (commands--defer path (lambda (output) (vector 'file (length output)))))
+   (t (signal 'elfuse-op-error elfuse-ENOENT))))
+
+(elfuse-define-op open (path)
+  (unless (assoc path commands--programs)
+    (signal 'elfuse-op-error elfuse-ENOENT))
+  t)
+
+(elfuse-define-op read (path offset size)
+  (unless (assoc path commands--programs)
+    (signal 'elfuse-op-error elfuse-ENOENT))
+  (commands--defer path
+                   (lambda (output)
+                     (substring output
+                                (min offset (length output))
+                                (min (+ offset size) (length output))))))
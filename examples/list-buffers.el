@@ -31,9 +31,12 @@
   (message "READDIR: %s" path)
   (unless (equal path "/")
     (signal 'elfuse-op-error elfuse-ENOENT))
+  ;; List buffer sizes right away, saving a getattr per buffer
   (seq-concatenate 'vector
                    '("." "..")
-                   (list-buffers--list-buffer-names)))
+                   (seq-map (lambda (name)
+                              (list name 'file (buffer-size (get-buffer name))))
+                            (list-buffers--list-buffer-names))))
 
 (elfuse-define-op getattr (path)
   (message "GETATTR: %s" path)
@@ -61,6 +64,19 @@
       (kill-buffer buf)
     (signal 'elfuse-op-error elfuse-ENOENT)))
 
+(defun list-buffers--notify-changed (&rest _)
+  (when (list-buffers--posix-filename-p (current-buffer))
+    (elfuse-notify-changed (concat "/" (buffer-name)))))
+
+(defun list-buffers--notify-deleted ()
+  (when (list-buffers--posix-filename-p (current-buffer))
+    (elfuse-notify-deleted (concat "/" (buffer-name)))))
+
+;; Keep the kernel caches coherent, so that the mount can run with long
+;; timeouts, e.g. (elfuse-start "mnt" '(:attr-timeout 10 :entry-timeout 10))
+(add-hook 'after-change-functions #'list-buffers--notify-changed)
+(add-hook 'kill-buffer-hook #'list-buffers--notify-deleted)
+
 (defun list-buffers--substring (str offset size)
   (cond
    ((> offset (seq-length str)) "")
@@ -0,0 +1,92 @@
+;; This file is part of Elfuse.
+
+;; Elfuse is free software: you can redistribute it and/or modify
+;; it under the terms of the GNU General Public License as published by
+;; the Free Software Foundation, either version 3 of the License, or
+;; (at your option) any later version.
+
+;; Elfuse is distributed in the hope that it will be useful,
+;; but WITHOUT ANY WARRANTY; without even the implied warranty of
+;; MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+;; GNU General Public License for more details.
+
+;; You should have received a copy of the GNU General Public License
+;; along with Elfuse.  If not, see <http://www.gnu.org/licenses/>.
+
+;; Two independent trees under one mount, each with handlers of its own.
+;; Do M-x routes-start instead of elfuse-start to mount them.
+
+(require 'seq)
+
+(require 'elfuse)
+
+(defvar routes--hello-files '(("hello" . "hellodata") ("other" . "otherdata")))
+
+(defun routes--substring (str offset size)
+  (seq-subseq str (min offset (length str)) (min (+ offset size) (length str))))
+
+;; /hello, the handlers see "/" and "/hello" for /hello and /hello/hello
+
+(defun routes--hello-readdir (path)
+  (unless (equal path "/")
+    (signal 'elfuse-op-error elfuse-ENOENT))
+  (vconcat '("." "..")
+           (seq-map (lambda (file) (list (car file) 'file (length (cdr file))))
+                    routes--hello-files)))
+
+(defun routes--hello-getattr (path)
+  (let ((file (assoc (substring path 1) routes--hello-files)))
+    (cond ((equal path "/") [dir 0])
+          (file (vector 'file (length (cdr file))))
+          (t (signal 'elfuse-op-error elfuse-ENOENT)))))
+
+(defun routes--hello-open (path)
+  (or (and (assoc (substring path 1) routes--hello-files) t)
+      (signal 'elfuse-op-error elfuse-ENOENT)))
+
+(defun routes--hello-read (path offset size)
+  (routes--substring (cdr (assoc (substring path 1) routes--hello-files)) offset size))
+
+;; /buffers, a read-only list of buffers
+
+(defun routes--buffer (path)
+  (or (get-buffer (substring path 1))
+      (signal 'elfuse-op-error elfuse-ENOENT)))
+
+(defun routes--buffers-readdir (path)
+  (unless (equal path "/")
+    (signal 'elfuse-op-error elfuse-ENOENT))
+  (vconcat '("." "..")
+           (delq nil
+                 (mapcar (lambda (buffer)
+                           (let ((name (buffer-name buffer)))
+                             (unless (string-match-p "[/ *]" name)
+                               (list name 'file (buffer-size buffer)))))
+                         (buffer-list)))))
+
+(defun routes--buffers-getattr (path)
+  (if (equal path "/")
+      [dir 0]
+    (vector 'file (buffer-size (routes--buffer path)))))
+
+(defun routes--buffers-open (path)
+  (and (routes--buffer path) t))
+
+(defun routes--buffers-read (path offset size)
+  (with-current-buffer (routes--buffer path)
+    (routes--substring (buffer-string) offset size)))
+
+(defun routes-start (mountpath)
+  "Mount /hello and /buffers on MOUNTPATH, the root lists them both."
+  (interactive "DElfuse mount path: ")
+  (elfuse-start mountpath nil
+                '(("/hello"
+                   (readdir . routes--hello-readdir)
+                   (getattr . routes--hello-getattr)
+                   (open . routes--hello-open)
+                   (read . routes--hello-read))
+                  ("/buffers"
+                   (readdir . routes--buffers-readdir)
+                   (getattr . routes--buffers-getattr)
+                   (open . routes--buffers-open)
+                   (read . routes--buffers-read)))))